@@ -24,26 +24,59 @@
 // array containing bit_sz bits will consume roughly bit_sz/8 bytes of
 // memory.
 
+// We need _GNU_SOURCE for sysconf, posix_memalign and madvise.
+#define _GNU_SOURCE
 
 #include "./bitarray.h"
+#include "./bittreap.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 //Added by isaac
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #define WORD_SIZE 64
 #define TRAIL(x) (((x) > 0) ? (UINT64_MAX << (WORD_SIZE-(x))) : 0)
 #define LEAD(x) (((x) > 0) ? (UINT64_MAX >> (WORD_SIZE-(x))) : 0)
 
 // ********************************* Types **********************************
 
+// Ways buf can be allocated.
+typedef enum {
+  // In the same allocation as the struct, one cache line past its start;
+  // used for arrays of up to INLINE_BITS bits.
+  STORAGE_INLINE,
+  // posix_memalign; used for small arrays.
+  STORAGE_HEAP,
+  // An anonymous mapping, backed by huge pages where the kernel allows.
+  STORAGE_MMAP,
+  // A file opened with bitarray_open_mmap, mapped over the front of an
+  // anonymous reservation that supplies the spare word.  Changes reach the
+  // file when it is shared and stay in memory when it is private.
+  STORAGE_FILE_SHARED,
+  STORAGE_FILE_PRIVATE,
+  // Carved out of a bitarray_arena_t along with the struct; both go back
+  // to the arena when it is reset.
+  STORAGE_ARENA,
+  // Supplied by the caller of bitarray_new_view, who keeps it.
+  STORAGE_VIEW,
+} bitarray_storage_t;
+
 // Concrete data type representing an array of bits.
 struct bitarray {
   // The number of bits represented by this bit array.
@@ -51,12 +84,80 @@ struct bitarray {
   size_t bit_sz;
 
   // The underlying memory buffer that stores the bits in
-  // packed form (8 per byte).
+  // packed form (8 per byte).  It starts on a cache line and spans
+  // buf_bytes, a whole number of cache lines with at least one spare word
+  // past the last bit, so any word holding a bit and the word after it can
+  // be read and written directly.  Short arrays keep it inline, right after
+  // the struct (see INLINE_BITS).  A buffer lent to bitarray_new_view need
+  // only be word-aligned and reach the spare word.
   char* buf;
+  size_t buf_bytes;
+
+  // Where buf came from, and so how to give it back.
+  bitarray_storage_t storage;
+
+  // Pending rotation of the whole array: logical bit i lives at physical
+  // bit (i + rotation) mod bit_sz of buf.  Whole-array rotations only adjust
+  // this; bitarray_normalize folds it back into buf.  Everything that works
+  // on buf a word at a time normalizes first.
+  size_t rotation;
+
+  // Storage chosen at creation.  With BITARRAY_BACKEND_TREAP, tree holds the
+  // bits whenever it is non-NULL and buf is stale; bitarray_normalize
+  // flattens the tree back into buf.
+  bitarray_backend_t backend;
+  bittreap_t* tree;
+
+  // Rank/select index built by bitarray_build_rank_index, or NULL.
+  struct rank_index* rank;
 };
 
 typedef uint64_t word;
 
+// Number of set bits before each superblock of RANK_SUPERBLOCK_BITS bits,
+// and before each block of RANK_BLOCK_BITS bits counting from the start of
+// its superblock.  Any change to the bits marks it stale; the next rank or
+// select query rebuilds it.
+struct rank_index {
+  size_t* superblocks;
+  uint16_t* blocks;
+  size_t superblock_count;
+  size_t block_count;
+  size_t total;
+  bool stale;
+};
+
+// A block of memory an arena hands out.  The header sits at the start, and
+// allocations follow it on cache-line boundaries.
+struct arena_chunk {
+  struct arena_chunk* next;
+  // Size of the chunk, header included.
+  size_t bytes;
+  // Bytes from the start of the chunk that may be nonzero.  Past this the
+  // chunk still holds the zeros fresh pages come with, so allocations there
+  // need no clearing.
+  size_t dirty;
+  // Whether the chunk came from mmap rather than posix_memalign.
+  bool mapped;
+};
+
+struct bitarray_arena {
+  // Size of each regular chunk, and the flags it was created with.
+  size_t chunk_bytes;
+  bitarray_arena_flags_t flags;
+
+  // Regular chunks, in the order they are filled.  Allocation bumps used
+  // through current and moves on to the next chunk when it runs out; a
+  // reset just sets current back to NULL.
+  struct arena_chunk* chunks;
+  struct arena_chunk* current;
+  size_t used;
+
+  // Chunks holding a single array too large for a regular one.  A reset
+  // returns them to the system.
+  struct arena_chunk* oversized;
+};
+
 // ******************** Prototypes for static functions *********************
 
 // Rotates a subarray left by an arbitrary number of bits.
@@ -116,6 +217,66 @@ static size_t modulo(const ssize_t n, const size_t m);
 // not matter.
 static char bitmask(const size_t bit_index);
 
+// Maps a logical bit index to its position in buf, accounting for a pending
+// whole-array rotation.
+static size_t bitarray_physical_index(const bitarray_t* const bitarray,
+                                      const size_t bit_index);
+
+// Rotates [bit_offset, bit_offset + bit_length) of buf left by
+// bit_left_amount with the selected engine, ignoring any pending rotation.
+static void bitarray_rotate_physical(bitarray_t* const bitarray,
+                                     const size_t bit_offset,
+                                     const size_t bit_length,
+                                     const size_t bit_left_amount);
+
+// Rotates a subarray of at most SMALL_ROTATE_BITS bits left without
+// reversals: one spanning at most two words is rotated as a 128-bit integer
+// in registers, anything else through a scratch buffer on the stack.
+static void bitarray_rotate_small(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const size_t bit_left_amount);
+
+// Sets every field of a new bit array of bit_sz bits but buf, buf_bytes and
+// storage: no pending rotation, no tree and no rank index.
+static void bitarray_init_fields(bitarray_t* const bitarray,
+                                 const size_t bit_sz,
+                                 const bitarray_backend_t backend);
+
+// Makes view a bit array over buf_bytes bytes at buf, which must be
+// word-aligned, keeping the last word back as the spare word.
+static void bitarray_init_view(bitarray_t* const view,
+                               char* const buf,
+                               const size_t buf_bytes);
+
+// Rotates [bit_offset, bit_offset + bit_length) of buf left by
+// bit_left_amount with the selected engine.  This is the kernel for
+// rotations with no useful alignment.
+static void bitarray_rotate_engine(bitarray_t* const bitarray,
+                                   const size_t bit_offset,
+                                   const size_t bit_length,
+                                   const size_t bit_left_amount);
+
+// Rotate kernels for arguments that are all multiples of 8, or all of 64:
+// whole bytes or words are moved with memcpy and memmove, never shifted.
+static void bitarray_rotate_bytes(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const size_t bit_left_amount);
+static void bitarray_rotate_words(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const size_t bit_left_amount);
+
+// Rotates a subarray of a treap-backed bit array left by bit_left_amount by
+// cutting and rejoining its tree, building the tree from buf first if there
+// is none.  Returns false if the tree could not be built or changed, in
+// which case the bit array is left as it was.
+static bool bitarray_rotate_treap(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const size_t bit_left_amount);
+
 static void bitarray_reverse_slow(bitarray_t* const bitarray,
                                   const size_t bit_offset,
                                   const size_t bit_length);
@@ -127,6 +288,72 @@ static void bitarray_rotate_slow(bitarray_t* const bitarray,
 
 static word bitarray_get_word(const bitarray_t* const bitarray, const size_t bit_index);
 
+// Returns true if bitarray_get_word and bitarray_set_word may be used at
+// bit_index, i.e. the word holding bit_index and the word after it both lie
+// inside the buffer.  Thanks to the spare word at the end of buf, this holds
+// for every bit_index below bit_sz.  Only asserts call it.
+#ifndef NDEBUG
+static bool bitarray_word_in_bounds(const bitarray_t* const bitarray, const size_t bit_index);
+#endif
+
+// Returns the size of buf for bit_sz bits: ceil(bit_sz/8) bytes plus a spare
+// word, rounded up to whole cache lines.
+static size_t bitarray_buf_bytes(const size_t bit_sz);
+
+// Allocates a zeroed, cache-line-aligned buffer for bit_sz bits and sets
+// buf, buf_bytes and storage to match.  Returns false if memory runs out.
+static bool bitarray_alloc_buf(bitarray_t* const bitarray, const size_t bit_sz);
+
+// Allocates a chunk of at least bytes bytes for an arena created with flags,
+// or returns NULL if memory runs out.
+static struct arena_chunk* arena_chunk_new(const size_t bytes,
+                                           const bitarray_arena_flags_t flags);
+
+// Returns a chunk to the system.
+static void arena_chunk_free(struct arena_chunk* const chunk);
+
+// Returns bytes zeroed bytes at offset in chunk, clearing only what an
+// earlier allocation may have written.
+static void* arena_chunk_take(struct arena_chunk* const chunk,
+                              const size_t offset,
+                              const size_t bytes);
+
+// Bump-allocates bytes zeroed, cache-line-aligned bytes (a multiple of
+// CACHE_LINE_BYTES) from arena, or returns NULL if memory runs out.
+static void* arena_alloc(bitarray_arena_t* const arena, const size_t bytes);
+
+// Releases buf, however it was allocated.
+static void bitarray_free_buf(bitarray_t* const bitarray);
+
+// Returns true if buf maps a file.
+static bool bitarray_is_mapped_file(const bitarray_t* const bitarray);
+
+// Passes advice to madvise for the pages holding bits
+// [bit_offset, bit_offset + bit_length) of a file-backed bit array.
+static void bitarray_advise(const bitarray_t* const bitarray,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const int advice);
+
+// Loads and stores the word_index th 64-bit word of the buffer.
+static word bitarray_load_word(const bitarray_t* const bitarray, const size_t word_index);
+static void bitarray_store_word(bitarray_t* const bitarray,
+                                const size_t word_index,
+                                const word a_word);
+
+// Returns the bit_count (1 to WORD_SIZE) bits starting at bit_index in the
+// low bits of a word, with bit_index in the least significant place.
+static word bitarray_get_bits(const bitarray_t* const bitarray,
+                              const size_t bit_index,
+                              const size_t bit_count);
+
+// Overwrites the bit_count (1 to WORD_SIZE) bits starting at bit_index with
+// the low bits of a_word, leaving every other bit alone.
+static void bitarray_set_bits(bitarray_t* const bitarray,
+                              const size_t bit_index,
+                              const size_t bit_count,
+                              const word a_word);
+
 void do_isaac_stuff(void);
 
 static void print_word(word a_word);
@@ -137,10 +364,59 @@ static void bitarray_set_word(const bitarray_t* const bitarray, const size_t bit
 
 static word reverse_word(word v);
 
+// Reverses a run of n words end to end: dst[i] = reverse_word(src[n - 1 - i]).
+// dst and src must not overlap.
+typedef void (*reverse_words_fn)(word* restrict dst,
+                                 const word* restrict src,
+                                 const size_t n);
+
+// Picks the fastest reverse_words kernel this CPU supports, installs it in
+// reverse_words and then runs it.  Only the first call lands here.
+static void reverse_words_resolve(word* restrict dst,
+                                  const word* restrict src,
+                                  const size_t n);
+
+// Installs the fastest reverse_words kernel this CPU supports.
+static void reverse_words_select(void);
+
 static void bitarray_reverse_fast(bitarray_t* const bitarray,
                                   const size_t bit_offset,
                                   const size_t bit_length);
 
+// Runs step_count steps of RANDFILL_LANES interleaved xoshiro256++
+// generators, writing RANDFILL_LANES words per step to dst: word
+// RANDFILL_LANES * i + lane is lane's i th output.  state holds the four
+// state words of every lane, state[r * RANDFILL_LANES + lane] being word r
+// of lane, and is advanced in place.
+typedef void (*randfill_fn)(word* restrict dst,
+                            const size_t step_count,
+                            word* restrict state);
+
+// Picks the fastest randfill kernel this CPU supports, installs it in
+// randfill_words and then runs it.  Only the first call lands here.
+static void randfill_words_resolve(word* restrict dst,
+                                   const size_t step_count,
+                                   word* restrict state);
+
+// Installs the fastest randfill kernel this CPU supports in randfill_words.
+static void randfill_words_select(void);
+
+// Arguments for randfill_blocks: fill byte_sz bytes of buf with the stream
+// seed selects.
+struct randfill_blocks {
+  char* buf;
+  size_t byte_sz;
+  word seed;
+};
+
+// Fills blocks [begin, end) of RANDFILL_BLOCK_BYTES bytes each.  Every block
+// seeds its own generators from its index, so blocks can be filled in any
+// order, on any thread, and still give the same bytes.
+static void randfill_blocks(void* const ctx, const size_t begin, const size_t end);
+
+// Returns the next output of the splitmix64 generator whose state is *x.
+static word splitmix64(word* const x);
+
 static bitarray_t* bitarray_newrand(const size_t bit_sz, const unsigned int seed);
 
 static void test_reverse(const unsigned int seed, const size_t bit_sz, const size_t bit_offset, const size_t bit_length);
@@ -152,35 +428,825 @@ static void bitarray_rotate_fast(bitarray_t* const bitarray,
                                  const size_t bit_length,
                                  const size_t bit_left_amount);
 
-static size_t bitarray_cmp(const bitarray_t* const first, const bitarray_t* const second);
+// Swaps the bit ranges [a_index, a_index + bit_length) and
+// [b_index, b_index + bit_length), which must not overlap and must satisfy
+// a_index < b_index.  Whole words are moved with bitarray_get_word and
+// bitarray_set_word; the ragged tail, shorter than a word, is moved with one
+// masked bitarray_get_bits and bitarray_set_bits per range.
+static void bitarray_swap_ranges(bitarray_t* const bitarray,
+                                 const size_t a_index,
+                                 const size_t b_index,
+                                 const size_t bit_length);
+
+// A loop body handed out by bitarray_parallel_for: processes items
+// [begin, end) of whatever ctx describes.
+typedef void (*range_fn)(void* const ctx, const size_t begin, const size_t end);
+
+// Runs fn over items [0, count), split into one contiguous chunk per thread.
+// Neighbouring items may share a buffer word, so the first item of every
+// chunk is held back and run on the calling thread once all chunks have
+// joined; every other item must only touch words no other item touches.
+static void bitarray_parallel_for(const size_t count, const range_fn fn, void* const ctx);
+
+// Returns true if a subarray of bit_length bits is worth splitting across
+// threads.
+static bool bitarray_use_threads(const size_t bit_length);
+
+// Arguments for bitarray_reverse_pairs.  Pair i swaps the word starting at
+// lp + i*WORD_SIZE with the word ending at rp - i*WORD_SIZE, reversing both.
+// With streaming set, both ends are prefetched prefetch_bits ahead of where
+// they are read.
+struct reverse_pairs {
+  bitarray_t* bitarray;
+  size_t lp;
+  size_t rp;
+  bool streaming;
+  size_t prefetch_bits;
+};
+
+// Reverses pairs [begin, end) described by ctx, a struct reverse_pairs.
+static void bitarray_reverse_pairs(void* const ctx, const size_t begin, const size_t end);
+
+// Arguments for bitarray_swap_words.  Word i swaps the word starting at
+// a_index + i*WORD_SIZE with the word starting at b_index + i*WORD_SIZE.
+struct swap_words {
+  bitarray_t* bitarray;
+  size_t a_index;
+  size_t b_index;
+};
+
+// Swaps words [begin, end) described by ctx, a struct swap_words.
+static void bitarray_swap_words(void* const ctx, const size_t begin, const size_t end);
+
+// Rotates a subarray left with the Gries-Mills block swap.  Every step swaps
+// the shorter of the two blocks into its final place, so each word of the
+// subarray is moved close to once instead of the twice that three reversals
+// cost.  Once the shorter block drops below a word, it is held in a register
+// while the longer one is shifted over it, as bitarray_rotate_through does.
+static void bitarray_rotate_blockswap(bitarray_t* const bitarray,
+                                      const size_t bit_offset,
+                                      const size_t bit_length,
+                                      const size_t bit_left_amount);
+
+// Rotates a subarray left with block swaps sized to the cache.  While both
+// blocks are longer than the cache block, the Gries-Mills steps of
+// bitarray_rotate_blockswap shrink the window; each swap streams its two
+// ranges through the cache once.  Then the shorter block is parked in a
+// scratch array that stays in L2, the longer one is moved over it in a
+// single pass, and the parked bits are written back.
+static void bitarray_rotate_blocked(bitarray_t* const bitarray,
+                                    const size_t bit_offset,
+                                    const size_t bit_length,
+                                    const size_t bit_left_amount);
+
+// Rotates a subarray left out of place: the shorter block is saved in
+// scratch, the longer one is moved over in one pass, and the saved bits are
+// written back at the other end.  scratch must hold WORD_SIZE bits more
+// than the shorter block.
+static void bitarray_rotate_through(bitarray_t* const bitarray,
+                                    const size_t bit_offset,
+                                    const size_t bit_length,
+                                    const size_t bit_left_amount,
+                                    bitarray_t* const scratch);
+
+// Returns the calling thread's scratch array, first replacing it with one of
+// bit_sz bits if it is smaller.  Returns NULL if that would take more than
+// scratch_limit bytes or memory runs out.
+static bitarray_t* thread_scratch_get(const size_t bit_sz);
+
+// Sets scratch_limit to its default.  Run once, through scratch_limit_once.
+static void scratch_limit_init(void);
+
+// Sets streaming_threshold to its default.  Run once, through
+// streaming_threshold_once.
+static void streaming_threshold_init(void);
+
+// Sets default_block_bytes.  Run once, through default_block_bytes_once.
+static void default_block_bytes_init(void);
+
+// A piece of the rearrangement composed by bitarray_rotate_batch: bit_length
+// bits that end up side by side, read from src_index onwards.
+struct batch_segment {
+  size_t src_index;
+  size_t bit_length;
+};
+
+// Rotations composed so far by bitarray_rotate_batch.  [lo, hi) is the region
+// they cover; it is to become the concatenation of segments, each read from
+// the region as it was before the first of them.  first_op indexes that first
+// rotation, so that the run can be replayed one rotation at a time if memory
+// runs out.
+struct rotation_batch {
+  size_t lo;
+  size_t hi;
+  struct batch_segment* segments;
+  size_t segment_count;
+  size_t capacity;
+  size_t first_op;
+};
+
+// Folds a left rotation of [bit_offset, bit_offset + bit_length) by
+// bit_left_amount (strictly between 0 and bit_length) into batch, widening
+// its region as needed.  Returns false if memory runs out, in which case
+// batch must be replayed.
+static bool batch_add(struct rotation_batch* const batch,
+                      const size_t bit_offset,
+                      const size_t bit_length,
+                      const size_t bit_left_amount);
+
+// Makes sure a segment of batch starts position bits into its region,
+// splitting a segment if necessary, and returns that segment's index.
+// Requires room for one more segment.
+static size_t batch_split(struct rotation_batch* const batch, const size_t position);
+
+// Reverses segments [begin, end) of batch.
+static void batch_reverse(struct rotation_batch* const batch,
+                          const size_t begin,
+                          const size_t end);
+
+// Joins neighbouring segments of batch whose sources are contiguous.
+static void batch_merge(struct rotation_batch* const batch);
+
+// Applies the rearrangement batch holds to bitarray and empties batch.  If
+// scratch memory cannot be found, ops[batch->first_op] through
+// ops[end_op - 1] are replayed with bitarray_rotate instead.
+static void batch_flush(bitarray_t* const bitarray,
+                        struct rotation_batch* const batch,
+                        const bitarray_rotation_t* const ops,
+                        const size_t end_op);
+
+// Copies bit_length bits of src starting at src_index into dst starting at
+// dst_index, ignoring any pending rotation.  src and dst may be the same bit
+// array with overlapping ranges, as for memmove.
+static void bitarray_copy_bits(bitarray_t* const dst,
+                               const size_t dst_index,
+                               const bitarray_t* const src,
+                               const size_t src_index,
+                               const size_t bit_length);
+
+// Sets bits [bit_offset, bit_offset + bit_length) of the physical layout to
+// value, ignoring any pending rotation.
+static void bitarray_fill_bits(bitarray_t* const bitarray,
+                               const size_t bit_offset,
+                               const size_t bit_length,
+                               const bool value);
+
+// Writes n words to dst, word i being the word starting at bit shift of
+// src[i].  Either dst lies below src or they do not overlap.  With streaming
+// set, dst is written with non-temporal stores where the CPU has them.
+typedef void (*copy_words_fn)(word* const dst,
+                              const word* const src,
+                              const size_t shift,
+                              const size_t n,
+                              const bool streaming);
+
+// Picks the fastest copy_words kernel this CPU supports, installs it in
+// copy_words and then runs it.  Only the first call lands here.
+static void copy_words_resolve(word* const dst,
+                               const word* const src,
+                               const size_t shift,
+                               const size_t n,
+                               const bool streaming);
+
+// Installs the fastest copy_words kernel this CPU supports.
+static void copy_words_select(void);
+
+// Like a copy_words kernel, but working from the last word down, for a dst
+// above an overlapping src.  shift must not be 0.
+static void copy_words_backward(word* const dst,
+                                const word* const src,
+                                const size_t shift,
+                                const size_t n);
+
+// Buffers for a streaming rotation of a file: three bit arrays of
+// window_bits bits plus two bytes of slack, so that a window can start
+// anywhere in its first byte.
+struct stream_windows {
+  int fd;
+  size_t block_bytes;
+  size_t window_bits;
+  bitarray_t* left;
+  bitarray_t* right;
+  bitarray_t* spare;
+};
+
+// Reads or writes byte_count bytes at byte_offset of a file, block_bytes at
+// a time.  Returns false on an I/O error or a short file.
+static bool stream_read(const int fd,
+                        char* const buf,
+                        const size_t byte_count,
+                        const size_t byte_offset,
+                        const size_t block_bytes);
+static bool stream_write(const int fd,
+                         const char* const buf,
+                         const size_t byte_count,
+                         const size_t byte_offset,
+                         const size_t block_bytes);
+
+// Reverses bits [bit_offset, bit_offset + bit_length) of the file in one
+// pass.  Windows are taken from both ends at once; each is reversed in
+// memory and written back at the other end.  Returns false on an I/O error.
+static bool stream_reverse(const struct stream_windows* const windows,
+                           const size_t bit_offset,
+                           const size_t bit_length);
+
+// Counts the set bits in n words.
+typedef size_t (*count_words_fn)(const word* const words, const size_t n);
+
+// Picks the fastest count_words kernel this CPU supports, installs it in
+// count_words and then runs it.  Only the first call lands here.
+static size_t count_words_resolve(const word* const words, const size_t n);
+
+// Installs the fastest count_words kernel this CPU supports.
+static void count_words_select(void);
+
+// Counts the set bits in [bit_offset, bit_offset + bit_length) of the
+// physical layout, ignoring any pending rotation.
+static size_t bitarray_count_physical(const bitarray_t* const bitarray,
+                                      const size_t bit_offset,
+                                      const size_t bit_length);
+
+// Marks the rank index, if there is one, out of date.  Everything that
+// changes bits calls this.
+static void bitarray_invalidate_rank(bitarray_t* const bitarray);
+
+// Fills in the counts of an allocated rank index from the (normalized) bits.
+static void rank_index_fill(bitarray_t* const bitarray);
+
+// Frees a rank index.
+static void rank_index_free(struct rank_index* const rank);
+
+// Returns the position of the k th (from 0) set bit of a_word, which must
+// have more than k set bits.
+static size_t select_in_word(word a_word, size_t k);
+
+// Writes op applied to n words of each source to dst.  Source word i is
+// taken from bit a_shift of a[i] onward (and likewise for b), so a nonzero
+// shift reads one word past the last one it uses; b is NULL for
+// BITARRAY_OP_NOT.  With streaming set, dst is written with non-temporal
+// stores where the CPU has them.
+typedef void (*op_words_fn)(word* const dst,
+                            const word* const a,
+                            const size_t a_shift,
+                            const word* const b,
+                            const size_t b_shift,
+                            const size_t n,
+                            const bitarray_op_t op,
+                            const bool streaming);
+
+// Picks the fastest op_words kernel this CPU supports, installs it in
+// op_words and then runs it.  Only the first call lands here.
+static void op_words_resolve(word* const dst,
+                             const word* const a,
+                             const size_t a_shift,
+                             const word* const b,
+                             const size_t b_shift,
+                             const size_t n,
+                             const bitarray_op_t op,
+                             const bool streaming);
+
+// Installs the fastest op_words kernel this CPU supports.
+static void op_words_select(void);
+
+// Returns op applied to two words.
+static inline word combine_words(const bitarray_op_t op, const word a_word, const word b_word);
+
+// Returns the word starting at bit shift of words[i].
+static inline word shifted_word(const word* const words, const size_t i, const size_t shift);
+
+// Arguments for op_word_blocks: the whole words of a bitarray_op_range, cut
+// into blocks of OP_BLOCK_WORDS words.
+struct op_blocks {
+  word* dst;
+  const word* a;
+  size_t a_shift;
+  const word* b;
+  size_t b_shift;
+  size_t word_count;
+  bitarray_op_t op;
+  bool streaming;
+};
+
+// Runs op_words over blocks [begin, end) of an op_blocks.
+static void op_word_blocks(void* const ctx, const size_t begin, const size_t end);
+
+// Return the index of the first (or last) of n words that differs from skip,
+// or n if every word equals skip.
+typedef size_t (*scan_words_fn)(const word* const words, const size_t n, const word skip);
+
+// Installs the fastest scan_words kernels this CPU supports.
+static void scan_words_select(void);
+
+// Picks the scan_words kernels on first use, then runs the chosen one.
+static size_t scan_words_forward_resolve(const word* const words,
+                                         const size_t n,
+                                         const word skip);
+static size_t scan_words_backward_resolve(const word* const words,
+                                          const size_t n,
+                                          const word skip);
+
+// Returns the index of the first bit equal to value in [bit_index, end) of
+// a normalized bit array, or end if there is none.
+static size_t bitarray_find_next(const bitarray_t* const bitarray,
+                                 const size_t bit_index,
+                                 const size_t end,
+                                 const bool value);
+
+// Returns the first i below n for which a[i] differs from the word starting
+// at bit b_shift of b[i], or n if there is none.  A nonzero b_shift reads
+// one word past b[n - 1].
+typedef size_t (*mismatch_words_fn)(const word* const a,
+                                    const word* const b,
+                                    const size_t b_shift,
+                                    const size_t n);
+
+// Picks the fastest mismatch_words kernel this CPU supports, installs it in
+// mismatch_words and then runs it.  Only the first call lands here.
+static size_t mismatch_words_resolve(const word* const a,
+                                     const word* const b,
+                                     const size_t b_shift,
+                                     const size_t n);
+
+// Installs the fastest mismatch_words kernel this CPU supports.
+static void mismatch_words_select(void);
+
+// Rotates bits [offsets[i], offsets[i] + lengths[i]) of words[i] left by
+// lefts[i], which is below lengths[i], for every i below n.
+typedef void (*bundle_rotate_fn)(word* const words,
+                                 const size_t n,
+                                 const size_t* const offsets,
+                                 const size_t* const lengths,
+                                 const size_t* const lefts);
+
+// Reverses bits [offsets[i], offsets[i] + lengths[i]) of words[i] for every i
+// below n.
+typedef void (*bundle_reverse_fn)(word* const words,
+                                  const size_t n,
+                                  const size_t* const offsets,
+                                  const size_t* const lengths);
+
+// Pick the fastest bundle kernels this CPU supports, install them in
+// bundle_rotate_words and bundle_reverse_words and then run one.  Only the
+// first call lands here.
+static void bundle_rotate_resolve(word* const words,
+                                  const size_t n,
+                                  const size_t* const offsets,
+                                  const size_t* const lengths,
+                                  const size_t* const lefts);
+static void bundle_reverse_resolve(word* const words,
+                                   const size_t n,
+                                   const size_t* const offsets,
+                                   const size_t* const lengths);
+
+// Installs the fastest bundle kernels this CPU supports.
+static void bundle_select(void);
+
+// Returns modulo(-bit_right_amount, bit_length), or 0 when bit_length is 0,
+// without dividing when the amount is shorter than the subarray.
+static inline size_t bundle_left_amount(const ssize_t bit_right_amount,
+                                        const size_t bit_length);
+
+// ******************************** Globals *********************************
+
+// The engine bitarray_rotate dispatches to.
+static bitarray_rotate_engine_t rotate_engine = BITARRAY_ROTATE_REVERSAL;
+
+// How finely the offset, length and amount of a rotation are aligned.
+enum rotate_alignment {
+  ROTATE_ALIGN_BIT,
+  ROTATE_ALIGN_BYTE,
+  ROTATE_ALIGN_WORD,
+  ROTATE_ALIGN_COUNT
+};
+
+// The kernel bitarray_rotate_physical uses for each alignment class.
+static void (* const rotate_kernels[ROTATE_ALIGN_COUNT])(bitarray_t* const bitarray,
+                                                         const size_t bit_offset,
+                                                         const size_t bit_length,
+                                                         const size_t bit_left_amount) = {
+  [ROTATE_ALIGN_BIT] = bitarray_rotate_engine,
+  [ROTATE_ALIGN_BYTE] = bitarray_rotate_bytes,
+  [ROTATE_ALIGN_WORD] = bitarray_rotate_words,
+};
+
+// Bytes of stack the aligned rotate kernels use to stage data.
+#define ALIGNED_SCRATCH_BYTES 16384
+
+// The reverse_words kernel in use; set by reverse_words_resolve.
+static reverse_words_fn reverse_words = reverse_words_resolve;
+static const char* reverse_words_name = NULL;
+
+// The randfill kernel in use; set by randfill_words_resolve.
+static randfill_fn randfill_words = randfill_words_resolve;
+
+// The op_words kernel in use; set by op_words_resolve.
+static op_words_fn op_words = op_words_resolve;
+static const char* op_words_name = NULL;
+
+// Words per item handed to bitarray_parallel_for by bitarray_op_range.
+#define OP_BLOCK_WORDS 4096
+
+// The mismatch_words kernel in use; set by mismatch_words_resolve.
+static mismatch_words_fn mismatch_words = mismatch_words_resolve;
+static const char* mismatch_words_name = NULL;
+
+// The copy_words kernel in use; set by copy_words_resolve.
+static copy_words_fn copy_words = copy_words_resolve;
+static const char* copy_words_name = NULL;
+
+// The scan_words kernels in use; set by scan_words_select.
+static scan_words_fn scan_words_forward = scan_words_forward_resolve;
+static scan_words_fn scan_words_backward = scan_words_backward_resolve;
+
+// The bundle kernels in use; set by bundle_select.
+static bundle_rotate_fn bundle_rotate_words = bundle_rotate_resolve;
+static bundle_reverse_fn bundle_reverse_words = bundle_reverse_resolve;
+static const char* bundle_kernel_name = NULL;
+
+// Items whose per-item arguments the bitarray_bundle_* functions gather on
+// the stack at a time.
+#define BUNDLE_BLOCK_ITEMS 256
+
+// bundle_mod_magic[d] = 2^64 / d rounded up, for 1 <= d <= WORD_SIZE.  For
+// any x below 2^58, x mod d is then the high word of (bundle_mod_magic[d] *
+// x, taken mod 2^64) * d, which spares bundle_left_amount a division per
+// item.
+#define BUNDLE_MAGIC(d) (UINT64_MAX / (d) + 1)
+#define BUNDLE_MAGIC8(d) BUNDLE_MAGIC(d), BUNDLE_MAGIC(d + 1), BUNDLE_MAGIC(d + 2), \
+  BUNDLE_MAGIC(d + 3), BUNDLE_MAGIC(d + 4), BUNDLE_MAGIC(d + 5), BUNDLE_MAGIC(d + 6), \
+  BUNDLE_MAGIC(d + 7)
+static const word bundle_mod_magic[WORD_SIZE + 1] = {
+  0, BUNDLE_MAGIC8(1), BUNDLE_MAGIC8(9), BUNDLE_MAGIC8(17), BUNDLE_MAGIC8(25),
+  BUNDLE_MAGIC8(33), BUNDLE_MAGIC8(41), BUNDLE_MAGIC8(49), BUNDLE_MAGIC8(57),
+};
+
+// The count_words kernel in use; set by count_words_resolve.
+static count_words_fn count_words = count_words_resolve;
+static const char* count_words_name = NULL;
+
+// Bits covered by each superblock and block of a rank index.  Block counts
+// stay below RANK_SUPERBLOCK_BITS, so they fit in 16 bits.
+#define RANK_SUPERBLOCK_BITS 4096
+#define RANK_BLOCK_BITS 512
+
+// Generators bitarray_randfill_seeded runs side by side, and the bytes each
+// block of its output spans.
+#define RANDFILL_LANES 4
+#define RANDFILL_BLOCK_BYTES 16384
+
+// Number of words bitarray_reverse_fast hands to reverse_words at a time from
+// each end of the range; one AVX-512 register's worth.
+#define REVERSE_BLOCK_WORDS 8
+
+// Upper bound on bitarray_set_thread_count.
+#define MAX_THREADS 256
+
+// Number of threads rotations may use, and the subarray length (in bits)
+// below which they stay on the calling thread.
+static unsigned int thread_count = 1;
+static size_t parallel_threshold = (size_t) 1 << 24;
+
+// Reversals of at least streaming_threshold bits prefetch both of their
+// streams prefetch_distance bytes ahead and bypass the cache on stores.
+// It defaults to the size of the last-level cache, worked out once under
+// streaming_threshold_once by whichever thread needs it first.
+static size_t streaming_threshold = SIZE_MAX;
+static pthread_once_t streaming_threshold_once = PTHREAD_ONCE_INIT;
+static size_t prefetch_distance = 2048;
+
+// Reversal-engine rotations of at least scratch_threshold bits go through
+// the calling thread's thread_scratch, which may grow to scratch_limit bytes.
+// scratch_limit defaults to a sixteenth of physical memory, worked out once
+// under scratch_limit_once by whichever thread needs it first.
+static size_t scratch_threshold = (size_t) 1 << 20;
+static size_t scratch_limit = SIZE_MAX;
+static pthread_once_t scratch_limit_once = PTHREAD_ONCE_INIT;
+static __thread bitarray_t* thread_scratch = NULL;
+
+// Bytes of scratch bitarray_rotate_blocked parks a block in, or 0 for
+// default_block_bytes: half the L2 cache, worked out once under
+// default_block_bytes_once by whichever thread needs it first.
+static size_t rotate_block_bytes = 0;
+static size_t default_block_bytes = 0;
+static pthread_once_t default_block_bytes_once = PTHREAD_ONCE_INIT;
+
+// Scratch limit assumed when sysconf does not know the memory size.
+#define SCRATCH_DEFAULT_LIMIT_BYTES ((size_t) 64 << 20)
+
+// L2 size assumed when sysconf does not know it.
+#define BLOCKED_DEFAULT_L2_BYTES ((size_t) 256 << 10)
+
+// Cache size assumed when sysconf does not know the last-level cache's.
+#define STREAMING_DEFAULT_CACHE_BYTES ((size_t) 32 << 20)
+
+// Buffers of at least this many bytes are mapped rather than taken from the
+// heap, and offered to the kernel for transparent huge pages: a multi-GB
+// array otherwise spends much of a rotation missing the TLB.
+#define HUGEPAGE_THRESHOLD ((size_t) 1 << 21)
+
+// Defaults for bitarray_stream_options_t.
+#define STREAM_BLOCK_BYTES ((size_t) 1 << 20)
+#define STREAM_MEMORY_BUDGET ((size_t) 64 << 20)
+
+// Alignment and granularity of buf.
+#define CACHE_LINE_BYTES 64
+
+// Arrays of up to INLINE_BITS bits keep their bits and spare word in a
+// single cache line allocated along with the struct, which is padded to
+// INLINE_STRUCT_BYTES so that the line is aligned.
+#define INLINE_BYTES CACHE_LINE_BYTES
+#define INLINE_BITS ((INLINE_BYTES - sizeof(word)) * 8)
+#define INLINE_STRUCT_BYTES \
+  ((sizeof(struct bitarray) + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES)
+
+// Default chunk size of an arena, and the page size chunks are rounded up
+// to with BITARRAY_ARENA_HUGEPAGES.
+#define ARENA_CHUNK_BYTES ((size_t) 1 << 20)
+#define ARENA_HUGEPAGE_BYTES ((size_t) 1 << 21)
+
+// Space taken by the header at the start of every arena chunk.
+#define ARENA_CHUNK_HEADER_BYTES \
+  ((sizeof(struct arena_chunk) + CACHE_LINE_BYTES - 1) / CACHE_LINE_BYTES * CACHE_LINE_BYTES)
+
+// Subarrays of up to this many bits are rotated by bitarray_rotate_small.
+#define SMALL_ROTATE_BITS INLINE_BITS
+
+// Most segments bitarray_rotate_batch lets a composed run grow to before
+// applying it.  Folding in a rotation costs time linear in the segment
+// count.
+#define BATCH_MAX_SEGMENTS 4096
+
 // ******************************* Functions ********************************
 
 bitarray_t* bitarray_new(const size_t bit_sz) {
-  // Allocate an underlying buffer of ceil(bit_sz/8) bytes.
-  char* const buf = calloc(1, (bit_sz+7) / 8);
-  if (buf == NULL) {
+  return bitarray_new_backend(bit_sz, BITARRAY_BACKEND_PACKED);
+}
+
+bitarray_t* bitarray_new_backend(const size_t bit_sz, const bitarray_backend_t backend) {
+  bitarray_t* bitarray;
+  if (bit_sz <= INLINE_BITS) {
+    // Allocate the struct and its buffer together.
+    void* block;
+    if (posix_memalign(&block, CACHE_LINE_BYTES, INLINE_STRUCT_BYTES + INLINE_BYTES) != 0) {
+      return NULL;
+    }
+    bitarray = block;
+    bitarray->buf = (char*) block + INLINE_STRUCT_BYTES;
+    bitarray->buf_bytes = INLINE_BYTES;
+    bitarray->storage = STORAGE_INLINE;
+    memset(bitarray->buf, 0, INLINE_BYTES);
+  } else {
+    // Allocate space for the struct.
+    bitarray = malloc(sizeof(struct bitarray));
+    if (bitarray == NULL) {
+      return NULL;
+    }
+
+    // Allocate an underlying buffer of at least ceil(bit_sz/8) bytes.
+    if (!bitarray_alloc_buf(bitarray, bit_sz)) {
+      free(bitarray);
+      return NULL;
+    }
+  }
+
+  bitarray_init_fields(bitarray, bit_sz, backend);
+  if (backend == BITARRAY_BACKEND_TREAP && bit_sz > 0) {
+    bitarray->tree = bittreap_build(bitarray->buf, bit_sz);
+    if (bitarray->tree == NULL) {
+      bitarray_free(bitarray);
+      return NULL;
+    }
+  }
+  return bitarray;
+}
+
+bitarray_t* bitarray_open_mmap(const char* const path,
+                               const size_t bit_sz,
+                               const bitarray_mmap_flags_t flags) {
+  const bool writable = (flags & BITARRAY_MMAP_RDWR) != 0;
+  const size_t file_bytes = (bit_sz + 7) / 8;
+  const int fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0666);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // A writable file too short for the array is extended with zeros.
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      ((size_t) file_stat.st_size < file_bytes &&
+       (!writable || ftruncate(fd, (off_t) file_bytes) != 0))) {
+    close(fd);
     return NULL;
   }
 
-  // Allocate space for the struct.
   bitarray_t* const bitarray = malloc(sizeof(struct bitarray));
   if (bitarray == NULL) {
-    free(buf);
+    close(fd);
+    return NULL;
+  }
+
+  // Reserve whole pages for the bits and the spare word, then map the file
+  // over the front.  Touching a page wholly past the end of a file raises
+  // SIGBUS, so the spare word must come from the reservation instead.
+  const size_t page_bytes = (size_t) sysconf(_SC_PAGESIZE);
+  const size_t buf_bytes = (file_bytes + sizeof(word) + page_bytes - 1) / page_bytes * page_bytes;
+  char* const buf = mmap(NULL, buf_bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    close(fd);
+    free(bitarray);
     return NULL;
   }
+  if (file_bytes > 0 &&
+      mmap(buf, file_bytes, PROT_READ | PROT_WRITE,
+           (writable ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(buf, buf_bytes);
+    close(fd);
+    free(bitarray);
+    return NULL;
+  }
+  // The mapping keeps the file open.
+  close(fd);
 
   bitarray->buf = buf;
-  bitarray->bit_sz = bit_sz;
+  bitarray->buf_bytes = buf_bytes;
+  bitarray->storage = writable ? STORAGE_FILE_SHARED : STORAGE_FILE_PRIVATE;
+  bitarray_init_fields(bitarray, bit_sz, BITARRAY_BACKEND_PACKED);
   return bitarray;
 }
 
+bool bitarray_rotate_file(const char* const path,
+                          const size_t bit_offset,
+                          const size_t bit_length,
+                          const ssize_t bit_right_amount,
+                          const bitarray_stream_options_t* const options) {
+  const size_t block_bytes = (options != NULL && options->block_bytes > 0) ?
+                             options->block_bytes : STREAM_BLOCK_BYTES;
+  const size_t memory_budget = (options != NULL && options->memory_budget > 0) ?
+                               options->memory_budget : STREAM_MEMORY_BUDGET;
+
+  const int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size * 8 < bit_offset + bit_length) {
+    close(fd);
+    return false;
+  }
+  const size_t bit_left_amount = (bit_length == 0) ? 0 : modulo(-bit_right_amount, bit_length);
+  if (bit_left_amount == 0) {
+    close(fd);
+    return true;
+  }
+
+  bool ok = false;
+  const size_t first_byte = bit_offset / 8;
+  const size_t byte_count = (bit_offset + bit_length + 7) / 8 - first_byte;
+  if (byte_count <= memory_budget) {
+    // The subarray fits: one read, an in-memory rotation, one write.
+    bitarray_t* const window = bitarray_new(byte_count * 8);
+    if (window != NULL) {
+      ok = stream_read(fd, window->buf, byte_count, first_byte, block_bytes);
+      if (ok) {
+        bitarray_rotate_physical(window, bit_offset % 8, bit_length, bit_left_amount);
+        ok = stream_write(fd, window->buf, byte_count, first_byte, block_bytes);
+      }
+      bitarray_free(window);
+    }
+  } else {
+    // Three streaming reversal passes, each reading and writing the range
+    // once, with three windows sharing the memory budget.
+    size_t window_bytes = memory_budget / 3 / block_bytes * block_bytes;
+    if (window_bytes < block_bytes) {
+      window_bytes = block_bytes;
+    }
+    if (window_bytes < sizeof(word)) {
+      // stream_reverse needs windows of at least a word.
+      window_bytes = sizeof(word);
+    }
+    struct stream_windows windows = { fd, block_bytes, window_bytes * 8, NULL, NULL, NULL };
+    windows.left = bitarray_new(windows.window_bits + 16);
+    windows.right = bitarray_new(windows.window_bits + 16);
+    windows.spare = bitarray_new(windows.window_bits + 16);
+    if (windows.left != NULL && windows.right != NULL && windows.spare != NULL) {
+      ok = stream_reverse(&windows, bit_offset, bit_left_amount) &&
+           stream_reverse(&windows, bit_offset + bit_left_amount, bit_length - bit_left_amount) &&
+           stream_reverse(&windows, bit_offset, bit_length);
+    }
+    bitarray_free(windows.left);
+    bitarray_free(windows.right);
+    bitarray_free(windows.spare);
+  }
+
+  if (close(fd) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+bool bitarray_sync(bitarray_t* const bitarray) {
+  bitarray_normalize(bitarray);
+  if (bitarray->storage != STORAGE_FILE_SHARED || bitarray->bit_sz == 0) {
+    return true;
+  }
+  return msync(bitarray->buf, (bitarray->bit_sz + 7) / 8, MS_SYNC) == 0;
+}
+
 void bitarray_free(bitarray_t* const bitarray) {
   if (bitarray == NULL) {
     return;
   }
-  free(bitarray->buf);
-  bitarray->buf = NULL;
-  free(bitarray);
+  // A shared file must be left holding the bits in order.
+  if (bitarray->storage == STORAGE_FILE_SHARED) {
+    bitarray_normalize(bitarray);
+  }
+  bittreap_free(bitarray->tree);
+  bitarray->tree = NULL;
+  rank_index_free(bitarray->rank);
+  bitarray->rank = NULL;
+  bitarray_free_buf(bitarray);
+  if (bitarray->storage != STORAGE_ARENA) {
+    free(bitarray);
+  }
+}
+
+bitarray_t* bitarray_new_view(void* const buf, const size_t buf_bytes, const size_t bit_sz) {
+  assert((uintptr_t) buf % sizeof(word) == 0 && buf_bytes >= bitarray_view_bytes(bit_sz));
+  bitarray_t* const bitarray = malloc(sizeof(struct bitarray));
+  if (bitarray == NULL) {
+    return NULL;
+  }
+  bitarray_init_view(bitarray, buf, buf_bytes);
+  bitarray->bit_sz = bit_sz;
+  bitarray->storage = STORAGE_VIEW;
+  return bitarray;
+}
+
+size_t bitarray_view_bytes(const size_t bit_sz) {
+  // The words holding the bits, plus the spare word.
+  return ((bit_sz + WORD_SIZE - 1) / WORD_SIZE + 1) * sizeof(word);
+}
+
+bitarray_arena_t* bitarray_arena_new(const size_t chunk_bytes,
+                                     const bitarray_arena_flags_t flags) {
+  bitarray_arena_t* const arena = malloc(sizeof(struct bitarray_arena));
+  if (arena == NULL) {
+    return NULL;
+  }
+  size_t bytes = (chunk_bytes > 0) ? chunk_bytes : ARENA_CHUNK_BYTES;
+  if (bytes < ARENA_CHUNK_HEADER_BYTES + INLINE_STRUCT_BYTES + INLINE_BYTES) {
+    // Room for at least one short array.
+    bytes = ARENA_CHUNK_HEADER_BYTES + INLINE_STRUCT_BYTES + INLINE_BYTES;
+  }
+  const size_t page_bytes = (flags & BITARRAY_ARENA_HUGEPAGES) ? ARENA_HUGEPAGE_BYTES :
+                            CACHE_LINE_BYTES;
+  arena->chunk_bytes = (bytes + page_bytes - 1) / page_bytes * page_bytes;
+  arena->flags = flags;
+  arena->chunks = NULL;
+  arena->current = NULL;
+  arena->used = 0;
+  arena->oversized = NULL;
+  return arena;
+}
+
+bitarray_t* bitarray_new_in(bitarray_arena_t* const arena, const size_t bit_sz) {
+  // The struct and buffer are laid out as for an inline array, with the
+  // buffer a cache line past the struct and as long as the array needs.
+  const size_t buf_bytes = bitarray_buf_bytes(bit_sz);
+  char* const block = arena_alloc(arena, INLINE_STRUCT_BYTES + buf_bytes);
+  if (block == NULL) {
+    return NULL;
+  }
+  bitarray_t* const bitarray = (bitarray_t*) block;
+  bitarray_init_fields(bitarray, bit_sz, BITARRAY_BACKEND_PACKED);
+  bitarray->buf = block + INLINE_STRUCT_BYTES;
+  bitarray->buf_bytes = buf_bytes;
+  bitarray->storage = STORAGE_ARENA;
+  return bitarray;
+}
+
+void bitarray_arena_reset(bitarray_arena_t* const arena) {
+  while (arena->oversized != NULL) {
+    struct arena_chunk* const next = arena->oversized->next;
+    arena_chunk_free(arena->oversized);
+    arena->oversized = next;
+  }
+  arena->current = NULL;
+  arena->used = 0;
+}
+
+void bitarray_arena_free(bitarray_arena_t* const arena) {
+  if (arena == NULL) {
+    return;
+  }
+  bitarray_arena_reset(arena);
+  while (arena->chunks != NULL) {
+    struct arena_chunk* const next = arena->chunks->next;
+    arena_chunk_free(arena->chunks);
+    arena->chunks = next;
+  }
+  free(arena);
 }
 
 size_t bitarray_get_bit_sz(const bitarray_t* const bitarray) {
@@ -198,7 +1264,11 @@ bool bitarray_get(const bitarray_t* const bitarray, const size_t bit_index) {
   // get the byte; we then bitwise-and the byte with an appropriate mask
   // to produce either a zero byte (if the bit was 0) or a nonzero byte
   // (if it wasn't).  Finally, we convert that to a boolean.
-  return (bitarray->buf[bit_index / 8] & bitmask(bit_index)) ?
+  const size_t physical_index = bitarray_physical_index(bitarray, bit_index);
+  if (bitarray->tree != NULL) {
+    return bittreap_get(bitarray->tree, physical_index);
+  }
+  return (bitarray->buf[physical_index / 8] & bitmask(physical_index)) ?
          true : false;
 }
 
@@ -214,15 +1284,52 @@ void bitarray_set(bitarray_t* const bitarray,
   // get the byte; we then bitwise-and the byte with an appropriate mask
   // to clear out the bit we're about to set.  We bitwise-or the result
   // with a byte that has either a 1 or a 0 in the correct place.
-  bitarray->buf[bit_index / 8] =
-    (bitarray->buf[bit_index / 8] & ~bitmask(bit_index)) |
-    (value ? bitmask(bit_index) : 0);
+  bitarray_invalidate_rank(bitarray);
+  const size_t physical_index = bitarray_physical_index(bitarray, bit_index);
+  if (bitarray->tree != NULL) {
+    bittreap_set(bitarray->tree, physical_index, value);
+    return;
+  }
+  bitarray->buf[physical_index / 8] =
+    (bitarray->buf[physical_index / 8] & ~bitmask(physical_index)) |
+    (value ? bitmask(physical_index) : 0);
 }
 
-void bitarray_randfill(bitarray_t* const bitarray){
-  int32_t *ptr = (int32_t *)bitarray->buf;
-  for (int64_t i=0; i<bitarray->bit_sz/32 + 1; i++){
-    ptr[i] = rand();
+void bitarray_randfill(bitarray_t* const bitarray) {
+  // Seed from rand(), so that srand() still decides what gets filled in.
+  const word seed = ((word) rand() << 32) ^ (word) rand();
+  bitarray_randfill_seeded(bitarray, seed);
+}
+
+void bitarray_randfill_seeded(bitarray_t* const bitarray, const uint64_t seed) {
+  // Every bit is overwritten, so a pending rotation can simply be dropped.
+  bitarray_invalidate_rank(bitarray);
+  bitarray->rotation = 0;
+  bittreap_free(bitarray->tree);
+  bitarray->tree = NULL;
+
+  struct randfill_blocks ctx = { bitarray->buf, (bitarray->bit_sz + 7) / 8, seed };
+  // The bits of the last byte past the end are not the array's; in a buffer
+  // lent to bitarray_new_view they may be the caller's.
+  const char past_end = (bitarray->bit_sz % 8 != 0) ? bitarray->buf[ctx.byte_sz - 1] : 0;
+  const size_t block_count = (ctx.byte_sz + RANDFILL_BLOCK_BYTES - 1) / RANDFILL_BLOCK_BYTES;
+  if (bitarray_use_threads(bitarray->bit_sz)) {
+    // Pick the kernel up front rather than racing to from every thread.
+    randfill_words_select();
+    bitarray_parallel_for(block_count, randfill_blocks, &ctx);
+  } else {
+    randfill_blocks(&ctx, 0, block_count);
+  }
+  if (bitarray->bit_sz % 8 != 0) {
+    const char mask = (char) ((1 << (bitarray->bit_sz % 8)) - 1);
+    bitarray->buf[ctx.byte_sz - 1] = (char) ((bitarray->buf[ctx.byte_sz - 1] & mask) |
+                                             (past_end & ~mask));
+  }
+
+  if (bitarray->backend == BITARRAY_BACKEND_TREAP) {
+    // If the tree cannot be rebuilt, the bits stay in buf and the next
+    // rotation tries again.
+    bitarray->tree = bittreap_build(bitarray->buf, bitarray->bit_sz);
   }
 }
 
@@ -235,38 +1342,785 @@ void bitarray_rotate(bitarray_t* const bitarray,
   if (bit_length == 0) {
     return;
   }
+  bitarray_invalidate_rank(bitarray);
 
   // Convert a rotate left or right to a left rotate only, and eliminate
   // multiple full rotations.
   // bitarray_rotate_left(bitarray, bit_offset, bit_length,
   //                      modulo(-bit_right_amount, bit_length));
-  bitarray_rotate_fast(bitarray,
-                       bit_offset,
-                       bit_length,
-                       modulo(-bit_right_amount, bit_length));
-  bitarray_randfill(bitarray);
-}
+  const size_t bit_left_amount = modulo(-bit_right_amount, bit_length);
 
-static void bitarray_rotate_left(bitarray_t* const bitarray,
-                                 const size_t bit_offset,
-                                 const size_t bit_length,
-                                 const size_t bit_left_amount) {
-  for (size_t i = 0; i < bit_left_amount; i++) {
-    bitarray_rotate_left_one(bitarray, bit_offset, bit_length);
+  // Rotating the whole array only moves where it logically starts.
+  if (bit_length == bitarray->bit_sz) {
+    bitarray->rotation += bit_left_amount;
+    if (bitarray->rotation >= bitarray->bit_sz) {
+      bitarray->rotation -= bitarray->bit_sz;
+    }
+    return;
   }
-}
 
-static void bitarray_rotate_left_one(bitarray_t* const bitarray,
-                                     const size_t bit_offset,
-                                     const size_t bit_length) {
-  // Grab the first bit in the range, shift everything left by one, and
-  // then stick the first bit at the end.
-  const bool first_bit = bitarray_get(bitarray, bit_offset);
-  size_t i;
-  for (i = bit_offset; i + 1 < bit_offset + bit_length; i++) {
-    bitarray_set(bitarray, i, bitarray_get(bitarray, i + 1));
+  if (bitarray->backend == BITARRAY_BACKEND_TREAP &&
+      bitarray_rotate_treap(bitarray, bit_offset, bit_length, bit_left_amount)) {
+    return;
   }
-  bitarray_set(bitarray, i, first_bit);
+
+  bitarray_normalize(bitarray);
+  bitarray_rotate_physical(bitarray, bit_offset, bit_length, bit_left_amount);
+}
+
+void bitarray_rotate_with_scratch(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const ssize_t bit_right_amount,
+                                  void* const scratch,
+                                  const size_t scratch_bytes) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+
+  // Whole-array and treap rotations move no bits, so scratch cannot help.
+  if (bit_length == 0 || bit_length == bitarray->bit_sz ||
+      bitarray->backend == BITARRAY_BACKEND_TREAP ||
+      scratch_bytes < bitarray_rotate_scratch_bytes(bit_length, bit_right_amount)) {
+    bitarray_rotate(bitarray, bit_offset, bit_length, bit_right_amount);
+    return;
+  }
+  bitarray_invalidate_rank(bitarray);
+  bitarray_normalize(bitarray);
+
+  // View the word-aligned part of scratch as a bit array, keeping back a
+  // spare word as buf does.
+  const size_t slack = (sizeof(word) - (uintptr_t) scratch % sizeof(word)) % sizeof(word);
+  bitarray_t view;
+  bitarray_init_view(&view, (char*) scratch + slack, scratch_bytes - slack);
+  bitarray_rotate_through(bitarray, bit_offset, bit_length,
+                          modulo(-bit_right_amount, bit_length), &view);
+}
+
+size_t bitarray_rotate_scratch_bytes(const size_t bit_length,
+                                     const ssize_t bit_right_amount) {
+  if (bit_length == 0) {
+    return 0;
+  }
+  const size_t left = modulo(-bit_right_amount, bit_length);
+  const size_t saved = (left < bit_length - left) ? left : bit_length - left;
+  // Up to a word of lead-in to match the destination's bit position, the
+  // spare word, and slack for aligning scratch.
+  return ((saved + 2 * WORD_SIZE - 1) / WORD_SIZE + 1) * sizeof(word) + sizeof(word) - 1;
+}
+
+void bitarray_rotate_batch(bitarray_t* const bitarray,
+                           const bitarray_rotation_t* const ops,
+                           const size_t n) {
+  bitarray_invalidate_rank(bitarray);
+
+  // Treap rotations never touch the bits, so there is nothing to save.
+  if (bitarray->backend == BITARRAY_BACKEND_TREAP) {
+    for (size_t i = 0; i < n; i++) {
+      bitarray_rotate(bitarray, ops[i].bit_offset, ops[i].bit_length, ops[i].bit_right_amount);
+    }
+    return;
+  }
+
+  struct rotation_batch batch = { 0, 0, NULL, 0, 0, 0 };
+  for (size_t i = 0; i < n; i++) {
+    const bitarray_rotation_t* const op = &ops[i];
+    assert(op->bit_offset + op->bit_length <= bitarray->bit_sz);
+    if (op->bit_length == 0) {
+      continue;
+    }
+    const size_t bit_left_amount = modulo(-op->bit_right_amount, op->bit_length);
+    if (bit_left_amount == 0) {
+      continue;
+    }
+
+    // Whole-array rotations cost nothing on their own; composing them would
+    // only drag the entire array through the scratch copy.
+    if (op->bit_length == bitarray->bit_sz) {
+      batch_flush(bitarray, &batch, ops, i);
+      bitarray_rotate(bitarray, op->bit_offset, op->bit_length, op->bit_right_amount);
+      continue;
+    }
+
+    // Rotations that do not overlap the current run gain nothing from being
+    // composed with it.
+    if (batch.segment_count > 0 &&
+        (op->bit_offset >= batch.hi || op->bit_offset + op->bit_length <= batch.lo ||
+         batch.segment_count > BATCH_MAX_SEGMENTS)) {
+      batch_flush(bitarray, &batch, ops, i);
+    }
+    if (batch.segment_count == 0) {
+      batch.first_op = i;
+    }
+    if (!batch_add(&batch, op->bit_offset, op->bit_length, bit_left_amount)) {
+      for (size_t j = batch.first_op; j <= i; j++) {
+        bitarray_rotate(bitarray, ops[j].bit_offset, ops[j].bit_length, ops[j].bit_right_amount);
+      }
+      batch.segment_count = 0;
+    }
+  }
+  batch_flush(bitarray, &batch, ops, n);
+  free(batch.segments);
+}
+
+void bitarray_op_range(bitarray_t* const dst,
+                       const size_t dst_offset,
+                       bitarray_t* const a,
+                       const size_t a_offset,
+                       bitarray_t* const b,
+                       const size_t b_offset,
+                       const size_t bit_length,
+                       const bitarray_op_t op) {
+  assert(dst_offset + bit_length <= dst->bit_sz);
+  assert(a_offset + bit_length <= a->bit_sz);
+  assert(op == BITARRAY_OP_NOT || b_offset + bit_length <= b->bit_sz);
+  if (bit_length == 0) {
+    return;
+  }
+  bitarray_t* const other = (op == BITARRAY_OP_NOT) ? NULL : b;
+  bitarray_normalize(dst);
+  bitarray_normalize(a);
+  if (other != NULL) {
+    bitarray_normalize(other);
+  }
+  bitarray_invalidate_rank(dst);
+
+  // Bits up to the first word boundary of dst.
+  size_t done = 0;
+  if (dst_offset % WORD_SIZE != 0) {
+    done = WORD_SIZE - dst_offset % WORD_SIZE;
+    if (done > bit_length) {
+      done = bit_length;
+    }
+    const word b_bits = (other != NULL) ? bitarray_get_bits(other, b_offset, done) : 0;
+    bitarray_set_bits(dst, dst_offset, done,
+                      combine_words(op, bitarray_get_bits(a, a_offset, done), b_bits));
+  }
+
+  // Whole words of dst.
+  const size_t word_count = (bit_length - done) / WORD_SIZE;
+  if (word_count > 0) {
+    struct op_blocks blocks = {
+      (word*) dst->buf + (dst_offset + done) / WORD_SIZE,
+      (const word*) a->buf + (a_offset + done) / WORD_SIZE,
+      (a_offset + done) % WORD_SIZE,
+      (other != NULL) ? (const word*) other->buf + (b_offset + done) / WORD_SIZE : NULL,
+      (b_offset + done) % WORD_SIZE,
+      word_count,
+      op,
+      // As for bitarray_copy_bits, only stream into an array not also read.
+      dst != a && dst != other && word_count * WORD_SIZE >= bitarray_get_streaming_threshold()
+    };
+    const size_t block_count = (word_count + OP_BLOCK_WORDS - 1) / OP_BLOCK_WORDS;
+    if (bitarray_use_threads(word_count * WORD_SIZE)) {
+      // Pick the kernel up front rather than racing to from every thread.
+      op_words_select();
+      bitarray_parallel_for(block_count, op_word_blocks, &blocks);
+    } else {
+      op_word_blocks(&blocks, 0, block_count);
+    }
+    done += word_count * WORD_SIZE;
+  }
+
+  // The bits left in the last, partial word of dst.
+  if (done < bit_length) {
+    const size_t count = bit_length - done;
+    const word b_bits = (other != NULL) ? bitarray_get_bits(other, b_offset + done, count) : 0;
+    bitarray_set_bits(dst, dst_offset + done, count,
+                      combine_words(op, bitarray_get_bits(a, a_offset + done, count), b_bits));
+  }
+}
+
+void bitarray_copy_range(bitarray_t* const dst,
+                         const size_t dst_offset,
+                         bitarray_t* const src,
+                         const size_t src_offset,
+                         const size_t bit_length) {
+  assert(dst_offset + bit_length <= dst->bit_sz);
+  assert(src_offset + bit_length <= src->bit_sz);
+  if (bit_length == 0) {
+    return;
+  }
+  bitarray_normalize(dst);
+  bitarray_normalize(src);
+  bitarray_invalidate_rank(dst);
+  bitarray_copy_bits(dst, dst_offset, src, src_offset, bit_length);
+}
+
+void bitarray_fill(bitarray_t* const bitarray,
+                   const size_t bit_offset,
+                   const size_t bit_length,
+                   const bool value) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  if (bit_length == 0) {
+    return;
+  }
+  bitarray_invalidate_rank(bitarray);
+  if (bitarray->tree != NULL) {
+    bitarray_normalize(bitarray);
+  }
+  // Filling does not care where bits sit, so a pending rotation can stay;
+  // the range just may wrap around the end of buf.
+  const size_t physical_offset = bitarray_physical_index(bitarray, bit_offset);
+  const size_t first_length = (bitarray->bit_sz - physical_offset < bit_length) ?
+                              bitarray->bit_sz - physical_offset : bit_length;
+  bitarray_fill_bits(bitarray, physical_offset, first_length, value);
+  bitarray_fill_bits(bitarray, 0, bit_length - first_length, value);
+}
+
+void bitarray_shift(bitarray_t* const bitarray,
+                    const size_t bit_offset,
+                    const size_t bit_length,
+                    const ssize_t bit_right_amount,
+                    const bool fill_value) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  const size_t amount = (bit_right_amount < 0) ? -(size_t) bit_right_amount :
+                                                 (size_t) bit_right_amount;
+  if (bit_length == 0 || amount == 0) {
+    return;
+  }
+  if (amount >= bit_length) {
+    bitarray_fill(bitarray, bit_offset, bit_length, fill_value);
+    return;
+  }
+  bitarray_normalize(bitarray);
+  bitarray_invalidate_rank(bitarray);
+  if (bit_right_amount > 0) {
+    bitarray_copy_bits(bitarray, bit_offset + amount, bitarray, bit_offset, bit_length - amount);
+    bitarray_fill_bits(bitarray, bit_offset, amount, fill_value);
+  } else {
+    bitarray_copy_bits(bitarray, bit_offset, bitarray, bit_offset + amount, bit_length - amount);
+    bitarray_fill_bits(bitarray, bit_offset + bit_length - amount, amount, fill_value);
+  }
+}
+
+size_t bitarray_mismatch(bitarray_t* const a,
+                         const size_t a_offset,
+                         bitarray_t* const b,
+                         const size_t b_offset,
+                         const size_t bit_length) {
+  assert(a_offset + bit_length <= a->bit_sz);
+  assert(b_offset + bit_length <= b->bit_sz);
+  if (bit_length == 0) {
+    return 0;
+  }
+  bitarray_normalize(a);
+  bitarray_normalize(b);
+
+  // Bits up to the first word boundary of a.
+  size_t done = (WORD_SIZE - a_offset % WORD_SIZE) % WORD_SIZE;
+  if (done > bit_length) {
+    done = bit_length;
+  }
+  if (done > 0) {
+    const word diff = bitarray_get_bits(a, a_offset, done) ^
+                      bitarray_get_bits(b, b_offset, done);
+    if (diff != 0) {
+      return (size_t) __builtin_ctzll(diff);
+    }
+  }
+
+  // Whole words of a against shifted words of b.
+  const size_t word_count = (bit_length - done) / WORD_SIZE;
+  if (word_count > 0) {
+    const word* const a_words = (const word*) a->buf + (a_offset + done) / WORD_SIZE;
+    const word* const b_words = (const word*) b->buf + (b_offset + done) / WORD_SIZE;
+    const size_t b_shift = (b_offset + done) % WORD_SIZE;
+    const size_t i = mismatch_words(a_words, b_words, b_shift, word_count);
+    if (i < word_count) {
+      const word diff = a_words[i] ^ shifted_word(b_words, i, b_shift);
+      return done + i * WORD_SIZE + (size_t) __builtin_ctzll(diff);
+    }
+    done += word_count * WORD_SIZE;
+  }
+
+  // The bits left in a's last, partial word.
+  if (done < bit_length) {
+    const word diff = bitarray_get_bits(a, a_offset + done, bit_length - done) ^
+                      bitarray_get_bits(b, b_offset + done, bit_length - done);
+    if (diff != 0) {
+      return done + (size_t) __builtin_ctzll(diff);
+    }
+  }
+  return bit_length;
+}
+
+bool bitarray_equal_range(bitarray_t* const a,
+                          const size_t a_offset,
+                          bitarray_t* const b,
+                          const size_t b_offset,
+                          const size_t bit_length) {
+  return bitarray_mismatch(a, a_offset, b, b_offset, bit_length) == bit_length;
+}
+
+bool bitarray_equal(bitarray_t* const a, bitarray_t* const b) {
+  return a->bit_sz == b->bit_sz && bitarray_equal_range(a, 0, b, 0, a->bit_sz);
+}
+
+size_t bitarray_find_next_set(bitarray_t* const bitarray, const size_t bit_index) {
+  bitarray_normalize(bitarray);
+  return bitarray_find_next(bitarray, bit_index, bitarray->bit_sz, true);
+}
+
+size_t bitarray_find_next_clear(bitarray_t* const bitarray, const size_t bit_index) {
+  bitarray_normalize(bitarray);
+  return bitarray_find_next(bitarray, bit_index, bitarray->bit_sz, false);
+}
+
+size_t bitarray_find_prev_set(bitarray_t* const bitarray, const size_t bit_index) {
+  if (bitarray->bit_sz == 0) {
+    return 0;
+  }
+  bitarray_normalize(bitarray);
+  const size_t start = (bit_index < bitarray->bit_sz) ? bit_index : bitarray->bit_sz - 1;
+  size_t word_index = start / WORD_SIZE;
+  word a_word = bitarray_load_word(bitarray, word_index) & LEAD(start % WORD_SIZE + 1);
+  if (a_word == 0) {
+    const size_t found = scan_words_backward((const word*) bitarray->buf, word_index, 0);
+    if (found == word_index) {
+      return bitarray->bit_sz;
+    }
+    word_index = found;
+    a_word = bitarray_load_word(bitarray, word_index);
+  }
+  return word_index * WORD_SIZE + (WORD_SIZE - 1) - (size_t) __builtin_clzll(a_word);
+}
+
+size_t bitarray_foreach_set(bitarray_t* const bitarray,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const bitarray_visit_fn fn,
+                            void* const ctx) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  bitarray_normalize(bitarray);
+  const size_t end = bit_offset + bit_length;
+  size_t calls = 0;
+  size_t bit_index = bitarray_find_next(bitarray, bit_offset, end, true);
+  while (bit_index < end) {
+    // Visit every set bit of this word, then look for the next word with any.
+    const size_t word_index = bit_index / WORD_SIZE;
+    const size_t word_end = (end - word_index * WORD_SIZE < WORD_SIZE) ?
+                            end - word_index * WORD_SIZE : WORD_SIZE;
+    word a_word = (bitarray_load_word(bitarray, word_index) & LEAD(word_end)) >>
+                  (bit_index % WORD_SIZE) << (bit_index % WORD_SIZE);
+    while (a_word != 0) {
+      calls++;
+      if (!fn(ctx, word_index * WORD_SIZE + (size_t) __builtin_ctzll(a_word))) {
+        return calls;
+      }
+      a_word &= a_word - 1;
+    }
+    bit_index = bitarray_find_next(bitarray, (word_index + 1) * WORD_SIZE, end, true);
+  }
+  return calls;
+}
+
+void bitarray_and(bitarray_t* const dst, bitarray_t* const a, bitarray_t* const b) {
+  assert(a->bit_sz == dst->bit_sz && b->bit_sz == dst->bit_sz);
+  bitarray_op_range(dst, 0, a, 0, b, 0, dst->bit_sz, BITARRAY_OP_AND);
+}
+
+void bitarray_or(bitarray_t* const dst, bitarray_t* const a, bitarray_t* const b) {
+  assert(a->bit_sz == dst->bit_sz && b->bit_sz == dst->bit_sz);
+  bitarray_op_range(dst, 0, a, 0, b, 0, dst->bit_sz, BITARRAY_OP_OR);
+}
+
+void bitarray_xor(bitarray_t* const dst, bitarray_t* const a, bitarray_t* const b) {
+  assert(a->bit_sz == dst->bit_sz && b->bit_sz == dst->bit_sz);
+  bitarray_op_range(dst, 0, a, 0, b, 0, dst->bit_sz, BITARRAY_OP_XOR);
+}
+
+void bitarray_andnot(bitarray_t* const dst, bitarray_t* const a, bitarray_t* const b) {
+  assert(a->bit_sz == dst->bit_sz && b->bit_sz == dst->bit_sz);
+  bitarray_op_range(dst, 0, a, 0, b, 0, dst->bit_sz, BITARRAY_OP_ANDNOT);
+}
+
+void bitarray_not(bitarray_t* const dst, bitarray_t* const a) {
+  assert(a->bit_sz == dst->bit_sz);
+  bitarray_op_range(dst, 0, a, 0, NULL, 0, dst->bit_sz, BITARRAY_OP_NOT);
+}
+
+const char* bitarray_get_op_kernel(void) {
+  if (op_words_name == NULL) {
+    op_words_select();
+  }
+  return op_words_name;
+}
+
+const char* bitarray_get_copy_kernel(void) {
+  if (copy_words_name == NULL) {
+    copy_words_select();
+  }
+  return copy_words_name;
+}
+
+const char* bitarray_get_mismatch_kernel(void) {
+  if (mismatch_words_name == NULL) {
+    mismatch_words_select();
+  }
+  return mismatch_words_name;
+}
+
+size_t bitarray_count(const bitarray_t* const bitarray,
+                      const size_t bit_offset,
+                      const size_t bit_length) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  if (bit_length == 0) {
+    return 0;
+  }
+  // Under a pending rotation the range may wrap around the end of buf.
+  const size_t physical_offset = bitarray_physical_index(bitarray, bit_offset);
+  const size_t first_length = (bitarray->bit_sz - physical_offset < bit_length) ?
+                              bitarray->bit_sz - physical_offset : bit_length;
+  return bitarray_count_physical(bitarray, physical_offset, first_length) +
+         bitarray_count_physical(bitarray, 0, bit_length - first_length);
+}
+
+bool bitarray_build_rank_index(bitarray_t* const bitarray) {
+  bitarray_normalize(bitarray);
+  if (bitarray->rank == NULL) {
+    struct rank_index* const rank = malloc(sizeof(struct rank_index));
+    if (rank == NULL) {
+      return false;
+    }
+    rank->superblock_count = bitarray->bit_sz / RANK_SUPERBLOCK_BITS + 1;
+    rank->block_count = bitarray->bit_sz / RANK_BLOCK_BITS + 1;
+    rank->superblocks = malloc(rank->superblock_count * sizeof(size_t));
+    rank->blocks = malloc(rank->block_count * sizeof(uint16_t));
+    if (rank->superblocks == NULL || rank->blocks == NULL) {
+      rank_index_free(rank);
+      return false;
+    }
+    bitarray->rank = rank;
+  }
+  rank_index_fill(bitarray);
+  return true;
+}
+
+size_t bitarray_rank(bitarray_t* const bitarray, const size_t bit_index) {
+  assert(bit_index <= bitarray->bit_sz);
+  if (bitarray->rank == NULL) {
+    return bitarray_count(bitarray, 0, bit_index);
+  }
+  if (bitarray->rank->stale) {
+    bitarray_build_rank_index(bitarray);
+  }
+  const struct rank_index* const rank = bitarray->rank;
+  const size_t block = bit_index / RANK_BLOCK_BITS;
+  return rank->superblocks[bit_index / RANK_SUPERBLOCK_BITS] + rank->blocks[block] +
+         bitarray_count_physical(bitarray, block * RANK_BLOCK_BITS,
+                                 bit_index - block * RANK_BLOCK_BITS);
+}
+
+size_t bitarray_select(bitarray_t* const bitarray, const size_t k) {
+  if (bitarray->rank != NULL && bitarray->rank->stale) {
+    bitarray_build_rank_index(bitarray);
+  }
+  bitarray_normalize(bitarray);
+  const struct rank_index* const rank = bitarray->rank;
+  const size_t word_count = (bitarray->bit_sz + WORD_SIZE - 1) / WORD_SIZE;
+
+  // Narrow the search to one block with the index, if there is one.
+  size_t word_index = 0;
+  size_t remaining = k;
+  if (rank != NULL) {
+    if (k >= rank->total) {
+      return bitarray->bit_sz;
+    }
+    // The last superblock starting with at most k set bits before it.
+    size_t lo = 0;
+    size_t hi = rank->superblock_count;
+    while (hi - lo > 1) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (rank->superblocks[mid] <= k) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    remaining -= rank->superblocks[lo];
+    const size_t blocks_per_superblock = RANK_SUPERBLOCK_BITS / RANK_BLOCK_BITS;
+    size_t block = lo * blocks_per_superblock;
+    while (block + 1 < rank->block_count &&
+           (block + 1) % blocks_per_superblock != 0 &&
+           rank->blocks[block + 1] <= remaining) {
+      block++;
+    }
+    remaining -= rank->blocks[block];
+    word_index = block * (RANK_BLOCK_BITS / WORD_SIZE);
+  }
+
+  // Then walk words until the one holding the bit.
+  for (; word_index < word_count; word_index++) {
+    word a_word = bitarray_load_word(bitarray, word_index);
+    if ((word_index + 1) * WORD_SIZE > bitarray->bit_sz) {
+      a_word &= LEAD(bitarray->bit_sz - word_index * WORD_SIZE);
+    }
+    const size_t count = (size_t) __builtin_popcountll(a_word);
+    if (remaining < count) {
+      return word_index * WORD_SIZE + select_in_word(a_word, remaining);
+    }
+    remaining -= count;
+  }
+  return bitarray->bit_sz;
+}
+
+void bitarray_bundle_rotate(const bitarray_bundle_t* const bundle,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const ssize_t bit_right_amount) {
+  assert(bundle->bit_sz <= WORD_SIZE && bit_offset + bit_length <= bundle->bit_sz);
+  const size_t bit_left_amount = bundle_left_amount(bit_right_amount, bit_length);
+  if (bit_left_amount == 0) {
+    return;
+  }
+  // The kernels take per-item arguments; every block shares one set.
+  size_t offsets[BUNDLE_BLOCK_ITEMS];
+  size_t lengths[BUNDLE_BLOCK_ITEMS];
+  size_t lefts[BUNDLE_BLOCK_ITEMS];
+  const size_t block_items = (bundle->count < BUNDLE_BLOCK_ITEMS) ? bundle->count :
+                             BUNDLE_BLOCK_ITEMS;
+  for (size_t i = 0; i < block_items; i++) {
+    offsets[i] = bit_offset;
+    lengths[i] = bit_length;
+    lefts[i] = bit_left_amount;
+  }
+  for (size_t start = 0; start < bundle->count; start += block_items) {
+    const size_t n = (bundle->count - start < block_items) ? bundle->count - start : block_items;
+    bundle_rotate_words(bundle->words + start, n, offsets, lengths, lefts);
+  }
+}
+
+void bitarray_bundle_rotate_each(const bitarray_bundle_t* const bundle,
+                                 const size_t* const bit_offsets,
+                                 const size_t* const bit_lengths,
+                                 const ssize_t* const bit_right_amounts) {
+  assert(bundle->bit_sz <= WORD_SIZE);
+  size_t offsets[BUNDLE_BLOCK_ITEMS];
+  size_t lengths[BUNDLE_BLOCK_ITEMS];
+  size_t lefts[BUNDLE_BLOCK_ITEMS];
+  for (size_t start = 0; start < bundle->count; start += BUNDLE_BLOCK_ITEMS) {
+    const size_t n = (bundle->count - start < BUNDLE_BLOCK_ITEMS) ? bundle->count - start :
+                     BUNDLE_BLOCK_ITEMS;
+    for (size_t i = 0; i < n; i++) {
+      offsets[i] = (bit_offsets == NULL) ? 0 : bit_offsets[start + i];
+      lengths[i] = (bit_lengths == NULL) ? bundle->bit_sz - offsets[i] : bit_lengths[start + i];
+      assert(offsets[i] + lengths[i] <= bundle->bit_sz);
+      lefts[i] = bundle_left_amount(bit_right_amounts[start + i], lengths[i]);
+    }
+    bundle_rotate_words(bundle->words + start, n, offsets, lengths, lefts);
+  }
+}
+
+void bitarray_bundle_reverse(const bitarray_bundle_t* const bundle,
+                             const size_t bit_offset,
+                             const size_t bit_length) {
+  assert(bundle->bit_sz <= WORD_SIZE && bit_offset + bit_length <= bundle->bit_sz);
+  if (bit_length < 2) {
+    return;
+  }
+  size_t offsets[BUNDLE_BLOCK_ITEMS];
+  size_t lengths[BUNDLE_BLOCK_ITEMS];
+  const size_t block_items = (bundle->count < BUNDLE_BLOCK_ITEMS) ? bundle->count :
+                             BUNDLE_BLOCK_ITEMS;
+  for (size_t i = 0; i < block_items; i++) {
+    offsets[i] = bit_offset;
+    lengths[i] = bit_length;
+  }
+  for (size_t start = 0; start < bundle->count; start += block_items) {
+    const size_t n = (bundle->count - start < block_items) ? bundle->count - start : block_items;
+    bundle_reverse_words(bundle->words + start, n, offsets, lengths);
+  }
+}
+
+void bitarray_bundle_reverse_each(const bitarray_bundle_t* const bundle,
+                                  const size_t* const bit_offsets,
+                                  const size_t* const bit_lengths) {
+  assert(bundle->bit_sz <= WORD_SIZE);
+  size_t offsets[BUNDLE_BLOCK_ITEMS];
+  size_t lengths[BUNDLE_BLOCK_ITEMS];
+  for (size_t start = 0; start < bundle->count; start += BUNDLE_BLOCK_ITEMS) {
+    const size_t n = (bundle->count - start < BUNDLE_BLOCK_ITEMS) ? bundle->count - start :
+                     BUNDLE_BLOCK_ITEMS;
+    for (size_t i = 0; i < n; i++) {
+      offsets[i] = (bit_offsets == NULL) ? 0 : bit_offsets[start + i];
+      lengths[i] = (bit_lengths == NULL) ? bundle->bit_sz - offsets[i] : bit_lengths[start + i];
+      assert(offsets[i] + lengths[i] <= bundle->bit_sz);
+    }
+    bundle_reverse_words(bundle->words + start, n, offsets, lengths);
+  }
+}
+
+void bitarray_bundle_load(const bitarray_bundle_t* const bundle,
+                          const size_t index,
+                          bitarray_t* const src) {
+  assert(index < bundle->count && src->bit_sz == bundle->bit_sz);
+  assert(bundle->bit_sz > 0 && bundle->bit_sz <= WORD_SIZE);
+  bitarray_normalize(src);
+  bundle->words[index] = bitarray_get_bits(src, 0, bundle->bit_sz);
+}
+
+void bitarray_bundle_store(const bitarray_bundle_t* const bundle,
+                           const size_t index,
+                           bitarray_t* const dst) {
+  assert(index < bundle->count && dst->bit_sz == bundle->bit_sz);
+  assert(bundle->bit_sz > 0 && bundle->bit_sz <= WORD_SIZE);
+  bitarray_invalidate_rank(dst);
+  bitarray_normalize(dst);
+  bitarray_set_bits(dst, 0, bundle->bit_sz, bundle->words[index]);
+}
+
+const char* bitarray_get_bundle_kernel(void) {
+  if (bundle_kernel_name == NULL) {
+    bundle_select();
+  }
+  return bundle_kernel_name;
+}
+
+const char* bitarray_get_count_kernel(void) {
+  if (count_words_name == NULL) {
+    count_words_select();
+  }
+  return count_words_name;
+}
+
+void bitarray_normalize(bitarray_t* const bitarray) {
+  if (bitarray->tree != NULL) {
+    // The tree stays in physical order, so once flattened buf is in the same
+    // state as if it had never been built.
+    bittreap_flatten(bitarray->tree, bitarray->buf);
+    bittreap_free(bitarray->tree);
+    bitarray->tree = NULL;
+  }
+  if (bitarray->rotation == 0) {
+    return;
+  }
+  // Logical bit 0 sits at physical bit rotation; rotating buf left by that
+  // much puts it back at 0.
+  const size_t rotation = bitarray->rotation;
+  bitarray->rotation = 0;
+  bitarray_rotate_physical(bitarray, 0, bitarray->bit_sz, rotation);
+}
+
+void bitarray_set_rotate_engine(const bitarray_rotate_engine_t engine) {
+  rotate_engine = engine;
+}
+
+bitarray_rotate_engine_t bitarray_get_rotate_engine(void) {
+  return rotate_engine;
+}
+
+void bitarray_set_thread_count(const unsigned int count) {
+  unsigned int resolved = count;
+  if (resolved == 0) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    resolved = (online > 0) ? (unsigned int) online : 1;
+  }
+  thread_count = (resolved < MAX_THREADS) ? resolved : MAX_THREADS;
+}
+
+unsigned int bitarray_get_thread_count(void) {
+  return thread_count;
+}
+
+void bitarray_set_parallel_threshold(const size_t bit_length) {
+  parallel_threshold = bit_length;
+}
+
+static void streaming_threshold_init(void) {
+  long cache_bytes = -1;
+  #ifdef _SC_LEVEL3_CACHE_SIZE
+  cache_bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  #endif
+  const size_t bytes = (cache_bytes > 0) ? (size_t) cache_bytes : STREAMING_DEFAULT_CACHE_BYTES;
+  streaming_threshold = bytes * 8;
+}
+
+void bitarray_set_streaming_threshold(const size_t bit_length) {
+  // Settle the default first, so that it cannot later overwrite bit_length.
+  pthread_once(&streaming_threshold_once, streaming_threshold_init);
+  streaming_threshold = bit_length;
+}
+
+size_t bitarray_get_streaming_threshold(void) {
+  pthread_once(&streaming_threshold_once, streaming_threshold_init);
+  return streaming_threshold;
+}
+
+void bitarray_set_scratch_threshold(const size_t bit_length) {
+  scratch_threshold = bit_length;
+}
+
+static void scratch_limit_init(void) {
+  const long pages = sysconf(_SC_PHYS_PAGES);
+  const long page_bytes = sysconf(_SC_PAGESIZE);
+  scratch_limit = (pages > 0 && page_bytes > 0) ?
+                  (size_t) pages * (size_t) page_bytes / 16 : SCRATCH_DEFAULT_LIMIT_BYTES;
+}
+
+void bitarray_set_scratch_limit(const size_t bytes) {
+  // Settle the default first, so that it cannot later overwrite bytes.
+  pthread_once(&scratch_limit_once, scratch_limit_init);
+  scratch_limit = bytes;
+}
+
+size_t bitarray_get_scratch_limit(void) {
+  pthread_once(&scratch_limit_once, scratch_limit_init);
+  return scratch_limit;
+}
+
+void bitarray_release_scratch(void) {
+  bitarray_free(thread_scratch);
+  thread_scratch = NULL;
+}
+
+void bitarray_set_block_bytes(const size_t bytes) {
+  rotate_block_bytes = bytes;
+}
+
+static void default_block_bytes_init(void) {
+  long cache_bytes = -1;
+  #ifdef _SC_LEVEL2_CACHE_SIZE
+  cache_bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  #endif
+  // Half, so the streamed side of the move shares L2 with the scratch.
+  default_block_bytes = ((cache_bytes > 0) ? (size_t) cache_bytes : BLOCKED_DEFAULT_L2_BYTES) / 2;
+}
+
+size_t bitarray_get_block_bytes(void) {
+  if (rotate_block_bytes != 0) {
+    return rotate_block_bytes;
+  }
+  pthread_once(&default_block_bytes_once, default_block_bytes_init);
+  return default_block_bytes;
+}
+
+void bitarray_set_prefetch_distance(const size_t bytes) {
+  prefetch_distance = bytes;
+}
+
+size_t bitarray_get_prefetch_distance(void) {
+  return prefetch_distance;
+}
+
+static void bitarray_rotate_left(bitarray_t* const bitarray,
+                                 const size_t bit_offset,
+                                 const size_t bit_length,
+                                 const size_t bit_left_amount) {
+  for (size_t i = 0; i < bit_left_amount; i++) {
+    bitarray_rotate_left_one(bitarray, bit_offset, bit_length);
+  }
+}
+
+static void bitarray_rotate_left_one(bitarray_t* const bitarray,
+                                     const size_t bit_offset,
+                                     const size_t bit_length) {
+  // Grab the first bit in the range, shift everything left by one, and
+  // then stick the first bit at the end.
+  const bool first_bit = bitarray_get(bitarray, bit_offset);
+  size_t i;
+  for (i = bit_offset; i + 1 < bit_offset + bit_length; i++) {
+    bitarray_set(bitarray, i, bitarray_get(bitarray, i + 1));
+  }
+  bitarray_set(bitarray, i, first_bit);
 }
 
 static size_t modulo(const ssize_t n, const size_t m) {
@@ -277,271 +2131,2400 @@ static size_t modulo(const ssize_t n, const size_t m) {
   return (size_t)result;
 }
 
-static char bitmask(const size_t bit_index) {
-  return 1 << (bit_index % 8);
+static char bitmask(const size_t bit_index) {
+  return 1 << (bit_index % 8);
+}
+
+static size_t bitarray_physical_index(const bitarray_t* const bitarray,
+                                      const size_t bit_index) {
+  const size_t physical_index = bit_index + bitarray->rotation;
+  return (physical_index >= bitarray->bit_sz) ?
+         physical_index - bitarray->bit_sz : physical_index;
+}
+
+static void bitarray_rotate_physical(bitarray_t* const bitarray,
+                                     const size_t bit_offset,
+                                     const size_t bit_length,
+                                     const size_t bit_left_amount) {
+  if (bit_length <= SMALL_ROTATE_BITS) {
+    bitarray_rotate_small(bitarray, bit_offset, bit_length, bit_left_amount);
+    return;
+  }
+  // Every engine streams through the subarray, so let the kernel read
+  // ahead in a mapped file.
+  const bool mapped_file = bitarray_is_mapped_file(bitarray);
+  if (mapped_file) {
+    bitarray_advise(bitarray, bit_offset, bit_length, MADV_SEQUENTIAL);
+  }
+  const size_t bits = bit_offset | bit_length | bit_left_amount;
+  const enum rotate_alignment alignment = (bits % WORD_SIZE == 0) ? ROTATE_ALIGN_WORD :
+                                          (bits % 8 == 0) ? ROTATE_ALIGN_BYTE :
+                                          ROTATE_ALIGN_BIT;
+  rotate_kernels[alignment](bitarray, bit_offset, bit_length, bit_left_amount);
+  if (mapped_file) {
+    bitarray_advise(bitarray, bit_offset, bit_length, MADV_NORMAL);
+  }
+}
+
+static void bitarray_rotate_small(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const size_t bit_left_amount) {
+  assert(bit_length <= SMALL_ROTATE_BITS && bit_left_amount <= bit_length);
+  if (bit_left_amount == 0 || bit_left_amount == bit_length) {
+    return;
+  }
+#ifdef __SIZEOF_INT128__
+  const size_t word_index = bit_offset / WORD_SIZE;
+  const size_t shift = bit_offset % WORD_SIZE;
+  if (shift + bit_length <= 2 * WORD_SIZE) {
+    // The spare word past the last bit makes the second word safe to touch.
+    typedef unsigned __int128 dword;
+    const dword window = (dword) bitarray_load_word(bitarray, word_index) |
+                         (dword) bitarray_load_word(bitarray, word_index + 1) << WORD_SIZE;
+    const dword mask = (bit_length == 2 * WORD_SIZE) ? ~(dword) 0 :
+                       ((dword) 1 << bit_length) - 1;
+    const dword field = (window >> shift) & mask;
+    const dword rotated =
+      ((field >> bit_left_amount) | (field << (bit_length - bit_left_amount))) & mask;
+    const dword result = (window & ~(mask << shift)) | (rotated << shift);
+    bitarray_store_word(bitarray, word_index, (word) result);
+    bitarray_store_word(bitarray, word_index + 1, (word) (result >> WORD_SIZE));
+    return;
+  }
+#endif
+  // The shorter block, at up to a word's offset, plus the spare word.
+  word scratch[SMALL_ROTATE_BITS / 2 / WORD_SIZE + 3];
+  bitarray_t view;
+  bitarray_init_view(&view, (char*) scratch, sizeof(scratch));
+  bitarray_rotate_through(bitarray, bit_offset, bit_length, bit_left_amount, &view);
+}
+
+static void bitarray_init_fields(bitarray_t* const bitarray,
+                                 const size_t bit_sz,
+                                 const bitarray_backend_t backend) {
+  bitarray->bit_sz = bit_sz;
+  bitarray->rotation = 0;
+  bitarray->backend = backend;
+  bitarray->tree = NULL;
+  bitarray->rank = NULL;
+}
+
+static void bitarray_init_view(bitarray_t* const view,
+                               char* const buf,
+                               const size_t buf_bytes) {
+  assert((uintptr_t) buf % sizeof(word) == 0 && buf_bytes >= sizeof(word));
+  bitarray_init_fields(view, (buf_bytes / sizeof(word) - 1) * WORD_SIZE,
+                       BITARRAY_BACKEND_PACKED);
+  view->buf = buf;
+  view->buf_bytes = buf_bytes;
+  view->storage = STORAGE_HEAP;
+}
+
+static bool bitarray_rotate_treap(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const size_t bit_left_amount) {
+  if (bitarray->tree == NULL) {
+    bitarray->tree = bittreap_build(bitarray->buf, bitarray->bit_sz);
+    if (bitarray->tree == NULL) {
+      return false;
+    }
+  }
+  // Fold any pending whole-array rotation into the tree first, so that
+  // logical and physical positions agree again.
+  if (bitarray->rotation != 0) {
+    if (!bittreap_rotate_left(bitarray->tree, 0, bitarray->bit_sz, bitarray->rotation)) {
+      return false;
+    }
+    bitarray->rotation = 0;
+  }
+  return bittreap_rotate_left(bitarray->tree, bit_offset, bit_length, bit_left_amount);
+}
+
+// ******************************* Functions. Added By Isaac ***********************
+
+static void bitarray_reverse_slow(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length) {
+  int lp = bit_offset;
+  int rp = bit_offset + bit_length - 1;
+  bool lbit, rbit;
+  for(int i = 0; i < bit_length/2 ; i++) {
+    lbit = bitarray_get(bitarray, lp);
+    rbit = bitarray_get(bitarray, rp);
+    bitarray_set(bitarray, lp, rbit);
+    bitarray_set(bitarray, rp, lbit);
+    lp++;
+    rp--;
+  }
+}
+
+static void bitarray_rotate_engine(bitarray_t* const bitarray,
+                                   const size_t bit_offset,
+                                   const size_t bit_length,
+                                   const size_t bit_left_amount) {
+  switch (rotate_engine) {
+  case BITARRAY_ROTATE_BLOCKSWAP:
+    bitarray_rotate_blockswap(bitarray, bit_offset, bit_length, bit_left_amount);
+    break;
+  case BITARRAY_ROTATE_BLOCKED:
+    bitarray_rotate_blocked(bitarray, bit_offset, bit_length, bit_left_amount);
+    break;
+  case BITARRAY_ROTATE_REVERSAL:
+  default: {
+    // Moving each bit once beats reversing it twice, given the memory.
+    // Threads reverse in parallel, which beats a single-threaded copy.
+    const size_t right = bit_length - bit_left_amount;
+    bitarray_t* const scratch =
+      (bit_length >= scratch_threshold && !bitarray_use_threads(bit_length)) ?
+      thread_scratch_get(((bit_left_amount < right) ? bit_left_amount : right) + WORD_SIZE) :
+      NULL;
+    if (scratch != NULL) {
+      bitarray_rotate_through(bitarray, bit_offset, bit_length, bit_left_amount, scratch);
+    } else {
+      bitarray_rotate_fast(bitarray, bit_offset, bit_length, bit_left_amount);
+    }
+    break;
+  }
+  }
+}
+
+// Defines rotate_<name>(base, n, k), which rotates the n units of type
+// unit_t at base left by k units.  If either side of the split fits in
+// ALIGNED_SCRATCH_BYTES, it is set aside while the other side is moved over
+// with one memmove.  Otherwise Gries-Mills block swaps shrink the problem,
+// each swap going through the scratch buffer a chunk at a time.
+#define DEFINE_ALIGNED_ROTATE(name, unit_t)                                   \
+  static void rotate_##name(unit_t* const base, const size_t n,              \
+                            const size_t k) {                                \
+    unit_t scratch[ALIGNED_SCRATCH_BYTES / sizeof(unit_t)];                  \
+    const size_t scratch_units = ALIGNED_SCRATCH_BYTES / sizeof(unit_t);     \
+    /* [p, p + left) moves behind [p + left, p + left + right). */           \
+    unit_t* p = base;                                                        \
+    size_t left = k;                                                         \
+    size_t right = n - k;                                                    \
+    while (left != 0 && right != 0) {                                        \
+      if (left <= scratch_units) {                                           \
+        memcpy(scratch, p, left * sizeof(unit_t));                           \
+        memmove(p, p + left, right * sizeof(unit_t));                        \
+        memcpy(p + right, scratch, left * sizeof(unit_t));                   \
+        return;                                                              \
+      }                                                                      \
+      if (right <= scratch_units) {                                          \
+        memcpy(scratch, p + left, right * sizeof(unit_t));                   \
+        memmove(p + right, p, left * sizeof(unit_t));                        \
+        memcpy(p, scratch, right * sizeof(unit_t));                          \
+        return;                                                              \
+      }                                                                      \
+      /* Swap the shorter side with its far end of the longer side. */      \
+      const size_t count = (left < right) ? left : right;                    \
+      unit_t* const x = (left < right) ? p : p + left - count;               \
+      unit_t* const y = p + left;                                            \
+      for (size_t done = 0; done < count; done += scratch_units) {           \
+        const size_t units = (count - done < scratch_units) ?                \
+                             count - done : scratch_units;                   \
+        memcpy(scratch, x + done, units * sizeof(unit_t));                   \
+        memcpy(x + done, y + done, units * sizeof(unit_t));                  \
+        memcpy(y + done, scratch, units * sizeof(unit_t));                   \
+      }                                                                      \
+      if (left < right) {                                                    \
+        p += left;                                                           \
+        right -= left;                                                       \
+      } else {                                                               \
+        left -= right;                                                       \
+      }                                                                      \
+    }                                                                        \
+  }
+
+DEFINE_ALIGNED_ROTATE(bytes, unsigned char)
+DEFINE_ALIGNED_ROTATE(words, word)
+
+static void bitarray_rotate_bytes(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const size_t bit_left_amount) {
+  rotate_bytes((unsigned char*) bitarray->buf + bit_offset / 8,
+               bit_length / 8, bit_left_amount / 8);
+}
+
+static void bitarray_rotate_words(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const size_t bit_left_amount) {
+  rotate_words((word*) bitarray->buf + bit_offset / WORD_SIZE,
+               bit_length / WORD_SIZE, bit_left_amount / WORD_SIZE);
+}
+
+static void bitarray_reverse_fast(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  // [lp, rp) is the part of the range that still has to be reversed.
+  size_t lp = bit_offset;
+  size_t rp = bit_offset + bit_length;
+
+  // Every whole word pair in between is independent of the others.
+  struct reverse_pairs pairs = {
+    bitarray, lp, rp, bit_length >= bitarray_get_streaming_threshold(), prefetch_distance * 8
+  };
+  const size_t pair_count = (rp - lp) / (2*WORD_SIZE);
+  if (bitarray_use_threads(rp - lp)) {
+    // Pick the kernel up front rather than racing to from every thread.
+    if (reverse_words_name == NULL) {
+      reverse_words_select();
+    }
+    bitarray_parallel_for(pair_count, bitarray_reverse_pairs, &pairs);
+  } else {
+    bitarray_reverse_pairs(&pairs, 0, pair_count);
+  }
+  lp += pair_count*WORD_SIZE;
+  rp -= pair_count*WORD_SIZE;
+
+  // Fewer than two words are left in the middle; reverse them in registers.
+  const size_t rest = rp - lp;
+  if (rest == 0) {
+    return;
+  }
+  if (rest <= WORD_SIZE) {
+    const word middle = bitarray_get_bits(bitarray, lp, rest);
+    bitarray_set_bits(bitarray, lp, rest, reverse_word(middle) >> (WORD_SIZE - rest));
+  } else {
+    // Reverse the 128-bit value hi:lo and shift the result down so that it
+    // is rest bits long again.
+    const size_t shift = 2*WORD_SIZE - rest;
+    const word lo = reverse_word(bitarray_get_bits(bitarray, lp, WORD_SIZE));
+    const word hi = reverse_word(bitarray_get_bits(bitarray, lp + WORD_SIZE, rest - WORD_SIZE));
+    bitarray_set_bits(bitarray, lp, WORD_SIZE, (hi >> shift) | (lo << (WORD_SIZE - shift)));
+    bitarray_set_bits(bitarray, lp + WORD_SIZE, rest - WORD_SIZE, lo >> shift);
+  }
+}
+
+static void bitarray_reverse_pairs(void* const ctx, const size_t begin, const size_t end) {
+  const struct reverse_pairs* const pairs = ctx;
+  bitarray_t* const bitarray = pairs->bitarray;
+  size_t i = begin;
+
+  // Move REVERSE_BLOCK_WORDS words from each end per step so reverse_words
+  // can use full vector registers, then finish off word by word.
+  word lblock[REVERSE_BLOCK_WORDS], rblock[REVERSE_BLOCK_WORDS];
+  word lout[REVERSE_BLOCK_WORDS], rout[REVERSE_BLOCK_WORDS];
+  // The hardware prefetcher handles the forward stream but often not the
+  // backward one, so a streaming reversal prefetches both.  Its stores stay
+  // cached: every line written was just read, and non-temporal stores to
+  // such lines measured several times slower.
+  const bool prefetch = pairs->streaming;
+  for (; i + REVERSE_BLOCK_WORDS <= end; i += REVERSE_BLOCK_WORDS) {
+    const size_t lstart = pairs->lp + i*WORD_SIZE;
+    const size_t rstart = pairs->rp - (i + REVERSE_BLOCK_WORDS)*WORD_SIZE;
+    if (prefetch && rstart - lstart > 2 * pairs->prefetch_bits) {
+      __builtin_prefetch(bitarray->buf + (lstart + pairs->prefetch_bits) / 8, 1, 0);
+      __builtin_prefetch(bitarray->buf + (rstart - pairs->prefetch_bits) / 8, 1, 0);
+    }
+    for (int k = 0; k < REVERSE_BLOCK_WORDS; k++) {
+      lblock[k] = bitarray_get_word(bitarray, lstart + k*WORD_SIZE);
+      rblock[k] = bitarray_get_word(bitarray, rstart + k*WORD_SIZE);
+    }
+    reverse_words(lout, rblock, REVERSE_BLOCK_WORDS);
+    reverse_words(rout, lblock, REVERSE_BLOCK_WORDS);
+    for (int k = 0; k < REVERSE_BLOCK_WORDS; k++) {
+      bitarray_set_word(bitarray, lstart + k*WORD_SIZE, lout[k]);
+      bitarray_set_word(bitarray, rstart + k*WORD_SIZE, rout[k]);
+    }
+  }
+
+  for (; i < end; i++) {
+    const size_t lstart = pairs->lp + i*WORD_SIZE;
+    const size_t rstart = pairs->rp - (i + 1)*WORD_SIZE;
+    const word lword = bitarray_get_word(bitarray, lstart);
+    const word rword = bitarray_get_word(bitarray, rstart);
+    bitarray_set_word(bitarray, lstart, reverse_word(rword));
+    bitarray_set_word(bitarray, rstart, reverse_word(lword));
+  }
+}
+
+static void bitarray_rotate_slow(bitarray_t* const bitarray,
+                                 const size_t bit_offset,
+                                 const size_t bit_length,
+                                 const size_t bit_left_amount) {
+  assert(bit_length >= bit_left_amount);
+  bitarray_reverse_slow(bitarray, bit_offset, bit_left_amount); //reverse a
+  bitarray_reverse_slow(bitarray, bit_offset + bit_left_amount, bit_length-bit_left_amount); //reverse b
+  bitarray_reverse_slow(bitarray, bit_offset, bit_length);
+}
+
+static void bitarray_rotate_fast(bitarray_t* const bitarray,
+                                 const size_t bit_offset,
+                                 const size_t bit_length,
+                                 const size_t bit_left_amount) {
+  assert(bit_length >= bit_left_amount);
+  bitarray_reverse_fast(bitarray, bit_offset, bit_left_amount); //reverse a
+  bitarray_reverse_fast(bitarray, bit_offset + bit_left_amount, bit_length-bit_left_amount); //reverse b
+  bitarray_reverse_fast(bitarray, bit_offset, bit_length);
+}
+
+static void bitarray_swap_ranges(bitarray_t* const bitarray,
+                                 const size_t a_index,
+                                 const size_t b_index,
+                                 const size_t bit_length) {
+  assert(a_index + bit_length <= b_index);
+  // Whole words go through bitarray_get_word and bitarray_set_word.
+  const size_t word_count = bit_length / WORD_SIZE;
+  struct swap_words words = { bitarray, a_index, b_index };
+  if (bitarray_use_threads(bit_length)) {
+    bitarray_parallel_for(word_count, bitarray_swap_words, &words);
+  } else {
+    bitarray_swap_words(&words, 0, word_count);
+  }
+
+  // Whatever is left is shorter than a word; move it with masked words.
+  const size_t i = word_count*WORD_SIZE;
+  if (i < bit_length) {
+    const size_t count = bit_length - i;
+    const word a_word = bitarray_get_bits(bitarray, a_index + i, count);
+    const word b_word = bitarray_get_bits(bitarray, b_index + i, count);
+    bitarray_set_bits(bitarray, a_index + i, count, b_word);
+    bitarray_set_bits(bitarray, b_index + i, count, a_word);
+  }
+}
+
+static void bitarray_swap_words(void* const ctx, const size_t begin, const size_t end) {
+  const struct swap_words* const words = ctx;
+  for (size_t i = begin; i < end; i++) {
+    const size_t a_start = words->a_index + i*WORD_SIZE;
+    const size_t b_start = words->b_index + i*WORD_SIZE;
+    const word a_word = bitarray_get_word(words->bitarray, a_start);
+    const word b_word = bitarray_get_word(words->bitarray, b_start);
+    bitarray_set_word(words->bitarray, a_start, b_word);
+    bitarray_set_word(words->bitarray, b_start, a_word);
+  }
+}
+
+// One thread's share of a bitarray_parallel_for.
+struct parallel_chunk {
+  range_fn fn;
+  void* ctx;
+  size_t begin;
+  size_t end;
+};
+
+static void* parallel_chunk_run(void* const arg) {
+  const struct parallel_chunk* const chunk = arg;
+  chunk->fn(chunk->ctx, chunk->begin, chunk->end);
+  return NULL;
+}
+
+static bool bitarray_use_threads(const size_t bit_length) {
+  return thread_count > 1 && bit_length >= parallel_threshold;
+}
+
+static void bitarray_parallel_for(const size_t count, const range_fn fn, void* const ctx) {
+  const size_t chunk_count = (thread_count < count) ? thread_count : count;
+  if (chunk_count <= 1) {
+    fn(ctx, 0, count);
+    return;
+  }
+
+  struct parallel_chunk chunks[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  bool started[MAX_THREADS];
+  for (size_t k = 0; k < chunk_count; k++) {
+    chunks[k].fn = fn;
+    chunks[k].ctx = ctx;
+    chunks[k].begin = count * k / chunk_count + 1;
+    chunks[k].end = count * (k + 1) / chunk_count;
+  }
+  // Chunk 0 runs here; if a thread can't be started its chunk runs here too.
+  for (size_t k = 1; k < chunk_count; k++) {
+    started[k] = pthread_create(&threads[k], NULL, parallel_chunk_run, &chunks[k]) == 0;
+    if (!started[k]) {
+      parallel_chunk_run(&chunks[k]);
+    }
+  }
+  parallel_chunk_run(&chunks[0]);
+  for (size_t k = 1; k < chunk_count; k++) {
+    if (started[k]) {
+      pthread_join(threads[k], NULL);
+    }
+  }
+  for (size_t k = 0; k < chunk_count; k++) {
+    fn(ctx, chunks[k].begin - 1, chunks[k].begin);
+  }
+}
+
+static void bitarray_rotate_blockswap(bitarray_t* const bitarray,
+                                      const size_t bit_offset,
+                                      const size_t bit_length,
+                                      const size_t bit_left_amount) {
+  assert(bit_length >= bit_left_amount);
+  if (bit_left_amount == 0 || bit_left_amount == bit_length) {
+    return;
+  }
+  // [split - i, split) is the block still to be moved right and
+  // [split, split + j) the block still to be moved left.
+  const size_t split = bit_offset + bit_left_amount;
+  size_t i = bit_left_amount;
+  size_t j = bit_length - bit_left_amount;
+  while (i != j) {
+    if (i < WORD_SIZE) {
+      const word saved = bitarray_get_bits(bitarray, split - i, i);
+      bitarray_copy_bits(bitarray, split - i, bitarray, split, j);
+      bitarray_set_bits(bitarray, split - i + j, i, saved);
+      return;
+    }
+    if (j < WORD_SIZE) {
+      const word saved = bitarray_get_bits(bitarray, split, j);
+      bitarray_copy_bits(bitarray, split - i + j, bitarray, split - i, i);
+      bitarray_set_bits(bitarray, split - i, j, saved);
+      return;
+    }
+    if (i < j) {
+      bitarray_swap_ranges(bitarray, split - i, split + j - i, i);
+      j -= i;
+    } else {
+      bitarray_swap_ranges(bitarray, split - i, split, j);
+      i -= j;
+    }
+  }
+  bitarray_swap_ranges(bitarray, split - i, split, i);
+}
+
+static void bitarray_rotate_blocked(bitarray_t* const bitarray,
+                                    const size_t bit_offset,
+                                    const size_t bit_length,
+                                    const size_t bit_left_amount) {
+  assert(bit_length >= bit_left_amount);
+  if (bit_left_amount == 0 || bit_left_amount == bit_length) {
+    return;
+  }
+  // As in bitarray_rotate_blockswap, [split - i, split + j) is still to be
+  // rotated left by i.
+  const size_t block_bits = bitarray_get_block_bytes() * 8;
+  const size_t split = bit_offset + bit_left_amount;
+  size_t i = bit_left_amount;
+  size_t j = bit_length - bit_left_amount;
+  while (i > block_bits && j > block_bits) {
+    if (i < j) {
+      bitarray_swap_ranges(bitarray, split - i, split + j - i, i);
+      j -= i;
+    } else if (i > j) {
+      bitarray_swap_ranges(bitarray, split - i, split, j);
+      i -= j;
+    } else {
+      bitarray_swap_ranges(bitarray, split - i, split, i);
+      return;
+    }
+  }
+
+  const size_t start = split - i;
+  bitarray_t* const scratch = thread_scratch_get(((i < j) ? i : j) + WORD_SIZE);
+  if (scratch == NULL) {
+    bitarray_rotate_blockswap(bitarray, start, i + j, i);
+    return;
+  }
+  bitarray_rotate_through(bitarray, start, i + j, i, scratch);
+}
+
+static void bitarray_rotate_through(bitarray_t* const bitarray,
+                                    const size_t bit_offset,
+                                    const size_t bit_length,
+                                    const size_t bit_left_amount,
+                                    bitarray_t* const scratch) {
+  assert(bit_length >= bit_left_amount);
+  if (bit_left_amount == 0 || bit_left_amount == bit_length) {
+    return;
+  }
+  const size_t right = bit_length - bit_left_amount;
+  const bool save_left = bit_left_amount <= right;
+  const size_t saved = save_left ? bit_left_amount : right;
+  // The saved block goes to the far end of the subarray.  Keeping it in
+  // scratch at the same bit position within a word lets it go back with a
+  // memmove.
+  const size_t saved_index = save_left ? bit_offset + right : bit_offset;
+  const size_t phase = saved_index % WORD_SIZE;
+  assert(scratch->bit_sz >= phase + saved);
+  if (save_left) {
+    bitarray_copy_bits(scratch, phase, bitarray, bit_offset, saved);
+    bitarray_copy_bits(bitarray, bit_offset, bitarray, bit_offset + saved, right);
+  } else {
+    bitarray_copy_bits(scratch, phase, bitarray, bit_offset + bit_left_amount, saved);
+    bitarray_copy_bits(bitarray, bit_offset + saved, bitarray, bit_offset, bit_left_amount);
+  }
+  bitarray_copy_bits(bitarray, saved_index, scratch, phase, saved);
+}
+
+static bitarray_t* thread_scratch_get(const size_t bit_sz) {
+  if (thread_scratch != NULL && thread_scratch->bit_sz >= bit_sz) {
+    return thread_scratch;
+  }
+  if (bit_sz / 8 > bitarray_get_scratch_limit()) {
+    return NULL;
+  }
+  bitarray_free(thread_scratch);
+  thread_scratch = bitarray_new(bit_sz);
+  return thread_scratch;
+}
+
+static bool batch_add(struct rotation_batch* const batch,
+                      const size_t bit_offset,
+                      const size_t bit_length,
+                      const size_t bit_left_amount) {
+  assert(bit_left_amount > 0 && bit_left_amount < bit_length);
+  // Widening the region adds up to two segments and each split one more.
+  if (batch->segment_count + 5 > batch->capacity) {
+    const size_t capacity = 2 * batch->capacity + 8;
+    struct batch_segment* const segments =
+      realloc(batch->segments, capacity * sizeof(struct batch_segment));
+    if (segments == NULL) {
+      return false;
+    }
+    batch->segments = segments;
+    batch->capacity = capacity;
+  }
+
+  // Bits outside the region so far have not moved yet.
+  const size_t bit_end = bit_offset + bit_length;
+  if (batch->segment_count == 0) {
+    batch->lo = bit_offset;
+    batch->hi = bit_end;
+    batch->segments[0].src_index = bit_offset;
+    batch->segments[0].bit_length = bit_length;
+    batch->segment_count = 1;
+  }
+  if (bit_offset < batch->lo) {
+    memmove(batch->segments + 1, batch->segments,
+            batch->segment_count * sizeof(struct batch_segment));
+    batch->segments[0].src_index = bit_offset;
+    batch->segments[0].bit_length = batch->lo - bit_offset;
+    batch->segment_count++;
+    batch->lo = bit_offset;
+  }
+  if (bit_end > batch->hi) {
+    batch->segments[batch->segment_count].src_index = batch->hi;
+    batch->segments[batch->segment_count].bit_length = bit_end - batch->hi;
+    batch->segment_count++;
+    batch->hi = bit_end;
+  }
+
+  // Rotating the segments that make up the subarray rotates the subarray;
+  // like the bits themselves, they are rotated with three reversals.
+  const size_t begin = batch_split(batch, bit_offset - batch->lo);
+  const size_t middle = batch_split(batch, bit_offset - batch->lo + bit_left_amount);
+  const size_t end = batch_split(batch, bit_end - batch->lo);
+  batch_reverse(batch, begin, middle);
+  batch_reverse(batch, middle, end);
+  batch_reverse(batch, begin, end);
+  batch_merge(batch);
+  return true;
+}
+
+static size_t batch_split(struct rotation_batch* const batch, const size_t position) {
+  size_t segment_start = 0;
+  for (size_t i = 0; i < batch->segment_count; i++) {
+    struct batch_segment* const segment = &batch->segments[i];
+    if (position == segment_start) {
+      return i;
+    }
+    if (position < segment_start + segment->bit_length) {
+      const size_t head = position - segment_start;
+      memmove(segment + 1, segment,
+              (batch->segment_count - i) * sizeof(struct batch_segment));
+      batch->segment_count++;
+      segment[1].src_index = segment->src_index + head;
+      segment[1].bit_length = segment->bit_length - head;
+      segment->bit_length = head;
+      return i + 1;
+    }
+    segment_start += segment->bit_length;
+  }
+  assert(position == segment_start);
+  return batch->segment_count;
+}
+
+static void batch_reverse(struct rotation_batch* const batch,
+                          const size_t begin,
+                          const size_t end) {
+  for (size_t i = begin, j = end; i + 1 < j; i++, j--) {
+    const struct batch_segment segment = batch->segments[i];
+    batch->segments[i] = batch->segments[j - 1];
+    batch->segments[j - 1] = segment;
+  }
+}
+
+static void batch_merge(struct rotation_batch* const batch) {
+  size_t count = 1;
+  for (size_t i = 1; i < batch->segment_count; i++) {
+    struct batch_segment* const last = &batch->segments[count - 1];
+    if (last->src_index + last->bit_length == batch->segments[i].src_index) {
+      last->bit_length += batch->segments[i].bit_length;
+    } else {
+      batch->segments[count++] = batch->segments[i];
+    }
+  }
+  batch->segment_count = count;
+}
+
+static void batch_flush(bitarray_t* const bitarray,
+                        struct rotation_batch* const batch,
+                        const bitarray_rotation_t* const ops,
+                        const size_t end_op) {
+  if (batch->segment_count == 0) {
+    return;
+  }
+  const size_t segment_count = batch->segment_count;
+  batch->segment_count = 0;
+
+  // Drop segments at either end that stayed where they were.
+  const struct batch_segment* first = batch->segments;
+  const struct batch_segment* last = batch->segments + segment_count - 1;
+  size_t lo = batch->lo;
+  size_t hi = batch->hi;
+  if (first->src_index == lo) {
+    lo += first->bit_length;
+    first++;
+  }
+  if (first <= last && last->src_index + last->bit_length == hi) {
+    hi -= last->bit_length;
+    last--;
+  }
+  if (first > last) {
+    return;
+  }
+
+  // [lo, hi) = [a, hi) followed by [lo, a) is a plain left rotation by a - lo,
+  // which the rotation engines do in place.
+  if (last == first + 1 && last->src_index == lo &&
+      first->src_index == lo + last->bit_length) {
+    bitarray_rotate(bitarray, lo, hi - lo, -(ssize_t) last->bit_length);
+    return;
+  }
+
+  bitarray_t* const scratch = bitarray_new(hi - lo);
+  if (scratch == NULL) {
+    for (size_t i = batch->first_op; i < end_op; i++) {
+      bitarray_rotate(bitarray, ops[i].bit_offset, ops[i].bit_length, ops[i].bit_right_amount);
+    }
+    return;
+  }
+  bitarray_normalize(bitarray);
+  bitarray_copy_bits(scratch, 0, bitarray, lo, hi - lo);
+  size_t dst_index = lo;
+  for (const struct batch_segment* segment = first; segment <= last; segment++) {
+    bitarray_copy_bits(bitarray, dst_index, scratch, segment->src_index - lo,
+                       segment->bit_length);
+    dst_index += segment->bit_length;
+  }
+  bitarray_free(scratch);
+}
+
+static void bitarray_fill_bits(bitarray_t* const bitarray,
+                               const size_t bit_offset,
+                               const size_t bit_length,
+                               const bool value) {
+  const word pattern = value ? UINT64_MAX : 0;
+  size_t done = 0;
+  // Up to the first byte boundary, then whole bytes, then what is left.
+  if (bit_offset % 8 != 0 && bit_length > 0) {
+    done = 8 - bit_offset % 8;
+    if (done > bit_length) {
+      done = bit_length;
+    }
+    bitarray_set_bits(bitarray, bit_offset, done, pattern);
+  }
+  const size_t byte_count = (bit_length - done) / 8;
+  memset(bitarray->buf + (bit_offset + done) / 8, value ? 0xFF : 0, byte_count);
+  done += byte_count * 8;
+  if (done < bit_length) {
+    bitarray_set_bits(bitarray, bit_offset + done, bit_length - done, pattern);
+  }
+}
+
+static void bitarray_copy_bits(bitarray_t* const dst,
+                               const size_t dst_index,
+                               const bitarray_t* const src,
+                               const size_t src_index,
+                               const size_t bit_length) {
+  if (bit_length == 0) {
+    return;
+  }
+  // The bits before the first word (or byte) boundary of dst and after the
+  // last one are read before anything is written, so overlap cannot spoil
+  // them; the middle is moved by memmove or a direction-aware kernel.
+  const bool same_bytes = dst_index % 8 == src_index % 8;
+  const size_t unit = same_bytes ? 8 : WORD_SIZE;
+  size_t head = (unit - dst_index % unit) % unit;
+  if (head > bit_length) {
+    head = bit_length;
+  }
+  const size_t middle = (bit_length - head) / unit * unit;
+  const size_t tail = bit_length - head - middle;
+  const word head_bits = (head > 0) ? bitarray_get_bits(src, src_index, head) : 0;
+  const word tail_bits = (tail > 0) ?
+                         bitarray_get_bits(src, src_index + head + middle, tail) : 0;
+
+  if (middle > 0) {
+    const size_t dst_bit = dst_index + head;
+    const size_t src_bit = src_index + head;
+    if (same_bytes) {
+      memmove(dst->buf + dst_bit / 8, src->buf + src_bit / 8, middle / 8);
+    } else {
+      word* const dst_words = (word*) dst->buf + dst_bit / WORD_SIZE;
+      const word* const src_words = (const word*) src->buf + src_bit / WORD_SIZE;
+      if (dst == src && dst_bit > src_bit) {
+        copy_words_backward(dst_words, src_words, src_bit % WORD_SIZE, middle / WORD_SIZE);
+      } else {
+        // Stream only into another array: a line just read would be
+        // evicted again by a non-temporal store.
+        copy_words(dst_words, src_words, src_bit % WORD_SIZE, middle / WORD_SIZE,
+                   dst != src && middle >= bitarray_get_streaming_threshold());
+      }
+    }
+  }
+  if (head > 0) {
+    bitarray_set_bits(dst, dst_index, head, head_bits);
+  }
+  if (tail > 0) {
+    bitarray_set_bits(dst, dst_index + head + middle, tail, tail_bits);
+  }
+}
+
+word bitarray_get_aligned_block(const bitarray_t *const bitarray, const size_t byte_index) {
+  //assert(byte_index*8 < bitarray->bit_sz); 
+  return ((word *) bitarray->buf)[byte_index];
+}
+
+static word bitarray_get_word(const bitarray_t* const bitarray, const size_t bit_index) {
+  #ifdef IDEBUG
+  printf("bit_index: %lu. bitarray->bit_size: %lu\n", bit_index, bitarray->bit_sz);
+  #endif
+  assert(bitarray_word_in_bounds(bitarray, bit_index));
+	word result;
+  //this does not work as intendend because it is stored right to left instead of left to right.
+	word lw = ((word *) bitarray->buf)[bit_index/WORD_SIZE];
+	word rw = ((word *) bitarray->buf)[bit_index/WORD_SIZE + 1]; //relies on buf contianing a 64 bit word to the right of the word containing the current bi
+  #ifdef IDEBUG
+  printf("lw is: ");
+  print_word(lw);
+  //printf("lw is: %lX\n", lw);
+  printf("rw is: ");
+  print_word(rw);
+  //printf("rw is: %lX\n", rw);
+  #endif
+  uint_fast8_t x = WORD_SIZE - modulo(bit_index, WORD_SIZE);
+
+	//lw = ((word) (lw & TRAIL(x))) >> ((uint_fast8_t) (WORD_SIZE - x)); //the &s here are redundant?
+  if (WORD_SIZE - x >= WORD_SIZE)
+    lw = 0;
+  else
+    lw = lw >> (WORD_SIZE - x);
+  if (x >= WORD_SIZE)
+    rw = 0;
+  else
+    rw = rw << x; //how shifts manipulate the underlying memory is dependent on endianess
+  //rw = ((word) (rw & LEAD(WORD_SIZE - x))) >> (x);
+
+  #ifdef IDEBUG
+  // printf("x is: %hhi\n", x);
+  printf("lw shifted is: ");
+  print_word(lw);
+  //   printf("lw is: %lX\n", lw);
+  printf("rw shifted is: ");
+  print_word(rw);
+  // printf("rw is: %lX\n", rw);
+	#endif
+	result = lw | rw;
+  // printf("the result is: ");
+  // print_word(result);
+
+  return result;
+} 
+
+#ifndef NDEBUG
+static bool bitarray_word_in_bounds(const bitarray_t* const bitarray, const size_t bit_index) {
+  return (bit_index / WORD_SIZE + 2) * sizeof(word) <= bitarray->buf_bytes;
+}
+#endif
+
+static size_t bitarray_buf_bytes(const size_t bit_sz) {
+  return ((bit_sz + 7) / 8 + sizeof(word) + CACHE_LINE_BYTES - 1) /
+         CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+}
+
+static bool bitarray_alloc_buf(bitarray_t* const bitarray, const size_t bit_sz) {
+  const size_t buf_bytes = bitarray_buf_bytes(bit_sz);
+
+  if (buf_bytes >= HUGEPAGE_THRESHOLD) {
+    // Fresh anonymous pages are already zero, so nothing is touched until
+    // the bits are first written.
+    void* const buf = mmap(NULL, buf_bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+      // Only a hint; the array works the same without huge pages.
+      madvise(buf, buf_bytes, MADV_HUGEPAGE);
+#endif
+      bitarray->buf = buf;
+      bitarray->buf_bytes = buf_bytes;
+      bitarray->storage = STORAGE_MMAP;
+      return true;
+    }
+  }
+
+  void* buf;
+  if (posix_memalign(&buf, CACHE_LINE_BYTES, buf_bytes) != 0) {
+    return false;
+  }
+  memset(buf, 0, buf_bytes);
+  bitarray->buf = buf;
+  bitarray->buf_bytes = buf_bytes;
+  bitarray->storage = STORAGE_HEAP;
+  return true;
+}
+
+static void bitarray_free_buf(bitarray_t* const bitarray) {
+  switch (bitarray->storage) {
+  case STORAGE_MMAP:
+  case STORAGE_FILE_SHARED:
+  case STORAGE_FILE_PRIVATE:
+    munmap(bitarray->buf, bitarray->buf_bytes);
+    break;
+  case STORAGE_INLINE:
+    // Freed along with the struct.
+    break;
+  case STORAGE_ARENA:
+    // Released when the arena is reset.
+    break;
+  case STORAGE_VIEW:
+    // Belongs to whoever made the view.
+    break;
+  case STORAGE_HEAP:
+  default:
+    free(bitarray->buf);
+    break;
+  }
+  bitarray->buf = NULL;
+  bitarray->buf_bytes = 0;
+}
+
+static struct arena_chunk* arena_chunk_new(const size_t bytes,
+                                           const bitarray_arena_flags_t flags) {
+  const bool huge = (flags & BITARRAY_ARENA_HUGEPAGES) != 0;
+  const size_t page_bytes = huge ? ARENA_HUGEPAGE_BYTES : CACHE_LINE_BYTES;
+  const size_t chunk_bytes = (bytes + page_bytes - 1) / page_bytes * page_bytes;
+
+  struct arena_chunk* chunk = NULL;
+  bool mapped = false;
+  if (huge || chunk_bytes >= HUGEPAGE_THRESHOLD) {
+    void* const block = mmap(NULL, chunk_bytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+      madvise(block, chunk_bytes, MADV_HUGEPAGE);
+#endif
+      chunk = block;
+      mapped = true;
+    }
+  }
+  if (chunk == NULL) {
+    void* block;
+    if (posix_memalign(&block, CACHE_LINE_BYTES, chunk_bytes) != 0) {
+      return NULL;
+    }
+    chunk = block;
+  }
+  chunk->next = NULL;
+  chunk->bytes = chunk_bytes;
+  // Heap memory may hold anything; fresh mappings are zero past the header.
+  chunk->dirty = mapped ? ARENA_CHUNK_HEADER_BYTES : chunk_bytes;
+  chunk->mapped = mapped;
+  return chunk;
+}
+
+static void arena_chunk_free(struct arena_chunk* const chunk) {
+  if (chunk->mapped) {
+    munmap(chunk, chunk->bytes);
+  } else {
+    free(chunk);
+  }
+}
+
+static void* arena_chunk_take(struct arena_chunk* const chunk,
+                              const size_t offset,
+                              const size_t bytes) {
+  assert(offset % CACHE_LINE_BYTES == 0 && offset + bytes <= chunk->bytes);
+  char* const block = (char*) chunk + offset;
+  if (offset < chunk->dirty) {
+    const size_t dirty_bytes = chunk->dirty - offset;
+    memset(block, 0, (dirty_bytes < bytes) ? dirty_bytes : bytes);
+  }
+  if (offset + bytes > chunk->dirty) {
+    chunk->dirty = offset + bytes;
+  }
+  return block;
+}
+
+static void* arena_alloc(bitarray_arena_t* const arena, const size_t bytes) {
+  assert(bytes % CACHE_LINE_BYTES == 0);
+  if (bytes > arena->chunk_bytes - ARENA_CHUNK_HEADER_BYTES) {
+    // Too big for a regular chunk: give it one of its own.
+    struct arena_chunk* const chunk =
+      arena_chunk_new(ARENA_CHUNK_HEADER_BYTES + bytes, arena->flags);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->next = arena->oversized;
+    arena->oversized = chunk;
+    return arena_chunk_take(chunk, ARENA_CHUNK_HEADER_BYTES, bytes);
+  }
+
+  // Move on through the chunk list, adding a chunk at the end if needed,
+  // until one has room.  Every regular chunk is chunk_bytes long, so an
+  // empty one always does.
+  while (arena->current == NULL || arena->used + bytes > arena->current->bytes) {
+    struct arena_chunk* next = (arena->current == NULL) ? arena->chunks : arena->current->next;
+    if (next == NULL) {
+      next = arena_chunk_new(arena->chunk_bytes, arena->flags);
+      if (next == NULL) {
+        return NULL;
+      }
+      if (arena->current == NULL) {
+        arena->chunks = next;
+      } else {
+        arena->current->next = next;
+      }
+    }
+    arena->current = next;
+    arena->used = ARENA_CHUNK_HEADER_BYTES;
+  }
+  void* const block = arena_chunk_take(arena->current, arena->used, bytes);
+  arena->used += bytes;
+  return block;
+}
+
+static bool stream_read(const int fd,
+                        char* const buf,
+                        const size_t byte_count,
+                        const size_t byte_offset,
+                        const size_t block_bytes) {
+  size_t done = 0;
+  while (done < byte_count) {
+    const size_t count = (byte_count - done < block_bytes) ? byte_count - done : block_bytes;
+    const ssize_t got = pread(fd, buf + done, count, (off_t) (byte_offset + done));
+    if (got <= 0) {
+      return false;
+    }
+    done += (size_t) got;
+  }
+  return true;
+}
+
+static bool stream_write(const int fd,
+                         const char* const buf,
+                         const size_t byte_count,
+                         const size_t byte_offset,
+                         const size_t block_bytes) {
+  size_t done = 0;
+  while (done < byte_count) {
+    const size_t count = (byte_count - done < block_bytes) ? byte_count - done : block_bytes;
+    const ssize_t put = pwrite(fd, buf + done, count, (off_t) (byte_offset + done));
+    if (put <= 0) {
+      return false;
+    }
+    done += (size_t) put;
+  }
+  return true;
+}
+
+static bool stream_reverse(const struct stream_windows* const windows,
+                           const size_t bit_offset,
+                           const size_t bit_length) {
+  // [lp, rp) is the part of the range that still has to be reversed.
+  size_t lp = bit_offset;
+  size_t rp = bit_offset + bit_length;
+  while (rp - lp > windows->window_bits) {
+    // Keep at least two bytes between the windows, so that writing one back
+    // cannot clobber bits of the other.
+    size_t window_bits = (rp - lp) / 2 - 16;
+    if (window_bits > windows->window_bits) {
+      window_bits = windows->window_bits;
+    }
+    const size_t l_byte = lp / 8;
+    const size_t l_shift = lp % 8;
+    const size_t l_bytes = (l_shift + window_bits + 7) / 8;
+    const size_t r_byte = (rp - window_bits) / 8;
+    const size_t r_shift = (rp - window_bits) % 8;
+    const size_t r_bytes = (r_shift + window_bits + 7) / 8;
+    if (!stream_read(windows->fd, windows->left->buf, l_bytes, l_byte, windows->block_bytes) ||
+        !stream_read(windows->fd, windows->right->buf, r_bytes, r_byte, windows->block_bytes)) {
+      return false;
+    }
+    bitarray_reverse_fast(windows->left, l_shift, window_bits);
+    bitarray_reverse_fast(windows->right, r_shift, window_bits);
+
+    // The windows trade places.  The bits either side of each window in its
+    // first and last byte belong to the neighbouring data and must survive,
+    // so the left window is moved into a copy of the right one's bytes.
+    memcpy(windows->spare->buf, windows->right->buf, r_bytes);
+    bitarray_copy_bits(windows->spare, r_shift, windows->left, l_shift, window_bits);
+    bitarray_copy_bits(windows->left, l_shift, windows->right, r_shift, window_bits);
+    if (!stream_write(windows->fd, windows->left->buf, l_bytes, l_byte, windows->block_bytes) ||
+        !stream_write(windows->fd, windows->spare->buf, r_bytes, r_byte, windows->block_bytes)) {
+      return false;
+    }
+    lp += window_bits;
+    rp -= window_bits;
+  }
+
+  // What is left fits in one window.
+  if (rp - lp > 1) {
+    const size_t byte_index = lp / 8;
+    const size_t byte_count = (rp + 7) / 8 - byte_index;
+    if (!stream_read(windows->fd, windows->left->buf, byte_count, byte_index, windows->block_bytes)) {
+      return false;
+    }
+    bitarray_reverse_fast(windows->left, lp % 8, rp - lp);
+    if (!stream_write(windows->fd, windows->left->buf, byte_count, byte_index, windows->block_bytes)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool bitarray_is_mapped_file(const bitarray_t* const bitarray) {
+  return bitarray->storage == STORAGE_FILE_SHARED || bitarray->storage == STORAGE_FILE_PRIVATE;
+}
+
+static void bitarray_advise(const bitarray_t* const bitarray,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const int advice) {
+  // madvise works on whole pages.
+  const size_t page_bytes = (size_t) sysconf(_SC_PAGESIZE);
+  const size_t first = bit_offset / 8 / page_bytes * page_bytes;
+  const size_t last = (bit_offset + bit_length + 7) / 8;
+  madvise(bitarray->buf + first, last - first, advice);
+}
+
+static word bitarray_load_word(const bitarray_t* const bitarray, const size_t word_index) {
+  assert((word_index + 1) * sizeof(word) <= bitarray->buf_bytes);
+  return ((const word *) bitarray->buf)[word_index];
+}
+
+static void bitarray_store_word(bitarray_t* const bitarray,
+                                const size_t word_index,
+                                const word a_word) {
+  assert((word_index + 1) * sizeof(word) <= bitarray->buf_bytes);
+  ((word *) bitarray->buf)[word_index] = a_word;
+}
+
+static word bitarray_get_bits(const bitarray_t* const bitarray,
+                              const size_t bit_index,
+                              const size_t bit_count) {
+  assert(bit_count > 0 && bit_count <= WORD_SIZE);
+  assert(bit_index + bit_count <= bitarray->bit_sz);
+  const size_t word_index = bit_index / WORD_SIZE;
+  const size_t shift = bit_index % WORD_SIZE;
+  word result = bitarray_load_word(bitarray, word_index) >> shift;
+  if (shift + bit_count > WORD_SIZE) {
+    result |= bitarray_load_word(bitarray, word_index + 1) << (WORD_SIZE - shift);
+  }
+  return result & LEAD(bit_count);
+}
+
+static void bitarray_set_bits(bitarray_t* const bitarray,
+                              const size_t bit_index,
+                              const size_t bit_count,
+                              const word a_word) {
+  assert(bit_count > 0 && bit_count <= WORD_SIZE);
+  assert(bit_index + bit_count <= bitarray->bit_sz);
+  const size_t word_index = bit_index / WORD_SIZE;
+  const size_t shift = bit_index % WORD_SIZE;
+  const word value = a_word & LEAD(bit_count);
+  const word mask = LEAD(bit_count) << shift;
+  bitarray_store_word(bitarray, word_index,
+                      (bitarray_load_word(bitarray, word_index) & ~mask) | (value << shift));
+  if (shift + bit_count > WORD_SIZE) {
+    // The bits that spilled past the first word land in the low end of the
+    // next one.
+    const size_t spill = shift + bit_count - WORD_SIZE;
+    bitarray_store_word(bitarray, word_index + 1,
+                        (bitarray_load_word(bitarray, word_index + 1) & ~LEAD(spill)) |
+                        (value >> (WORD_SIZE - shift)));
+  }
+}
+
+
+static void bitarray_set_word(const bitarray_t* const bitarray, const size_t bit_index, const word a_word) {
+  assert(bitarray_word_in_bounds(bitarray, bit_index));
+  uint_fast8_t y = modulo(bit_index, WORD_SIZE);
+  assert (y >= 0);
+  assert(WORD_SIZE - y >= 0);
+  word lw, rw;
+
+  #ifdef IDEBUG
+  printf("y is: %hhi bit_index is: %lu \n a_word is: %lu", y, bit_index, a_word);
+  #endif
+
+  if (y >= WORD_SIZE)
+    lw = 0;
+  else
+    lw = a_word << y;
+
+  if (WORD_SIZE - y >= WORD_SIZE)
+    rw = 0;
+  else
+    rw = a_word >> (WORD_SIZE - y);
+  
+  #ifdef IDEBUG
+  printf("lw is: ");
+  print_word(lw);
+  printf("rw is: ");
+  print_word(rw);
+  #endif
+
+  word * buff = (word *) bitarray->buf;
+  lw |= buff[bit_index/WORD_SIZE] & LEAD(y);
+  #ifdef IDEBUG
+  printf("LEAD(y) is %lX\n", LEAD(y));
+  #endif
+  rw |=  buff[bit_index/WORD_SIZE + 1] & TRAIL(WORD_SIZE - y);
+  #ifdef IDEBUG
+  printf("TRAIL(WORD_SIZE - y) is %lX\n", TRAIL(WORD_SIZE - y));
+  #endif
+
+  #ifdef IDEBUG
+  printf("lw final is: ");
+  print_word(lw);
+  printf("rw final is: ");
+  print_word(rw);
+  #endif
+  buff[bit_index/WORD_SIZE] = lw;
+  buff[bit_index/WORD_SIZE + 1] = rw;
+
+  return;
+}
+
+static void print_bitarray(const bitarray_t* const bitarray, const size_t bit_index) {
+  size_t i = bit_index;
+  for (; i < bitarray->bit_sz; i++)
+    printf("%s", bitarray_get(bitarray, i) ? "1" : "0");
+  printf("\n");
+}
+
+static void print_word(const word a_word) {
+  bitarray_t* word_bitarray = bitarray_new((size_t) 64);
+  memcpy(word_bitarray->buf, &a_word, sizeof(a_word));
+  print_bitarray(word_bitarray, 0);
+  free(word_bitarray);
+}
+
+static word reverse_word(word v) {
+	static const unsigned char BitReverseTable256[256] = 
+{
+#   define R2(n)     n,     n + 2*64,     n + 1*64,     n + 3*64
+#   define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#   define R6(n) R4(n), R4(n + 2*4 ), R4(n + 1*4 ), R4(n + 3*4 )
+    R6(0), R6(2), R6(1), R6(3)
+};
+	word c; // c will get v reversed
+	unsigned char * p = (unsigned char *) &v;
+	unsigned char * q = (unsigned char *) &c;
+	q[7] = BitReverseTable256[p[0]]; 
+	q[6] = BitReverseTable256[p[1]]; 
+	q[5] = BitReverseTable256[p[2]]; 
+	q[4] = BitReverseTable256[p[3]];
+	q[3] = BitReverseTable256[p[4]]; 
+	q[2] = BitReverseTable256[p[5]]; 
+	q[1] = BitReverseTable256[p[6]]; 
+	q[0] = BitReverseTable256[p[7]];
+
+	return c;
+}
+
+static void reverse_words_table(word* restrict dst,
+                                const word* restrict src,
+                                const size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = reverse_word(src[n - 1 - i]);
+  }
+}
+
+#if defined(__x86_64__)
+// The vector kernels below all reverse a whole register at once: the bits
+// within each byte are reversed (with a nibble lookup through pshufb, or with
+// a single gf2p8affine against the bit-reversal matrix), and then the byte
+// order of the register is reversed.  A register loaded from src + i therefore
+// holds the reversed words destined for the mirror-image slot in dst.
+
+// GF(2) affine matrix that maps every byte to its bit reversal.
+#define GF2P8_BIT_REVERSE 0x8040201008040201ULL
+
+// rev4(i) in the low nibble and rev4(i) << 4, for the pshufb nibble lookup.
+#define NIBBLE_REVERSE_LO 0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, \
+                          0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF
+#define NIBBLE_REVERSE_HI 0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0, \
+                          0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0
+#define BYTE_REVERSE_128 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+
+__attribute__((target("ssse3")))
+static void reverse_words_ssse3(word* restrict dst,
+                                const word* restrict src,
+                                const size_t n) {
+  const __m128i lo_table = _mm_setr_epi8(NIBBLE_REVERSE_HI);
+  const __m128i hi_table = _mm_setr_epi8(NIBBLE_REVERSE_LO);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  const __m128i byte_reverse = _mm_setr_epi8(BYTE_REVERSE_128);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+    v = _mm_or_si128(_mm_shuffle_epi8(lo_table, _mm_and_si128(v, nibble)),
+                     _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+    v = _mm_shuffle_epi8(v, byte_reverse);
+    _mm_storeu_si128((__m128i*) (dst + n - i - 2), v);
+  }
+  for (; i < n; i++) {
+    dst[n - 1 - i] = reverse_word(src[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+static void reverse_words_avx2(word* restrict dst,
+                               const word* restrict src,
+                               const size_t n) {
+  const __m256i lo_table = _mm256_setr_epi8(NIBBLE_REVERSE_HI, NIBBLE_REVERSE_HI);
+  const __m256i hi_table = _mm256_setr_epi8(NIBBLE_REVERSE_LO, NIBBLE_REVERSE_LO);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i byte_reverse = _mm256_setr_epi8(BYTE_REVERSE_128, BYTE_REVERSE_128);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+    v = _mm256_or_si256(_mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble)),
+                        _mm256_shuffle_epi8(hi_table,
+                                            _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    v = _mm256_shuffle_epi8(v, byte_reverse);
+    v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 0, 3, 2));
+    _mm256_storeu_si256((__m256i*) (dst + n - i - 4), v);
+  }
+  for (; i < n; i++) {
+    dst[n - 1 - i] = reverse_word(src[i]);
+  }
+}
+
+__attribute__((target("avx2,gfni")))
+static void reverse_words_avx2_gfni(word* restrict dst,
+                                    const word* restrict src,
+                                    const size_t n) {
+  const __m256i matrix = _mm256_set1_epi64x((long long) GF2P8_BIT_REVERSE);
+  const __m256i byte_reverse = _mm256_setr_epi8(BYTE_REVERSE_128, BYTE_REVERSE_128);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+    v = _mm256_gf2p8affine_epi64_epi8(v, matrix, 0);
+    v = _mm256_shuffle_epi8(v, byte_reverse);
+    v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 0, 3, 2));
+    _mm256_storeu_si256((__m256i*) (dst + n - i - 4), v);
+  }
+  for (; i < n; i++) {
+    dst[n - 1 - i] = reverse_word(src[i]);
+  }
+}
+
+// Byte indices 63, 62, ..., 0 for vpermb.
+#define BYTE_REVERSE_512 \
+  _mm512_set_epi64(0x0001020304050607LL, 0x08090A0B0C0D0E0FLL, \
+                   0x1011121314151617LL, 0x18191A1B1C1D1E1FLL, \
+                   0x2021222324252627LL, 0x28292A2B2C2D2E2FLL, \
+                   0x3031323334353637LL, 0x38393A3B3C3D3E3FLL)
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void reverse_words_avx512vbmi(word* restrict dst,
+                                     const word* restrict src,
+                                     const size_t n) {
+  const __m512i lo_table = _mm512_broadcast_i32x4(_mm_setr_epi8(NIBBLE_REVERSE_HI));
+  const __m512i hi_table = _mm512_broadcast_i32x4(_mm_setr_epi8(NIBBLE_REVERSE_LO));
+  const __m512i nibble = _mm512_set1_epi8(0x0F);
+  const __m512i byte_reverse = BYTE_REVERSE_512;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i v = _mm512_loadu_si512((const void*) (src + i));
+    v = _mm512_or_si512(_mm512_shuffle_epi8(lo_table, _mm512_and_si512(v, nibble)),
+                        _mm512_shuffle_epi8(hi_table,
+                                            _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble)));
+    v = _mm512_permutexvar_epi8(byte_reverse, v);
+    _mm512_storeu_si512((void*) (dst + n - i - 8), v);
+  }
+  for (; i < n; i++) {
+    dst[n - 1 - i] = reverse_word(src[i]);
+  }
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi,gfni")))
+static void reverse_words_avx512vbmi_gfni(word* restrict dst,
+                                          const word* restrict src,
+                                          const size_t n) {
+  const __m512i matrix = _mm512_set1_epi64((long long) GF2P8_BIT_REVERSE);
+  const __m512i byte_reverse = BYTE_REVERSE_512;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i v = _mm512_loadu_si512((const void*) (src + i));
+    v = _mm512_gf2p8affine_epi64_epi8(v, matrix, 0);
+    v = _mm512_permutexvar_epi8(byte_reverse, v);
+    _mm512_storeu_si512((void*) (dst + n - i - 8), v);
+  }
+  for (; i < n; i++) {
+    dst[n - 1 - i] = reverse_word(src[i]);
+  }
+}
+
+static bool cpu_has_ssse3(void) {
+  return __builtin_cpu_supports("ssse3");
+}
+
+static bool cpu_has_avx2(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+static bool cpu_has_avx2_gfni(void) {
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("gfni");
+}
+
+static bool cpu_has_avx512vbmi(void) {
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+         __builtin_cpu_supports("avx512vbmi");
+}
+
+static bool cpu_has_avx512vbmi_gfni(void) {
+  return cpu_has_avx512vbmi() && __builtin_cpu_supports("gfni");
+}
+#endif  // defined(__x86_64__)
+
+static bool cpu_has_nothing(void) {
+  return true;
+}
+
+// Every reverse_words kernel, best first.  reverse_words_resolve takes the
+// first one whose CPU check passes, so the table always ends with a kernel
+// that runs anywhere.
+static const struct {
+  const char* name;
+  bool (*supported)(void);
+  reverse_words_fn kernel;
+} reverse_words_kernels[] = {
+#if defined(__x86_64__)
+  { "avx512vbmi+gfni", cpu_has_avx512vbmi_gfni, reverse_words_avx512vbmi_gfni },
+  { "avx512vbmi", cpu_has_avx512vbmi, reverse_words_avx512vbmi },
+  { "avx2+gfni", cpu_has_avx2_gfni, reverse_words_avx2_gfni },
+  { "avx2", cpu_has_avx2, reverse_words_avx2 },
+  { "ssse3", cpu_has_ssse3, reverse_words_ssse3 },
+#endif
+  { "table", cpu_has_nothing, reverse_words_table },
+};
+
+static void reverse_words_select(void) {
+  #if defined(__x86_64__)
+  __builtin_cpu_init();
+  #endif
+  const size_t count = sizeof(reverse_words_kernels) / sizeof(reverse_words_kernels[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (reverse_words_kernels[i].supported()) {
+      reverse_words_name = reverse_words_kernels[i].name;
+      reverse_words = reverse_words_kernels[i].kernel;
+      return;
+    }
+  }
+}
+
+static void reverse_words_resolve(word* restrict dst,
+                                  const word* restrict src,
+                                  const size_t n) {
+  reverse_words_select();
+  reverse_words(dst, src, n);
+}
+
+const char* bitarray_get_reverse_kernel(void) {
+  if (reverse_words_name == NULL) {
+    reverse_words_select();
+  }
+  return reverse_words_name;
+}
+
+
+static size_t bitarray_count_physical(const bitarray_t* const bitarray,
+                                      const size_t bit_offset,
+                                      const size_t bit_length) {
+  if (bit_length == 0) {
+    return 0;
+  }
+  if (bitarray->tree != NULL) {
+    return bittreap_count(bitarray->tree, bit_offset, bit_length);
+  }
+  const size_t first_word = bit_offset / WORD_SIZE;
+  const size_t last_word = (bit_offset + bit_length - 1) / WORD_SIZE;
+  const size_t shift = bit_offset % WORD_SIZE;
+  if (first_word == last_word) {
+    return (size_t) __builtin_popcountll((bitarray_load_word(bitarray, first_word) >> shift) &
+                                         LEAD(bit_length));
+  }
+  // Mask the two end words; everything in between goes to the kernel.
+  const size_t tail_bits = bit_offset + bit_length - last_word * WORD_SIZE;
+  return (size_t) __builtin_popcountll(bitarray_load_word(bitarray, first_word) >> shift) +
+         count_words((const word*) bitarray->buf + first_word + 1, last_word - first_word - 1) +
+         (size_t) __builtin_popcountll(bitarray_load_word(bitarray, last_word) & LEAD(tail_bits));
+}
+
+static void bitarray_invalidate_rank(bitarray_t* const bitarray) {
+  if (bitarray->rank != NULL) {
+    bitarray->rank->stale = true;
+  }
+}
+
+static void rank_index_fill(bitarray_t* const bitarray) {
+  struct rank_index* const rank = bitarray->rank;
+  const size_t blocks_per_superblock = RANK_SUPERBLOCK_BITS / RANK_BLOCK_BITS;
+  size_t total = 0;
+  size_t superblock_start = 0;
+  for (size_t block = 0; block < rank->block_count; block++) {
+    if (block % blocks_per_superblock == 0) {
+      rank->superblocks[block / blocks_per_superblock] = total;
+      superblock_start = total;
+    }
+    rank->blocks[block] = (uint16_t) (total - superblock_start);
+    const size_t bit_index = block * RANK_BLOCK_BITS;
+    if (bit_index < bitarray->bit_sz) {
+      const size_t bit_length = (bitarray->bit_sz - bit_index < RANK_BLOCK_BITS) ?
+                                bitarray->bit_sz - bit_index : RANK_BLOCK_BITS;
+      total += bitarray_count_physical(bitarray, bit_index, bit_length);
+    }
+  }
+  rank->total = total;
+  rank->stale = false;
+}
+
+static void rank_index_free(struct rank_index* const rank) {
+  if (rank == NULL) {
+    return;
+  }
+  free(rank->superblocks);
+  free(rank->blocks);
+  free(rank);
+}
+
+static size_t select_in_word(word a_word, size_t k) {
+  // Drop the k lowest set bits; the lowest one left is the answer.
+  for (; k > 0; k--) {
+    a_word &= a_word - 1;
+  }
+  return (size_t) __builtin_ctzll(a_word);
+}
+
+static size_t bitarray_find_next(const bitarray_t* const bitarray,
+                                 const size_t bit_index,
+                                 const size_t end,
+                                 const bool value) {
+  if (bit_index >= end) {
+    return end;
+  }
+  // Searching for a clear bit is searching the complement for a set one.
+  const word flip = value ? 0 : UINT64_MAX;
+  size_t word_index = bit_index / WORD_SIZE;
+  word a_word = (bitarray_load_word(bitarray, word_index) ^ flip) &
+                ~LEAD(bit_index % WORD_SIZE);
+  if (a_word == 0) {
+    const size_t last_word = (end - 1) / WORD_SIZE;
+    if (word_index == last_word) {
+      return end;
+    }
+    word_index += 1 + scan_words_forward((const word*) bitarray->buf + word_index + 1,
+                                         last_word - word_index, flip);
+    if (word_index > last_word) {
+      return end;
+    }
+    a_word = bitarray_load_word(bitarray, word_index) ^ flip;
+  }
+  // A clear search can land on the zero bits past bit_sz; those are past end.
+  const size_t found = word_index * WORD_SIZE + (size_t) __builtin_ctzll(a_word);
+  return (found < end) ? found : end;
+}
+
+static size_t scan_words_forward_portable(const word* const words,
+                                          const size_t n,
+                                          const word skip) {
+  for (size_t i = 0; i < n; i++) {
+    if (words[i] != skip) {
+      return i;
+    }
+  }
+  return n;
+}
+
+static size_t scan_words_backward_portable(const word* const words,
+                                           const size_t n,
+                                           const word skip) {
+  for (size_t i = n; i > 0; i--) {
+    if (words[i - 1] != skip) {
+      return i - 1;
+    }
+  }
+  return n;
+}
+
+#if defined(__x86_64__)
+// Both AVX2 scans test eight words per step and leave the step that stopped
+// them to the portable scan.
+__attribute__((target("avx2")))
+static size_t scan_words_forward_avx2(const word* const words,
+                                      const size_t n,
+                                      const word skip) {
+  const __m256i pattern = _mm256_set1_epi64x((long long) skip);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i diff = _mm256_or_si256(
+      _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (words + i)), pattern),
+      _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (words + i + 4)), pattern));
+    if (!_mm256_testz_si256(diff, diff)) {
+      break;
+    }
+  }
+  return i + scan_words_forward_portable(words + i, n - i, skip);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_words_backward_avx2(const word* const words,
+                                       const size_t n,
+                                       const word skip) {
+  const __m256i pattern = _mm256_set1_epi64x((long long) skip);
+  size_t i = n;
+  for (; i >= 8; i -= 8) {
+    const __m256i diff = _mm256_or_si256(
+      _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (words + i - 8)), pattern),
+      _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (words + i - 4)), pattern));
+    if (!_mm256_testz_si256(diff, diff)) {
+      break;
+    }
+  }
+  const size_t found = scan_words_backward_portable(words, i, skip);
+  return (found == i) ? n : found;
+}
+#endif  // defined(__x86_64__)
+
+// Every pair of scan_words kernels, best first, as for reverse_words_kernels.
+static const struct {
+  const char* name;
+  bool (*supported)(void);
+  scan_words_fn forward;
+  scan_words_fn backward;
+} scan_words_kernels[] = {
+#if defined(__x86_64__)
+  { "avx2", cpu_has_avx2, scan_words_forward_avx2, scan_words_backward_avx2 },
+#endif
+  { "portable", cpu_has_nothing, scan_words_forward_portable, scan_words_backward_portable },
+};
+
+static void scan_words_select(void) {
+  #if defined(__x86_64__)
+  __builtin_cpu_init();
+  #endif
+  const size_t count = sizeof(scan_words_kernels) / sizeof(scan_words_kernels[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (scan_words_kernels[i].supported()) {
+      scan_words_forward = scan_words_kernels[i].forward;
+      scan_words_backward = scan_words_kernels[i].backward;
+      return;
+    }
+  }
+}
+
+static size_t scan_words_forward_resolve(const word* const words,
+                                         const size_t n,
+                                         const word skip) {
+  scan_words_select();
+  return scan_words_forward(words, n, skip);
+}
+
+static size_t scan_words_backward_resolve(const word* const words,
+                                          const size_t n,
+                                          const word skip) {
+  scan_words_select();
+  return scan_words_backward(words, n, skip);
+}
+
+static inline word combine_words(const bitarray_op_t op, const word a_word, const word b_word) {
+  switch (op) {
+    case BITARRAY_OP_AND:
+      return a_word & b_word;
+    case BITARRAY_OP_OR:
+      return a_word | b_word;
+    case BITARRAY_OP_XOR:
+      return a_word ^ b_word;
+    case BITARRAY_OP_ANDNOT:
+      return a_word & ~b_word;
+    case BITARRAY_OP_NOT:
+    default:
+      return ~a_word;
+  }
+}
+
+static inline word shifted_word(const word* const words, const size_t i, const size_t shift) {
+  return (shift == 0) ? words[i] :
+         (words[i] >> shift) | (words[i + 1] << (WORD_SIZE - shift));
+}
+
+static void op_word_blocks(void* const ctx, const size_t begin, const size_t end) {
+  const struct op_blocks* const blocks = ctx;
+  for (size_t block = begin; block < end; block++) {
+    const size_t first = block * OP_BLOCK_WORDS;
+    const size_t n = (blocks->word_count - first < OP_BLOCK_WORDS) ?
+                     blocks->word_count - first : OP_BLOCK_WORDS;
+    op_words(blocks->dst + first, blocks->a + first, blocks->a_shift,
+             (blocks->b != NULL) ? blocks->b + first : NULL, blocks->b_shift, n, blocks->op,
+             blocks->streaming);
+  }
+}
+
+static void op_words_portable(word* const dst,
+                              const word* const a,
+                              const size_t a_shift,
+                              const word* const b,
+                              const size_t b_shift,
+                              const size_t n,
+                              const bitarray_op_t op,
+                              const bool streaming) {
+  (void) streaming;
+  for (size_t i = 0; i < n; i++) {
+    const word b_word = (b != NULL) ? shifted_word(b, i, b_shift) : 0;
+    dst[i] = combine_words(op, shifted_word(a, i, a_shift), b_word);
+  }
+}
+
+// Returns how many of n words at dst come before the first 32-byte boundary,
+// where aligned non-temporal vector stores can start.
+static inline size_t stream_alignment_words(const word* const dst, const size_t n) {
+  const size_t words = (32 - (uintptr_t) dst % 32) % 32 / sizeof(word);
+  return (words < n) ? words : n;
+}
+
+#if defined(__x86_64__)
+// Stores four words at dst, which must be 32-byte aligned if streaming is
+// set, bypassing the cache if it is.
+__attribute__((target("avx2")))
+static inline void store_avx2(word* const dst, const __m256i value, const bool streaming) {
+  if (streaming) {
+    _mm256_stream_si256((__m256i*) dst, value);
+  } else {
+    _mm256_storeu_si256((__m256i*) dst, value);
+  }
+}
+
+// Four source words starting at bit shift of words[i].  A shift count of 64
+// makes _mm256_sll_epi64 return zero, so shift 0 needs no special case.
+__attribute__((target("avx2")))
+static inline __m256i load_shifted_avx2(const word* const words,
+                                        const size_t i,
+                                        const __m128i shift,
+                                        const __m128i back_shift) {
+  const __m256i lo = _mm256_loadu_si256((const __m256i*) (words + i));
+  const __m256i hi = _mm256_loadu_si256((const __m256i*) (words + i + 1));
+  return _mm256_or_si256(_mm256_srl_epi64(lo, shift), _mm256_sll_epi64(hi, back_shift));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i combine_avx2(const bitarray_op_t op, const __m256i a, const __m256i b) {
+  switch (op) {
+    case BITARRAY_OP_AND:
+      return _mm256_and_si256(a, b);
+    case BITARRAY_OP_OR:
+      return _mm256_or_si256(a, b);
+    case BITARRAY_OP_XOR:
+      return _mm256_xor_si256(a, b);
+    case BITARRAY_OP_ANDNOT:
+      return _mm256_andnot_si256(b, a);
+    case BITARRAY_OP_NOT:
+    default:
+      return _mm256_xor_si256(a, _mm256_set1_epi64x(-1));
+  }
+}
+
+__attribute__((target("avx2")))
+static void op_words_avx2(word* const dst,
+                          const word* const a,
+                          const size_t a_shift,
+                          const word* const b,
+                          const size_t b_shift,
+                          const size_t n,
+                          const bitarray_op_t op,
+                          const bool streaming) {
+  size_t i = 0;
+  if (streaming) {
+    // Non-temporal stores must be aligned; bring dst to 32 bytes first.
+    i = stream_alignment_words(dst, n);
+    op_words_portable(dst, a, a_shift, b, b_shift, i, op, false);
+  }
+  if (a_shift == 0 && (b == NULL || b_shift == 0)) {
+    // Everything lines up: plain loads, so the loop runs at memory speed.
+    for (; i + 4 <= n; i += 4) {
+      const __m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+      const __m256i vb = (b != NULL) ? _mm256_loadu_si256((const __m256i*) (b + i)) : va;
+      store_avx2(dst + i, combine_avx2(op, va, vb), streaming);
+    }
+  } else {
+    const __m128i a_right = _mm_cvtsi64_si128((long long) a_shift);
+    const __m128i a_left = _mm_cvtsi64_si128((long long) (WORD_SIZE - a_shift));
+    const __m128i b_right = _mm_cvtsi64_si128((long long) b_shift);
+    const __m128i b_left = _mm_cvtsi64_si128((long long) (WORD_SIZE - b_shift));
+    for (; i + 4 <= n; i += 4) {
+      const __m256i va = load_shifted_avx2(a, i, a_right, a_left);
+      const __m256i vb = (b != NULL) ? load_shifted_avx2(b, i, b_right, b_left) : va;
+      store_avx2(dst + i, combine_avx2(op, va, vb), streaming);
+    }
+  }
+  if (streaming) {
+    // Non-temporal stores are weakly ordered; fence them before returning.
+    _mm_sfence();
+  }
+  op_words_portable(dst + i, a + i, a_shift, (b != NULL) ? b + i : NULL, b_shift, n - i, op,
+                    false);
 }
+#endif  // defined(__x86_64__)
 
-// ******************************* Functions. Added By Isaac ***********************
+// Every op_words kernel, best first, as for reverse_words_kernels.
+static const struct {
+  const char* name;
+  bool (*supported)(void);
+  op_words_fn kernel;
+} op_words_kernels[] = {
+#if defined(__x86_64__)
+  { "avx2", cpu_has_avx2, op_words_avx2 },
+#endif
+  { "portable", cpu_has_nothing, op_words_portable },
+};
 
-static void bitarray_reverse_slow(bitarray_t* const bitarray,
-                                  const size_t bit_offset,
-                                  const size_t bit_length) {
-  int lp = bit_offset;
-  int rp = bit_offset + bit_length - 1;
-  bool lbit, rbit;
-  for(int i = 0; i < bit_length/2 ; i++) {
-    lbit = bitarray_get(bitarray, lp);
-    rbit = bitarray_get(bitarray, rp);
-    bitarray_set(bitarray, lp, rbit);
-    bitarray_set(bitarray, rp, lbit);
-    lp++;
-    rp--;
+static void op_words_select(void) {
+  #if defined(__x86_64__)
+  __builtin_cpu_init();
+  #endif
+  const size_t count = sizeof(op_words_kernels) / sizeof(op_words_kernels[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (op_words_kernels[i].supported()) {
+      op_words_name = op_words_kernels[i].name;
+      op_words = op_words_kernels[i].kernel;
+      return;
+    }
   }
 }
 
-static void bitarray_reverse_fast(bitarray_t* const bitarray,
-                                  const size_t bit_offset,
-                                  const size_t bit_length) {
-  //assert(bit_offset + bit_length <= bitarray->bit_sz);
-  size_t lp = bit_offset;
-  size_t rp = bit_offset + bit_length -1;
-  bool lbit, rbit;
-  word lword, rword;
-  //assert(rp < bitarray->bit_sz);
-  if (bit_length < WORD_SIZE*4) {
-    bitarray_reverse_slow(bitarray, bit_offset, bit_length);
+static void op_words_resolve(word* const dst,
+                             const word* const a,
+                             const size_t a_shift,
+                             const word* const b,
+                             const size_t b_shift,
+                             const size_t n,
+                             const bitarray_op_t op,
+                             const bool streaming) {
+  op_words_select();
+  op_words(dst, a, a_shift, b, b_shift, n, op, streaming);
+}
+
+static void copy_words_portable(word* const dst,
+                                const word* const src,
+                                const size_t shift,
+                                const size_t n,
+                                const bool streaming) {
+  (void) streaming;
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = shifted_word(src, i, shift);
   }
-  else {
-    for(int i = 0; i < 2*WORD_SIZE ; i++) {
-      lbit = bitarray_get(bitarray, lp);
-      rbit = bitarray_get(bitarray, rp);
-      bitarray_set(bitarray, lp, rbit);
-      bitarray_set(bitarray, rp, lbit);
-      lp++;
-      rp--;
-    }
-    rp -= WORD_SIZE - 1;
-    //assert(lp < rp);
-    #ifdef IDEBUG
-    printf("bitarray prior to paralleism: ");
-    print_bitarray(bitarray, 257);
-    #endif
-    while(lp <= rp - WORD_SIZE) {
-      #ifdef IDEBUG
-      printf("we're actually using parallelism\n");
-      #endif
-      lword = bitarray_get_word(bitarray, lp);
-      rword = bitarray_get_word(bitarray, rp);
-
-      #ifdef IDEBUG
-      printf("lword is: ");
-      print_word(lword);
-      printf("rword is: ");
-      print_word(rword);
-      printf("lword reverse is: ");
-      print_word(reverse_word(lword));
-      printf("rword reverse is: "); 
-      print_word(reverse_word(rword));
-      #endif
-      bitarray_set_word(bitarray, lp, reverse_word(rword));
-      bitarray_set_word(bitarray, rp, reverse_word(lword));
-      lp+=WORD_SIZE;
-      rp-=WORD_SIZE;
-    }
-    rp += WORD_SIZE-1;
-    #ifdef IDEBUG
-    printf("lp is: %i and rp is: %i\n", lp, rp);
-    #endif
-    while (lp < rp) {
-      lbit = bitarray_get(bitarray, lp);
-      rbit = bitarray_get(bitarray, rp);
-      bitarray_set(bitarray, lp, rbit);
-      bitarray_set(bitarray, rp, lbit);
-      lp++;
-      rp--;
+}
+
+static void copy_words_backward(word* const dst,
+                                const word* const src,
+                                const size_t shift,
+                                const size_t n) {
+  assert(shift != 0);
+  // dst[i] may be src[i] itself, so each source word is loaded once and
+  // carried down to the next step rather than read again.
+  word high = src[n];
+  for (size_t i = n; i > 0; i--) {
+    const word low = src[i - 1];
+    dst[i - 1] = (low >> shift) | (high << (WORD_SIZE - shift));
+    high = low;
+  }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void copy_words_avx2(word* const dst,
+                            const word* const src,
+                            const size_t shift,
+                            const size_t n,
+                            const bool streaming) {
+  const __m128i right = _mm_cvtsi64_si128((long long) shift);
+  const __m128i left = _mm_cvtsi64_si128((long long) (WORD_SIZE - shift));
+  size_t i = 0;
+  if (streaming) {
+    i = stream_alignment_words(dst, n);
+    copy_words_portable(dst, src, shift, i, false);
+  }
+  for (; i + 4 <= n; i += 4) {
+    store_avx2(dst + i, load_shifted_avx2(src, i, right, left), streaming);
+  }
+  if (streaming) {
+    _mm_sfence();
+  }
+  copy_words_portable(dst + i, src + i, shift, n - i, false);
+}
+#endif  // defined(__x86_64__)
+
+// Every copy_words kernel, best first, as for reverse_words_kernels.
+static const struct {
+  const char* name;
+  bool (*supported)(void);
+  copy_words_fn kernel;
+} copy_words_kernels[] = {
+#if defined(__x86_64__)
+  { "avx2", cpu_has_avx2, copy_words_avx2 },
+#endif
+  { "portable", cpu_has_nothing, copy_words_portable },
+};
+
+static void copy_words_select(void) {
+  #if defined(__x86_64__)
+  __builtin_cpu_init();
+  #endif
+  const size_t count = sizeof(copy_words_kernels) / sizeof(copy_words_kernels[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (copy_words_kernels[i].supported()) {
+      copy_words_name = copy_words_kernels[i].name;
+      copy_words = copy_words_kernels[i].kernel;
+      return;
     }
   }
-  return;
 }
 
-static void bitarray_rotate_slow(bitarray_t* const bitarray,
-                                 const size_t bit_offset,
-                                 const size_t bit_length,
-                                 const size_t bit_left_amount) {
-  assert(bit_length >= bit_left_amount);
-  bitarray_reverse_slow(bitarray, bit_offset, bit_left_amount); //reverse a
-  bitarray_reverse_slow(bitarray, bit_offset + bit_left_amount, bit_length-bit_left_amount); //reverse b
-  bitarray_reverse_slow(bitarray, bit_offset, bit_length);
+static void copy_words_resolve(word* const dst,
+                               const word* const src,
+                               const size_t shift,
+                               const size_t n,
+                               const bool streaming) {
+  copy_words_select();
+  copy_words(dst, src, shift, n, streaming);
 }
 
-static void bitarray_rotate_fast(bitarray_t* const bitarray,
-                                 const size_t bit_offset,
-                                 const size_t bit_length,
-                                 const size_t bit_left_amount) {
-  assert(bit_length >= bit_left_amount);
-  bitarray_reverse_fast(bitarray, bit_offset, bit_left_amount); //reverse a
-  bitarray_reverse_fast(bitarray, bit_offset + bit_left_amount, bit_length-bit_left_amount); //reverse b
-  bitarray_reverse_fast(bitarray, bit_offset, bit_length);
+static size_t mismatch_words_portable(const word* const a,
+                                      const word* const b,
+                                      const size_t b_shift,
+                                      const size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (a[i] != shifted_word(b, i, b_shift)) {
+      return i;
+    }
+  }
+  return n;
 }
 
-word bitarray_get_aligned_block(const bitarray_t *const bitarray, const size_t byte_index) {
-  //assert(byte_index*8 < bitarray->bit_sz); 
-  return ((word *) bitarray->buf)[byte_index];
+#if defined(__x86_64__)
+// Tests eight words per step and leaves the step that stopped it to the
+// portable loop.
+__attribute__((target("avx2")))
+static size_t mismatch_words_avx2(const word* const a,
+                                  const word* const b,
+                                  const size_t b_shift,
+                                  const size_t n) {
+  const __m128i right = _mm_cvtsi64_si128((long long) b_shift);
+  const __m128i left = _mm_cvtsi64_si128((long long) (WORD_SIZE - b_shift));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i diff = _mm256_or_si256(
+      _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (a + i)),
+                       load_shifted_avx2(b, i, right, left)),
+      _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (a + i + 4)),
+                       load_shifted_avx2(b, i + 4, right, left)));
+    if (!_mm256_testz_si256(diff, diff)) {
+      break;
+    }
+  }
+  return i + mismatch_words_portable(a + i, b + i, b_shift, n - i);
 }
+#endif  // defined(__x86_64__)
 
-static word bitarray_get_word(const bitarray_t* const bitarray, const size_t bit_index) {
-  #ifdef IDEBUG
-  printf("bit_index: %lu. bitarray->bit_size: %lu\n", bit_index, bitarray->bit_sz);
-  #endif
-  assert(bit_index <= bitarray->bit_sz - 2*WORD_SIZE);
-	word result;
-  //this does not work as intendend because it is stored right to left instead of left to right.
-	word lw = ((word *) bitarray->buf)[bit_index/WORD_SIZE];
-	word rw = ((word *) bitarray->buf)[bit_index/WORD_SIZE + 1]; //relies on buf contianing a 64 bit word to the right of the word containing the current bi
-  #ifdef IDEBUG
-  printf("lw is: ");
-  print_word(lw);
-  //printf("lw is: %lX\n", lw);
-  printf("rw is: ");
-  print_word(rw);
-  //printf("rw is: %lX\n", rw);
+// Every mismatch_words kernel, best first, as for reverse_words_kernels.
+static const struct {
+  const char* name;
+  bool (*supported)(void);
+  mismatch_words_fn kernel;
+} mismatch_words_kernels[] = {
+#if defined(__x86_64__)
+  { "avx2", cpu_has_avx2, mismatch_words_avx2 },
+#endif
+  { "portable", cpu_has_nothing, mismatch_words_portable },
+};
+
+static void mismatch_words_select(void) {
+  #if defined(__x86_64__)
+  __builtin_cpu_init();
   #endif
-  uint_fast8_t x = WORD_SIZE - modulo(bit_index, WORD_SIZE);
+  const size_t count = sizeof(mismatch_words_kernels) / sizeof(mismatch_words_kernels[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (mismatch_words_kernels[i].supported()) {
+      mismatch_words_name = mismatch_words_kernels[i].name;
+      mismatch_words = mismatch_words_kernels[i].kernel;
+      return;
+    }
+  }
+}
 
-	//lw = ((word) (lw & TRAIL(x))) >> ((uint_fast8_t) (WORD_SIZE - x)); //the &s here are redundant?
-  if (WORD_SIZE - x >= WORD_SIZE)
-    lw = 0;
-  else
-    lw = lw >> (WORD_SIZE - x);
-  if (x >= WORD_SIZE)
-    rw = 0;
-  else
-    rw = rw << x; //how shifts manipulate the underlying memory is dependent on endianess
-  //rw = ((word) (rw & LEAD(WORD_SIZE - x))) >> (x);
+static size_t mismatch_words_resolve(const word* const a,
+                                     const word* const b,
+                                     const size_t b_shift,
+                                     const size_t n) {
+  mismatch_words_select();
+  return mismatch_words(a, b, b_shift, n);
+}
 
-  #ifdef IDEBUG
-  // printf("x is: %hhi\n", x);
-  printf("lw shifted is: ");
-  print_word(lw);
-  //   printf("lw is: %lX\n", lw);
-  printf("rw shifted is: ");
-  print_word(rw);
-  // printf("rw is: %lX\n", rw);
-	#endif
-	result = lw | rw;
-  // printf("the result is: ");
-  // print_word(result);
+static size_t count_words_portable(const word* const words, const size_t n) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    count += (size_t) __builtin_popcountll(words[i]);
+  }
+  return count;
+}
 
-  return result;
-} 
+#if defined(__x86_64__)
+__attribute__((target("popcnt")))
+static size_t count_words_popcnt(const word* const words, const size_t n) {
+  // Four independent sums keep several popcnt instructions in flight.
+  size_t counts[4] = { 0, 0, 0, 0 };
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    counts[0] += (size_t) __builtin_popcountll(words[i]);
+    counts[1] += (size_t) __builtin_popcountll(words[i + 1]);
+    counts[2] += (size_t) __builtin_popcountll(words[i + 2]);
+    counts[3] += (size_t) __builtin_popcountll(words[i + 3]);
+  }
+  for (; i < n; i++) {
+    counts[0] += (size_t) __builtin_popcountll(words[i]);
+  }
+  return counts[0] + counts[1] + counts[2] + counts[3];
+}
 
-static size_t bitarray_cmp(const bitarray_t* const first, const bitarray_t* const second) {
-  //assert sizes are equal
-  if (first->bit_sz != second->bit_sz)
-    return 1;
-  
-  //iterate through both buffers and check they are equal
-  for (size_t bit_index = 0; bit_index < first->bit_sz; bit_index++)
-    if (bitarray_get(first, bit_index) != bitarray_get(second, bit_index))
-      return bit_index;
-  return 0;
-}
-static bool bitarray_copy(const bitarray_t* const src, bitarray_t* dst) {
-  //assert sizes are equal
-  if (src->bit_sz != dst->bit_sz)
-    return false;
-  for (size_t bit_index = 0; bit_index < src->bit_sz; bit_index++)
-    bitarray_set(dst, bit_index, bitarray_get(src, bit_index));
-  return true;
+// Counts each nibble with a shuffle lookup and sums the bytes with
+// _mm256_sad_epu8.
+__attribute__((target("avx2,popcnt")))
+static size_t count_words_avx2(const word* const words, const size_t n) {
+  const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  __m256i sums = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256i v = _mm256_loadu_si256((const __m256i*) (words + i));
+    const __m256i bytes = _mm256_add_epi8(
+      _mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble)),
+      _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+  }
+  size_t count = (size_t) (_mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                           _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3));
+  for (; i < n; i++) {
+    count += (size_t) __builtin_popcountll(words[i]);
+  }
+  return count;
 }
 
-static void bitarray_set_word(const bitarray_t* const bitarray, const size_t bit_index, const word a_word) {
-  assert(bit_index <= bitarray->bit_sz - 2*WORD_SIZE);
-  uint_fast8_t y = modulo(bit_index, WORD_SIZE);
-  assert (y >= 0);
-  assert(WORD_SIZE - y >= 0);
-  word lw, rw;
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static size_t count_words_avx512vpopcntdq(const word* const words, const size_t n) {
+  __m512i sums = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    sums = _mm512_add_epi64(sums, _mm512_popcnt_epi64(_mm512_loadu_si512(words + i)));
+  }
+  size_t count = (size_t) _mm512_reduce_add_epi64(sums);
+  for (; i < n; i++) {
+    count += (size_t) __builtin_popcountll(words[i]);
+  }
+  return count;
+}
 
-  #ifdef IDEBUG
-  printf("y is: %hhi bit_index is: %lu \n a_word is: %lu", y, bit_index, a_word);
-  #endif
+static bool cpu_has_popcnt(void) {
+  return __builtin_cpu_supports("popcnt");
+}
 
-  if (y >= WORD_SIZE)
-    lw = 0;
-  else
-    lw = a_word << y;
+static bool cpu_has_avx512vpopcntdq(void) {
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq");
+}
+#endif  // defined(__x86_64__)
 
-  if (WORD_SIZE - y >= WORD_SIZE)
-    rw = 0;
-  else
-    rw = a_word >> (WORD_SIZE - y);
-  
-  #ifdef IDEBUG
-  printf("lw is: ");
-  print_word(lw);
-  printf("rw is: ");
-  print_word(rw);
-  #endif
+// Every count_words kernel, best first, as for reverse_words_kernels.
+static const struct {
+  const char* name;
+  bool (*supported)(void);
+  count_words_fn kernel;
+} count_words_kernels[] = {
+#if defined(__x86_64__)
+  { "avx512vpopcntdq", cpu_has_avx512vpopcntdq, count_words_avx512vpopcntdq },
+  { "avx2", cpu_has_avx2, count_words_avx2 },
+  { "popcnt", cpu_has_popcnt, count_words_popcnt },
+#endif
+  { "portable", cpu_has_nothing, count_words_portable },
+};
 
-  word * buff = (word *) bitarray->buf;
-  lw |= buff[bit_index/WORD_SIZE] & LEAD(y);
-  #ifdef IDEBUG
-  printf("LEAD(y) is %lX\n", LEAD(y));
-  #endif
-  rw |=  buff[bit_index/WORD_SIZE + 1] & TRAIL(WORD_SIZE - y);
-  #ifdef IDEBUG
-  printf("TRAIL(WORD_SIZE - y) is %lX\n", TRAIL(WORD_SIZE - y));
+static void count_words_select(void) {
+  #if defined(__x86_64__)
+  __builtin_cpu_init();
   #endif
+  const size_t count = sizeof(count_words_kernels) / sizeof(count_words_kernels[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (count_words_kernels[i].supported()) {
+      count_words_name = count_words_kernels[i].name;
+      count_words = count_words_kernels[i].kernel;
+      return;
+    }
+  }
+}
 
-  #ifdef IDEBUG
-  printf("lw final is: ");
-  print_word(lw);
-  printf("rw final is: ");
-  print_word(rw);
-  #endif
-  buff[bit_index/WORD_SIZE] = lw;
-  buff[bit_index/WORD_SIZE + 1] = rw;
+static size_t count_words_resolve(const word* const words, const size_t n) {
+  count_words_select();
+  return count_words(words, n);
+}
 
-  return;
+static word splitmix64(word* const x) {
+  *x += 0x9E3779B97F4A7C15ULL;
+  word z = *x;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
 }
 
-static void print_bitarray(const bitarray_t* const bitarray, const size_t bit_index) {
-  size_t i = bit_index;
-  for (; i < bitarray->bit_sz; i++)
-    printf("%s", bitarray_get(bitarray, i) ? "1" : "0");
-  printf("\n");
+static void randfill_blocks(void* const ctx, const size_t begin, const size_t end) {
+  const struct randfill_blocks* const fill = ctx;
+  for (size_t block = begin; block < end; block++) {
+    // Block k seeds its lanes from outputs 16k through 16k + 15 of one
+    // splitmix64 stream, so no two blocks share a generator.
+    word state[4 * RANDFILL_LANES];
+    word x = fill->seed + block * (4 * RANDFILL_LANES) * 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < 4 * RANDFILL_LANES; i++) {
+      state[i] = splitmix64(&x);
+    }
+
+    const size_t byte_index = block * RANDFILL_BLOCK_BYTES;
+    const size_t byte_count = (fill->byte_sz - byte_index < RANDFILL_BLOCK_BYTES) ?
+                              fill->byte_sz - byte_index : RANDFILL_BLOCK_BYTES;
+    const size_t step_bytes = RANDFILL_LANES * sizeof(word);
+    randfill_words((word*) (fill->buf + byte_index), byte_count / step_bytes, state);
+    // The last block may end partway through a step; only the bytes that
+    // belong to the array are copied out of it.
+    if (byte_count % step_bytes != 0) {
+      word tail[RANDFILL_LANES];
+      randfill_words(tail, 1, state);
+      memcpy(fill->buf + byte_index + byte_count / step_bytes * step_bytes, tail,
+             byte_count % step_bytes);
+    }
+  }
 }
 
-static void print_word(const word a_word) {
-  bitarray_t* word_bitarray = bitarray_new((size_t) 64);
-  memcpy(word_bitarray->buf, &a_word, sizeof(a_word));
-  print_bitarray(word_bitarray, 0);
-  free(word_bitarray);
+static void randfill_words_scalar(word* restrict dst,
+                                  const size_t step_count,
+                                  word* restrict state) {
+  for (size_t lane = 0; lane < RANDFILL_LANES; lane++) {
+    word s0 = state[lane];
+    word s1 = state[RANDFILL_LANES + lane];
+    word s2 = state[2 * RANDFILL_LANES + lane];
+    word s3 = state[3 * RANDFILL_LANES + lane];
+    for (size_t i = 0; i < step_count; i++) {
+      const word sum = s0 + s3;
+      dst[RANDFILL_LANES * i + lane] = ((sum << 23) | (sum >> 41)) + s0;
+      const word t = s1 << 17;
+      s2 ^= s0;
+      s3 ^= s1;
+      s1 ^= s2;
+      s0 ^= s3;
+      s2 ^= t;
+      s3 = (s3 << 45) | (s3 >> 19);
+    }
+    state[lane] = s0;
+    state[RANDFILL_LANES + lane] = s1;
+    state[2 * RANDFILL_LANES + lane] = s2;
+    state[3 * RANDFILL_LANES + lane] = s3;
+  }
 }
 
-static word reverse_word(word v) {
-	static const unsigned char BitReverseTable256[256] = 
-{
-#   define R2(n)     n,     n + 2*64,     n + 1*64,     n + 3*64
-#   define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
-#   define R6(n) R4(n), R4(n + 2*4 ), R4(n + 1*4 ), R4(n + 3*4 )
-    R6(0), R6(2), R6(1), R6(3)
+#if defined(__x86_64__)
+// One lane per 64-bit element: a step produces a whole 256-bit register.
+__attribute__((target("avx2")))
+static void randfill_words_avx2(word* restrict dst,
+                                const size_t step_count,
+                                word* restrict state) {
+  __m256i s0 = _mm256_loadu_si256((const __m256i*) state);
+  __m256i s1 = _mm256_loadu_si256((const __m256i*) (state + RANDFILL_LANES));
+  __m256i s2 = _mm256_loadu_si256((const __m256i*) (state + 2 * RANDFILL_LANES));
+  __m256i s3 = _mm256_loadu_si256((const __m256i*) (state + 3 * RANDFILL_LANES));
+  for (size_t i = 0; i < step_count; i++) {
+    const __m256i sum = _mm256_add_epi64(s0, s3);
+    const __m256i result = _mm256_add_epi64(
+      _mm256_or_si256(_mm256_slli_epi64(sum, 23), _mm256_srli_epi64(sum, 41)), s0);
+    _mm256_storeu_si256((__m256i*) (dst + RANDFILL_LANES * i), result);
+    const __m256i t = _mm256_slli_epi64(s1, 17);
+    s2 = _mm256_xor_si256(s2, s0);
+    s3 = _mm256_xor_si256(s3, s1);
+    s1 = _mm256_xor_si256(s1, s2);
+    s0 = _mm256_xor_si256(s0, s3);
+    s2 = _mm256_xor_si256(s2, t);
+    s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+  }
+  _mm256_storeu_si256((__m256i*) state, s0);
+  _mm256_storeu_si256((__m256i*) (state + RANDFILL_LANES), s1);
+  _mm256_storeu_si256((__m256i*) (state + 2 * RANDFILL_LANES), s2);
+  _mm256_storeu_si256((__m256i*) (state + 3 * RANDFILL_LANES), s3);
+}
+#endif  // defined(__x86_64__)
+
+static void randfill_words_select(void) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (cpu_has_avx2()) {
+    randfill_words = randfill_words_avx2;
+    return;
+  }
+#endif
+  randfill_words = randfill_words_scalar;
+}
+
+static void randfill_words_resolve(word* restrict dst,
+                                   const size_t step_count,
+                                   word* restrict state) {
+  randfill_words_select();
+  randfill_words(dst, step_count, state);
+}
+
+static inline size_t bundle_left_amount(const ssize_t bit_right_amount,
+                                        const size_t bit_length) {
+  assert(bit_length <= WORD_SIZE);
+  if (bit_length == 0) {
+    return 0;
+  }
+#ifdef __SIZEOF_INT128__
+  if (bit_right_amount >= -(ssize_t) UINT32_MAX && bit_right_amount <= (ssize_t) UINT32_MAX) {
+    // Adding a multiple of the length makes -bit_right_amount nonnegative
+    // without changing it mod the length, and keeps it below 2^38.  There
+    // is no branch on the sign for random amounts to mispredict.
+    const size_t x = ((size_t) bit_length << 32) - (size_t) bit_right_amount;
+    return (size_t)
+      (((unsigned __int128) (bundle_mod_magic[bit_length] * x) * bit_length) >> WORD_SIZE);
+  }
+#endif
+  return modulo(-bit_right_amount, bit_length);
+}
+
+static void bundle_rotate_portable(word* const words,
+                                   const size_t n,
+                                   const size_t* const offsets,
+                                   const size_t* const lengths,
+                                   const size_t* const lefts) {
+  for (size_t i = 0; i < n; i++) {
+    if (lefts[i] == 0) {
+      continue;
+    }
+    const word mask = LEAD(lengths[i]);
+    const word field = (words[i] >> offsets[i]) & mask;
+    const word rotated = ((field >> lefts[i]) | (field << (lengths[i] - lefts[i]))) & mask;
+    words[i] = (words[i] & ~(mask << offsets[i])) | (rotated << offsets[i]);
+  }
+}
+
+static void bundle_reverse_portable(word* const words,
+                                    const size_t n,
+                                    const size_t* const offsets,
+                                    const size_t* const lengths) {
+  for (size_t i = 0; i < n; i++) {
+    if (lengths[i] < 2) {
+      continue;
+    }
+    // Reversing the whole word carries the field to the mirror-image place;
+    // shift it back down to its offset.
+    const word mask = LEAD(lengths[i]);
+    const word reversed =
+      (reverse_word(words[i]) >> (WORD_SIZE - offsets[i] - lengths[i])) & mask;
+    words[i] = (words[i] & ~(mask << offsets[i])) | (reversed << offsets[i]);
+  }
+}
+
+#if defined(__x86_64__)
+// The vector kernels work as the portable ones do, a lane per item.  Variable
+// shifts by 64 or more give 0, so the masks and the rotation need no special
+// case for an empty field, a zero amount or a field filling the word.
+
+// Byte indices reversing each 64-bit lane of a 128-bit lane, for pshufb.
+#define BYTE_REVERSE_64X2 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+
+__attribute__((target("avx2")))
+static void bundle_rotate_avx2(word* const words,
+                               const size_t n,
+                               const size_t* const offsets,
+                               const size_t* const lengths,
+                               const size_t* const lefts) {
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  const __m256i width = _mm256_set1_epi64x(WORD_SIZE);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256i w = _mm256_loadu_si256((const __m256i*) (words + i));
+    const __m256i offset = _mm256_loadu_si256((const __m256i*) (offsets + i));
+    const __m256i length = _mm256_loadu_si256((const __m256i*) (lengths + i));
+    const __m256i left = _mm256_loadu_si256((const __m256i*) (lefts + i));
+    const __m256i mask = _mm256_srlv_epi64(ones, _mm256_sub_epi64(width, length));
+    const __m256i field = _mm256_and_si256(_mm256_srlv_epi64(w, offset), mask);
+    const __m256i rotated =
+      _mm256_and_si256(_mm256_or_si256(_mm256_srlv_epi64(field, left),
+                                       _mm256_sllv_epi64(field, _mm256_sub_epi64(length, left))),
+                       mask);
+    _mm256_storeu_si256((__m256i*) (words + i),
+                        _mm256_or_si256(_mm256_andnot_si256(_mm256_sllv_epi64(mask, offset), w),
+                                        _mm256_sllv_epi64(rotated, offset)));
+  }
+  bundle_rotate_portable(words + i, n - i, offsets + i, lengths + i, lefts + i);
+}
+
+__attribute__((target("avx2")))
+static void bundle_reverse_avx2(word* const words,
+                                const size_t n,
+                                const size_t* const offsets,
+                                const size_t* const lengths) {
+  const __m256i lo_table = _mm256_setr_epi8(NIBBLE_REVERSE_HI, NIBBLE_REVERSE_HI);
+  const __m256i hi_table = _mm256_setr_epi8(NIBBLE_REVERSE_LO, NIBBLE_REVERSE_LO);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i byte_reverse = _mm256_setr_epi8(BYTE_REVERSE_64X2, BYTE_REVERSE_64X2);
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  const __m256i width = _mm256_set1_epi64x(WORD_SIZE);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256i w = _mm256_loadu_si256((const __m256i*) (words + i));
+    const __m256i offset = _mm256_loadu_si256((const __m256i*) (offsets + i));
+    const __m256i length = _mm256_loadu_si256((const __m256i*) (lengths + i));
+    const __m256i mask = _mm256_srlv_epi64(ones, _mm256_sub_epi64(width, length));
+    __m256i reversed =
+      _mm256_or_si256(_mm256_shuffle_epi8(lo_table, _mm256_and_si256(w, nibble)),
+                      _mm256_shuffle_epi8(hi_table,
+                                          _mm256_and_si256(_mm256_srli_epi16(w, 4), nibble)));
+    reversed = _mm256_shuffle_epi8(reversed, byte_reverse);
+    reversed = _mm256_srlv_epi64(reversed,
+                                 _mm256_sub_epi64(width, _mm256_add_epi64(offset, length)));
+    reversed = _mm256_and_si256(reversed, mask);
+    _mm256_storeu_si256((__m256i*) (words + i),
+                        _mm256_or_si256(_mm256_andnot_si256(_mm256_sllv_epi64(mask, offset), w),
+                                        _mm256_sllv_epi64(reversed, offset)));
+  }
+  bundle_reverse_portable(words + i, n - i, offsets + i, lengths + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void bundle_rotate_avx512bw(word* const words,
+                                   const size_t n,
+                                   const size_t* const offsets,
+                                   const size_t* const lengths,
+                                   const size_t* const lefts) {
+  const __m512i ones = _mm512_set1_epi64(-1);
+  const __m512i width = _mm512_set1_epi64(WORD_SIZE);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m512i w = _mm512_loadu_si512((const void*) (words + i));
+    const __m512i offset = _mm512_loadu_si512((const void*) (offsets + i));
+    const __m512i length = _mm512_loadu_si512((const void*) (lengths + i));
+    const __m512i left = _mm512_loadu_si512((const void*) (lefts + i));
+    const __m512i mask = _mm512_srlv_epi64(ones, _mm512_sub_epi64(width, length));
+    const __m512i field = _mm512_and_si512(_mm512_srlv_epi64(w, offset), mask);
+    const __m512i rotated =
+      _mm512_and_si512(_mm512_or_si512(_mm512_srlv_epi64(field, left),
+                                       _mm512_sllv_epi64(field, _mm512_sub_epi64(length, left))),
+                       mask);
+    _mm512_storeu_si512((void*) (words + i),
+                        _mm512_or_si512(_mm512_andnot_si512(_mm512_sllv_epi64(mask, offset), w),
+                                        _mm512_sllv_epi64(rotated, offset)));
+  }
+  bundle_rotate_avx2(words + i, n - i, offsets + i, lengths + i, lefts + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void bundle_reverse_avx512bw(word* const words,
+                                    const size_t n,
+                                    const size_t* const offsets,
+                                    const size_t* const lengths) {
+  const __m512i lo_table = _mm512_broadcast_i32x4(_mm_setr_epi8(NIBBLE_REVERSE_HI));
+  const __m512i hi_table = _mm512_broadcast_i32x4(_mm_setr_epi8(NIBBLE_REVERSE_LO));
+  const __m512i nibble = _mm512_set1_epi8(0x0F);
+  const __m512i byte_reverse = _mm512_broadcast_i32x4(_mm_setr_epi8(BYTE_REVERSE_64X2));
+  const __m512i ones = _mm512_set1_epi64(-1);
+  const __m512i width = _mm512_set1_epi64(WORD_SIZE);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m512i w = _mm512_loadu_si512((const void*) (words + i));
+    const __m512i offset = _mm512_loadu_si512((const void*) (offsets + i));
+    const __m512i length = _mm512_loadu_si512((const void*) (lengths + i));
+    const __m512i mask = _mm512_srlv_epi64(ones, _mm512_sub_epi64(width, length));
+    __m512i reversed =
+      _mm512_or_si512(_mm512_shuffle_epi8(lo_table, _mm512_and_si512(w, nibble)),
+                      _mm512_shuffle_epi8(hi_table,
+                                          _mm512_and_si512(_mm512_srli_epi16(w, 4), nibble)));
+    reversed = _mm512_shuffle_epi8(reversed, byte_reverse);
+    reversed = _mm512_srlv_epi64(reversed,
+                                 _mm512_sub_epi64(width, _mm512_add_epi64(offset, length)));
+    reversed = _mm512_and_si512(reversed, mask);
+    _mm512_storeu_si512((void*) (words + i),
+                        _mm512_or_si512(_mm512_andnot_si512(_mm512_sllv_epi64(mask, offset), w),
+                                        _mm512_sllv_epi64(reversed, offset)));
+  }
+  bundle_reverse_avx2(words + i, n - i, offsets + i, lengths + i);
+}
+
+static bool cpu_has_avx512bw(void) {
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif  // defined(__x86_64__)
+
+// Every pair of bundle kernels, best first, as for reverse_words_kernels.
+// The wider kernels finish their last few items with the next narrower one,
+// so each must also be supported wherever the one before it is.
+static const struct {
+  const char* name;
+  bool (*supported)(void);
+  bundle_rotate_fn rotate;
+  bundle_reverse_fn reverse;
+} bundle_kernels[] = {
+#if defined(__x86_64__)
+  { "avx512bw", cpu_has_avx512bw, bundle_rotate_avx512bw, bundle_reverse_avx512bw },
+  { "avx2", cpu_has_avx2, bundle_rotate_avx2, bundle_reverse_avx2 },
+#endif
+  { "portable", cpu_has_nothing, bundle_rotate_portable, bundle_reverse_portable },
 };
-	word c; // c will get v reversed
-	unsigned char * p = (unsigned char *) &v;
-	unsigned char * q = (unsigned char *) &c;
-	q[7] = BitReverseTable256[p[0]]; 
-	q[6] = BitReverseTable256[p[1]]; 
-	q[5] = BitReverseTable256[p[2]]; 
-	q[4] = BitReverseTable256[p[3]];
-	q[3] = BitReverseTable256[p[4]]; 
-	q[2] = BitReverseTable256[p[5]]; 
-	q[1] = BitReverseTable256[p[6]]; 
-	q[0] = BitReverseTable256[p[7]];
 
-	return c;
+static void bundle_select(void) {
+  #if defined(__x86_64__)
+  __builtin_cpu_init();
+  #endif
+  const size_t count = sizeof(bundle_kernels) / sizeof(bundle_kernels[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (bundle_kernels[i].supported()) {
+      bundle_kernel_name = bundle_kernels[i].name;
+      bundle_rotate_words = bundle_kernels[i].rotate;
+      bundle_reverse_words = bundle_kernels[i].reverse;
+      return;
+    }
+  }
+}
+
+static void bundle_rotate_resolve(word* const words,
+                                  const size_t n,
+                                  const size_t* const offsets,
+                                  const size_t* const lengths,
+                                  const size_t* const lefts) {
+  bundle_select();
+  bundle_rotate_words(words, n, offsets, lengths, lefts);
 }
 
+static void bundle_reverse_resolve(word* const words,
+                                   const size_t n,
+                                   const size_t* const offsets,
+                                   const size_t* const lengths) {
+  bundle_select();
+  bundle_reverse_words(words, n, offsets, lengths);
+}
 
 void do_isaac_stuff(void) {
   // int bit_index = 2;
@@ -570,7 +4553,7 @@ void do_isaac_stuff(void) {
   // printf("b bitarray is now:     ");
   // print_bitarray(b_bitarray);
 
-  //assert(!bitarray_cmp(a_bitarray, b_bitarray));
+  //assert(bitarray_equal(a_bitarray, b_bitarray));
   size_t bit_length = 2048;
   size_t bit_offset = 1024;
   test_rotate(0, bit_length, bit_offset, bit_length-bit_offset, 27);
@@ -599,22 +4582,22 @@ static bitarray_t* bitarray_newrand(const size_t bit_sz, const unsigned int seed
 static void test_reverse(const unsigned int seed, const size_t bit_sz, const size_t bit_offset, const size_t bit_length) {
   bitarray_t* a_bitarray =  bitarray_newrand(bit_sz, seed);
   bitarray_t* b_bitarray =  bitarray_newrand(bit_sz, seed);
-  ssize_t index = 0;
+  size_t index = 0;
 
-  assert(!bitarray_cmp(a_bitarray, b_bitarray));
+  assert(bitarray_equal(a_bitarray, b_bitarray));
   bitarray_reverse_fast(a_bitarray, bit_offset, bit_length);
   bitarray_reverse_slow(b_bitarray, bit_offset, bit_length);
   
   printf("\n seed: %u bit_sz: %lu bit_offset: %lu bit_length: %lu status: ", seed, bit_sz, bit_offset, bit_length);
-  index = bitarray_cmp(a_bitarray, b_bitarray);
-  if (index) {
+  index = bitarray_mismatch(a_bitarray, 0, b_bitarray, 0, bit_sz);
+  if (index != bit_sz) {
     index = 257;
     printf("FAILURE");
     printf("\nCorrect bitarray: ");
     print_bitarray(b_bitarray, index);
     printf("My Bitarray     : ");
     print_bitarray(a_bitarray, index);
-    printf("index is: %lu\n", index);
+    printf("index is: %zu\n", index);
     exit(EXIT_FAILURE);
   }
   else {
@@ -630,12 +4613,12 @@ static void test_rotate(const unsigned int seed, const size_t bit_sz, const size
   bitarray_t* b_bitarray =  bitarray_newrand(bit_sz, seed);
   bitarray_t* c_bitarray =  bitarray_newrand(bit_sz, seed);
 
-  assert(!bitarray_cmp(a_bitarray, b_bitarray));
+  assert(bitarray_equal(a_bitarray, b_bitarray));
   bitarray_rotate_fast(a_bitarray, bit_offset, bit_length, bit_left_amount);
   bitarray_rotate_left(b_bitarray, bit_offset, bit_length, bit_left_amount);
 
   printf("\n seed: %u bit_sz: %lu bit_offset: %lu bit_length: %lu bit_left_amount %lu status: ", seed, bit_sz, bit_offset, bit_length, bit_left_amount);
-  if (bitarray_cmp(a_bitarray, b_bitarray)) {
+  if (!bitarray_equal(a_bitarray, b_bitarray)) {
     printf("FAILURE");
     printf("\nCorrect result: ");
     print_bitarray(b_bitarray, 0);
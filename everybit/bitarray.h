@@ -25,28 +25,200 @@
 
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // ********************************* Types **********************************
 
 // Abstract data type representing an array of bits.
 typedef struct bitarray bitarray_t;
 
+// A region that bit arrays can be carved out of and then all released at
+// once (see bitarray_arena_new).
+typedef struct bitarray_arena bitarray_arena_t;
+
+// Algorithms bitarray_rotate can use to move the bits of a subarray.
+typedef enum {
+  // Reverse the two halves, then reverse the whole subarray.
+  BITARRAY_ROTATE_REVERSAL,
+  // Gries-Mills block swap over whole words.
+  BITARRAY_ROTATE_BLOCKSWAP,
+  // Block swaps until the shorter block fits in half the L2 cache, then one
+  // pass that moves the longer block past a cached copy of the shorter one
+  // (see bitarray_set_block_bytes).
+  BITARRAY_ROTATE_BLOCKED,
+} bitarray_rotate_engine_t;
+
+// Ways a bit array can store its bits.
+typedef enum {
+  // One packed buffer, 8 bits per byte.  Rotating a subarray costs time
+  // linear in its length.
+  BITARRAY_BACKEND_PACKED,
+  // A balanced tree of chunks of up to 2048 bits (see bittreap.h).  Rotating
+  // a subarray costs O(log n) whatever its length, at the price of slower
+  // single-bit access.
+  BITARRAY_BACKEND_TREAP,
+} bitarray_backend_t;
+
+// Modes for bitarray_open_mmap.
+typedef enum {
+  // Open the file read-only.  The array can still be changed, but changes
+  // are private to the process and never reach the file.
+  BITARRAY_MMAP_RDONLY = 0,
+  // Open the file read-write, creating or extending it if needed.  Changes
+  // reach the file; bitarray_sync waits until they have.
+  BITARRAY_MMAP_RDWR = 1,
+} bitarray_mmap_flags_t;
+
+// Options for bitarray_arena_new.
+typedef enum {
+  BITARRAY_ARENA_DEFAULT = 0,
+  // Round chunks up to whole 2MB pages and ask the kernel to back them with
+  // transparent huge pages.  Only a hint; the arena works the same without.
+  BITARRAY_ARENA_HUGEPAGES = 1,
+} bitarray_arena_flags_t;
+
+// Tuning for bitarray_rotate_file.  A field left at 0 takes its default.
+typedef struct {
+  // Bytes moved by each read or write call.  Default 1 MiB.
+  size_t block_bytes;
+  // Bytes of memory the rotation may use for buffers.  Default 64 MiB.
+  size_t memory_budget;
+} bitarray_stream_options_t;
+
+// One rotation for bitarray_rotate_batch, with the same meaning as the
+// arguments of bitarray_rotate.
+typedef struct {
+  size_t bit_offset;
+  size_t bit_length;
+  ssize_t bit_right_amount;
+} bitarray_rotation_t;
+
+// count bit arrays of bit_sz bits each (1 to 64), stored one per word so
+// that a vector register holds several side by side for the
+// bitarray_bundle_* functions.  Bit j of item i is bit j of words[i],
+// counting from the least significant: the layout a bit array of up to 64
+// bits has in its first word.
+typedef struct {
+  uint64_t* words;
+  size_t count;
+  size_t bit_sz;
+} bitarray_bundle_t;
+
+// Boolean operations for bitarray_op_range.
+typedef enum {
+  BITARRAY_OP_AND,     // a & b
+  BITARRAY_OP_OR,      // a | b
+  BITARRAY_OP_XOR,     // a ^ b
+  BITARRAY_OP_ANDNOT,  // a & ~b
+  BITARRAY_OP_NOT,     // ~a; b is not used
+} bitarray_op_t;
+
+// Called by bitarray_foreach_set with each set bit's index.  Returning false
+// stops the walk.
+typedef bool (*bitarray_visit_fn)(void* const ctx, const size_t bit_index);
+
 // ******************************* Prototypes *******************************
 
 // Allocates space for a new bit array.
 // bit_sz is the number of bits storable in the resultant bit array
 bitarray_t* bitarray_new(const size_t bit_sz);
 
-// Frees a bit array allocated by bitarray_new.
+// Like bitarray_new, but with the given storage backend.  bitarray_new uses
+// BITARRAY_BACKEND_PACKED.
+bitarray_t* bitarray_new_backend(const size_t bit_sz, const bitarray_backend_t backend);
+
+// Opens a bit array of bit_sz bits whose storage is the file at path,
+// mapped into memory: bit i is bit i % 8 of byte i / 8 of the file, the same
+// packed layout bitarray_new uses.  Nothing is read up front, and rotations
+// work on the mapped pages in place.  Returns NULL if the file cannot be
+// opened or mapped, or if it is shorter than (bit_sz + 7) / 8 bytes and
+// flags is BITARRAY_MMAP_RDONLY.
+bitarray_t* bitarray_open_mmap(const char* const path,
+                               const size_t bit_sz,
+                               const bitarray_mmap_flags_t flags);
+
+// Rotates a subarray of a bit array stored in the file at path, in the
+// layout bitarray_open_mmap uses, without loading the whole array.
+// Arguments are as for bitarray_rotate; options may be NULL.
+//
+// A subarray that fits in the memory budget is read, rotated and written
+// back once.  A larger one is rotated with three reversals, each a single
+// sequential pass that streams windows in from both ends of its range.
+// Returns false if the file cannot be opened, is too short, or an I/O error
+// occurs; the file may then be left partly rotated.
+bool bitarray_rotate_file(const char* const path,
+                          const size_t bit_offset,
+                          const size_t bit_length,
+                          const ssize_t bit_right_amount,
+                          const bitarray_stream_options_t* const options);
+
+// Writes any pending whole-array rotation back into memory and, for a file
+// opened with BITARRAY_MMAP_RDWR, waits until the file holds every change.
+// Returns false if writing the file failed.
+bool bitarray_sync(bitarray_t* const bitarray);
+
+// Frees a bit array allocated by bitarray_new, bitarray_new_backend,
+// bitarray_open_mmap, bitarray_new_view or bitarray_new_in.  A file opened
+// with BITARRAY_MMAP_RDWR is unmapped holding the array's final contents,
+// though not necessarily on disk yet.
 void bitarray_free(bitarray_t* const bitarray);
 
+// Makes a bit array of bit_sz bits whose storage is buf, in the layout
+// bitarray_new uses: bit i is bit i % 8 of byte i / 8, which on x86-64 is
+// bit i % 64 of 64-bit word i / 64.  Nothing is copied; operations on the
+// array read and write buf directly.  buf must be word-aligned and at least
+// bitarray_view_bytes(bit_sz) bytes long, which leaves the spare word past
+// the last bit that word-at-a-time access needs.  bitarray_free frees only
+// the struct, leaving buf to the caller.  Returns NULL if memory runs out.
+//
+// A whole-array rotation leaves the bits rotated only logically (see
+// bitarray_rotate), so call bitarray_normalize before reading buf.
+bitarray_t* bitarray_new_view(void* const buf, const size_t buf_bytes, const size_t bit_sz);
+
+// Returns the smallest buffer, in bytes, bitarray_new_view accepts for
+// bit_sz bits.
+size_t bitarray_view_bytes(const size_t bit_sz);
+
+// Creates an arena that hands out bit arrays from chunks of chunk_bytes
+// bytes (0 means 1MB), bump-allocating each array's struct and buffer
+// together on cache-line boundaries.  Returns NULL if memory runs out.  An
+// arena is not thread-safe: only one thread may allocate from it at a time.
+bitarray_arena_t* bitarray_arena_new(const size_t chunk_bytes,
+                                     const bitarray_arena_flags_t flags);
+
+// Allocates a zeroed, packed bit array of bit_sz bits in arena.  It works
+// like one from bitarray_new until the arena is reset or freed, and need not
+// be freed on its own; bitarray_free on it only releases its rank index, if
+// it has one.  An array larger than the arena's chunks gets a mapping of its
+// own.  Returns NULL if memory runs out.
+bitarray_t* bitarray_new_in(bitarray_arena_t* const arena, const size_t bit_sz);
+
+// Invalidates every bit array allocated in arena at once and makes its
+// chunks available again.  Takes constant time, apart from unmapping any
+// arrays that got mappings of their own.
+void bitarray_arena_reset(bitarray_arena_t* const arena);
+
+// Resets arena and returns all its memory to the system.
+void bitarray_arena_free(bitarray_arena_t* const arena);
+
 // Returns the number of bits stored in a bit array.
 // Note the invariant bitarray_get_bit_sz(bitarray_new(n)) = n.
 size_t bitarray_get_bit_sz(const bitarray_t* const bitarray);
 
-// Does a random fill of all the bits in the bit array.
+// Does a random fill of all the bits in the bit array.  The bits are drawn
+// from bitarray_randfill_seeded with a seed taken from rand(), so srand()
+// makes the fill repeatable.
 void bitarray_randfill(bitarray_t* const bitarray);
 
+// Fills the bit array with pseudorandom bits that depend only on seed: the
+// same seed gives the same bits whatever the thread count or CPU.  Large
+// arrays are filled in parallel (see bitarray_set_thread_count).
+void bitarray_randfill_seeded(bitarray_t* const bitarray, const uint64_t seed);
+
 // Indexes into a bit array, retreiving the bit at the specified zero-based
 // index.
 bool bitarray_get(const bitarray_t* const bitarray, const size_t bit_index);
@@ -80,11 +252,315 @@ void bitarray_set(bitarray_t* const bitarray,
 // bitarray_rotate(ba, 2, 5, 2) rotates the third through seventh
 // (inclusive) bits right two places.  After the rotation, ba contains the
 // byte 0b10110100.
+//
+// Rotating the whole array (bit_offset == 0 and bit_length equal to the
+// array size) takes constant time: the array just remembers a logical
+// offset, which later sub-range rotations fold back into memory.
 void bitarray_rotate(bitarray_t* const bitarray,
                      const size_t bit_offset,
                      const size_t bit_length,
                      const ssize_t bit_right_amount);
 
+// Rotates like bitarray_rotate, but out of place: the shorter of the two
+// blocks that trade places is saved in scratch, the longer one is moved to
+// its new place in one pass, and the saved bits are written back.  This
+// moves each bit about once where the reversal engine moves it twice.
+// scratch needs bitarray_rotate_scratch_bytes(bit_length, bit_right_amount)
+// bytes and any alignment; with less, the rotation is done in place instead.
+void bitarray_rotate_with_scratch(bitarray_t* const bitarray,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const ssize_t bit_right_amount,
+                                  void* const scratch,
+                                  const size_t scratch_bytes);
+
+// Returns the scratch size, in bytes, that bitarray_rotate_with_scratch needs
+// to rotate a bit_length-bit subarray right by bit_right_amount out of place.
+size_t bitarray_rotate_scratch_bytes(const size_t bit_length,
+                                     const ssize_t bit_right_amount);
+
+// Performs ops[0], ops[1], ..., ops[n - 1] in order, as if by bitarray_rotate.
+//
+// Rather than moving bits once per rotation, runs of rotations whose
+// subarrays overlap are first composed into a single rearrangement of the
+// region they cover, which is then applied in one pass through a scratch
+// copy.  A run that composes to a plain rotation (for instance repeated
+// rotations of the same subarray, whose amounts simply add up) is applied in
+// place by the usual rotation engine.
+void bitarray_rotate_batch(bitarray_t* const bitarray,
+                           const bitarray_rotation_t* const ops,
+                           const size_t n);
+
+// Rotates the same subarray of every item in bundle right by the same amount,
+// with the meaning bitarray_rotate gives its arguments.  Items are rotated in
+// lockstep, as many per instruction as the CPU's vector registers hold words,
+// with variable shifts building and moving each item's field.
+void bitarray_bundle_rotate(const bitarray_bundle_t* const bundle,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const ssize_t bit_right_amount);
+
+// Like bitarray_bundle_rotate, but item i has its own subarray and amount:
+// bit_offsets[i], bit_lengths[i] and bit_right_amounts[i].  bit_offsets may
+// be NULL, meaning 0 for every item, and bit_lengths may be NULL, meaning
+// each subarray runs to the end of its item.
+void bitarray_bundle_rotate_each(const bitarray_bundle_t* const bundle,
+                                 const size_t* const bit_offsets,
+                                 const size_t* const bit_lengths,
+                                 const ssize_t* const bit_right_amounts);
+
+// Reverses [bit_offset, bit_offset + bit_length) of every item in bundle.
+void bitarray_bundle_reverse(const bitarray_bundle_t* const bundle,
+                             const size_t bit_offset,
+                             const size_t bit_length);
+
+// Like bitarray_bundle_reverse, with per-item subarrays as for
+// bitarray_bundle_rotate_each.
+void bitarray_bundle_reverse_each(const bitarray_bundle_t* const bundle,
+                                  const size_t* const bit_offsets,
+                                  const size_t* const bit_lengths);
+
+// Copies the bits of src, which must be bundle->bit_sz bits long, into item
+// index of bundle, normalizing src first.
+void bitarray_bundle_load(const bitarray_bundle_t* const bundle,
+                          const size_t index,
+                          bitarray_t* const src);
+
+// Copies item index of bundle over the bits of dst, which must be
+// bundle->bit_sz bits long.
+void bitarray_bundle_store(const bitarray_bundle_t* const bundle,
+                           const size_t index,
+                           bitarray_t* const dst);
+
+// Returns the number of set bits in [bit_offset, bit_offset + bit_length).
+// Whole words in the middle of the range are counted with the widest
+// population-count instructions the CPU has.
+size_t bitarray_count(const bitarray_t* const bitarray,
+                      const size_t bit_offset,
+                      const size_t bit_length);
+
+// Builds (or rebuilds) a rank/select index, normalizing the array first.  The
+// index takes about 3% of the array's size and makes bitarray_rank constant
+// time and bitarray_select logarithmic.  Any later change to the bits marks it
+// out of date, and the next query rebuilds it.  Returns false if memory runs
+// out, in which case queries fall back to scanning.
+bool bitarray_build_rank_index(bitarray_t* const bitarray);
+
+// Returns the number of set bits in [0, bit_index).
+size_t bitarray_rank(bitarray_t* const bitarray, const size_t bit_index);
+
+// Returns the index of the set bit preceded by exactly k set bits, or the
+// array's bit_sz if fewer than k + 1 bits are set.
+size_t bitarray_select(bitarray_t* const bitarray, const size_t k);
+
+// Sets bits [dst_offset, dst_offset + bit_length) of dst to op applied to the
+// same number of bits of a starting at a_offset and of b starting at
+// b_offset.  For BITARRAY_OP_NOT, b may be NULL.  The three offsets need not
+// agree; a source whose bits do not line up with dst's words is read with
+// shifted word loads.  dst may be the same array as a or b, but then the two
+// ranges must either start at the same bit or not overlap at all.
+//
+// Every operand is normalized first (see bitarray_normalize).  Long ranges
+// are split across threads as for bitarray_rotate.
+void bitarray_op_range(bitarray_t* const dst,
+                       const size_t dst_offset,
+                       bitarray_t* const a,
+                       const size_t a_offset,
+                       bitarray_t* const b,
+                       const size_t b_offset,
+                       const size_t bit_length,
+                       const bitarray_op_t op);
+
+// Whole-array forms of bitarray_op_range: dst = a & b, and so on.  All
+// operands must have the same size.  Passing dst as a gives the in-place
+// form, e.g. bitarray_and(x, x, y) for x &= y.
+void bitarray_and(bitarray_t* const dst, bitarray_t* const a, bitarray_t* const b);
+void bitarray_or(bitarray_t* const dst, bitarray_t* const a, bitarray_t* const b);
+void bitarray_xor(bitarray_t* const dst, bitarray_t* const a, bitarray_t* const b);
+void bitarray_andnot(bitarray_t* const dst, bitarray_t* const a, bitarray_t* const b);
+void bitarray_not(bitarray_t* const dst, bitarray_t* const a);
+
+// Copies bits [src_offset, src_offset + bit_length) of src over bits
+// [dst_offset, dst_offset + bit_length) of dst.  dst and src may be the same
+// bit array, and the ranges may overlap, as with memmove.  When the two
+// offsets agree modulo 8 the bulk is moved with memmove; otherwise whole
+// words of dst are assembled from two shifted source words at a time.  Both
+// arrays are normalized first.
+void bitarray_copy_range(bitarray_t* const dst,
+                         const size_t dst_offset,
+                         bitarray_t* const src,
+                         const size_t src_offset,
+                         const size_t bit_length);
+
+// Sets every bit in [bit_offset, bit_offset + bit_length) to value.  Whole
+// bytes are written with memset and the two ends with word masks.
+void bitarray_fill(bitarray_t* const bitarray,
+                   const size_t bit_offset,
+                   const size_t bit_length,
+                   const bool value);
+
+// Shifts a subarray without wrapping around: bit i of the subarray moves to
+// i + bit_right_amount, bits pushed past either end of the subarray are
+// lost, and the bits left vacant are set to fill_value.  A negative
+// bit_right_amount shifts left.  Bits outside the subarray are unchanged.
+// Costs one bitarray_copy_range and one bitarray_fill.
+void bitarray_shift(bitarray_t* const bitarray,
+                    const size_t bit_offset,
+                    const size_t bit_length,
+                    const ssize_t bit_right_amount,
+                    const bool fill_value);
+
+// Compares bits [a_offset, a_offset + bit_length) of a with the same number of
+// bits of b starting at b_offset, a word (or, with AVX2, eight words) at a
+// time.  Returns the position within the ranges of the first bit that
+// differs, so a_offset plus the result is the bit of a, or bit_length if the
+// ranges are equal.  Both arrays are normalized first.
+size_t bitarray_mismatch(bitarray_t* const a,
+                         const size_t a_offset,
+                         bitarray_t* const b,
+                         const size_t b_offset,
+                         const size_t bit_length);
+
+// Returns true if the two ranges hold the same bits.
+bool bitarray_equal_range(bitarray_t* const a,
+                          const size_t a_offset,
+                          bitarray_t* const b,
+                          const size_t b_offset,
+                          const size_t bit_length);
+
+// Returns true if a and b have the same size and hold the same bits.
+bool bitarray_equal(bitarray_t* const a, bitarray_t* const b);
+
+// Return the index of the first set (or clear) bit at or after bit_index, or
+// the array's bit_sz if there is none.  Runs of words with nothing to find
+// are skipped with vector compares.
+//
+// These and bitarray_foreach_set normalize the array first, so calling them
+// between rotations of a treap-backed array flattens its tree each time.
+size_t bitarray_find_next_set(bitarray_t* const bitarray, const size_t bit_index);
+size_t bitarray_find_next_clear(bitarray_t* const bitarray, const size_t bit_index);
+
+// Returns the index of the last set bit at or before bit_index, or the
+// array's bit_sz if there is none.  A bit_index past the end is treated as
+// the last bit.
+size_t bitarray_find_prev_set(bitarray_t* const bitarray, const size_t bit_index);
+
+// Calls fn(ctx, i) for each set bit i in [bit_offset, bit_offset + bit_length),
+// in increasing order, until fn returns false.  Costs time proportional to
+// the number of words in the range plus the number of set bits.  fn must not
+// change the array.  Returns the number of calls made.
+size_t bitarray_foreach_set(bitarray_t* const bitarray,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const bitarray_visit_fn fn,
+                            void* const ctx);
+
+// Applies any pending whole-array rotation to the underlying memory, so that
+// bit i is stored at position i again.  Nothing observable through
+// bitarray_get changes; this only moves the cost of a deferred rotation to a
+// time of the caller's choosing.  A treap-backed array is flattened back into
+// a packed buffer; its next subarray rotation rebuilds the tree.
+void bitarray_normalize(bitarray_t* const bitarray);
+
+// Selects the engine used by every subsequent bitarray_rotate call.  The
+// default is BITARRAY_ROTATE_REVERSAL.  All engines produce identical
+// results; they only differ in speed.  Rotations whose offset, length and
+// amount are all multiples of 8 bypass the engine: they move whole bytes (or,
+// for multiples of 64, whole words) with memmove.
+void bitarray_set_rotate_engine(const bitarray_rotate_engine_t engine);
+
+// Returns the engine currently used by bitarray_rotate.
+bitarray_rotate_engine_t bitarray_get_rotate_engine(void);
+
+// Sets the number of threads bitarray_rotate may split large subarrays
+// across.  0 means one thread per online processor.  The default is 1, which
+// keeps every rotation on the calling thread.
+void bitarray_set_thread_count(const unsigned int count);
+
+// Returns the number of threads bitarray_rotate may use.
+unsigned int bitarray_get_thread_count(void);
+
+// Sets the subarray length, in bits, below which bitarray_rotate stays on the
+// calling thread even when more threads are available.  Starting threads costs
+// far more than rotating a short subarray.
+void bitarray_set_parallel_threshold(const size_t bit_length);
+
+// Sets the subarray length, in bits, from which the reversal engine rotates
+// out of place, as bitarray_rotate_with_scratch does, through a scratch
+// buffer kept per thread.  The rotation stays in place when threads are in
+// use (see bitarray_set_parallel_threshold) or when the buffer would exceed
+// the scratch limit.  SIZE_MAX turns the out-of-place path off.  The default
+// is 1M bits.
+void bitarray_set_scratch_threshold(const size_t bit_length);
+
+// Sets the largest scratch buffer, in bytes, a thread may keep for
+// out-of-place rotations.  The default is a sixteenth of physical memory; 0
+// keeps every rotation in place.
+void bitarray_set_scratch_limit(const size_t bytes);
+
+// Returns the current scratch limit, in bytes.
+size_t bitarray_get_scratch_limit(void);
+
+// Frees the calling thread's scratch buffer.  A thread that has rotated
+// out of place should call this before it exits.
+void bitarray_release_scratch(void);
+
+// Sets the size, in bytes, of the scratch block BITARRAY_ROTATE_BLOCKED
+// keeps in cache.  0 restores the default, half the L2 cache size reported by
+// sysconf (or 128KB if it reports none).
+void bitarray_set_block_bytes(const size_t bytes);
+
+// Returns the block size BITARRAY_ROTATE_BLOCKED uses, in bytes.
+size_t bitarray_get_block_bytes(void);
+
+// Sets the length, in bits, from which operations switch to a streaming
+// mode for data larger than the caches.  Reversals inside bitarray_rotate
+// prefetch both of their ends ahead of use, and bitarray_copy_range and
+// bitarray_op_range write a destination array that is not also a source with
+// non-temporal stores.  0 streams always and SIZE_MAX never.  The default is
+// the size of the last-level cache; the crossover for a given machine can be
+// measured with everybit -c.
+void bitarray_set_streaming_threshold(const size_t bit_length);
+
+// Returns the current streaming threshold, in bits.
+size_t bitarray_get_streaming_threshold(void);
+
+// Sets how far ahead of its current position, in bytes, each end of a
+// streaming reversal prefetches.  The default is 2048.
+void bitarray_set_prefetch_distance(const size_t bytes);
+
+// Returns the current prefetch distance, in bytes.
+size_t bitarray_get_prefetch_distance(void);
+
+// Returns the name of the vectorized bit-reversal kernel chosen for this CPU
+// (for example "avx2" or "table").  The kernel is picked once, the first time
+// it is needed.
+const char* bitarray_get_reverse_kernel(void);
+
+// Returns the name of the kernel chosen for bitarray_op_range on this CPU
+// (for example "avx2" or "portable").
+const char* bitarray_get_op_kernel(void);
+
+// Returns the name of the shifted-copy kernel chosen for bitarray_copy_range
+// and the rotation engines on this CPU (for example "avx2" or "portable").
+const char* bitarray_get_copy_kernel(void);
+
+// Returns the name of the kernel chosen for bitarray_mismatch and
+// bitarray_equal on this CPU (for example "avx2" or "portable").
+const char* bitarray_get_mismatch_kernel(void);
+
+// Returns the name of the kernel chosen for the bitarray_bundle_* functions
+// on this CPU (for example "avx512bw" or "portable").
+const char* bitarray_get_bundle_kernel(void);
+
+// Returns the name of the population-count kernel chosen for this CPU (for
+// example "avx512vpopcntdq" or "popcnt").
+const char* bitarray_get_count_kernel(void);
+
 void do_isaac_stuff(void);
 
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
 #endif  // BITARRAY_H
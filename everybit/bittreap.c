@@ -0,0 +1,602 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Implements the implicit treap described in bittreap.h.
+
+#include "./bittreap.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ********************************* Macros *********************************
+
+#define WORD_SIZE 64
+
+// Most bits a single node holds.  Big enough that building and flattening
+// stream whole cache lines, small enough that cutting a chunk in two is cheap.
+#define BITTREAP_CHUNK_BITS 2048
+#define BITTREAP_CHUNK_WORDS (BITTREAP_CHUNK_BITS / WORD_SIZE)
+
+// Nodes a rotation may need: one per cut.
+#define BITTREAP_SPARE_NODES 3
+
+// Nodes a tree may hold beyond twice the chunks its bits need before a
+// rotation re-chunks it.
+#define BITTREAP_SLACK_NODES 16
+
+// ********************************* Types **********************************
+
+typedef uint64_t word;
+
+struct bittreap_node {
+  struct bittreap_node* left;
+  struct bittreap_node* right;
+
+  // Heap priority; a parent's priority is never below its children's.
+  uint64_t priority;
+
+  // Bits held by this node, and by its whole subtree.
+  size_t bits;
+  size_t subtree_bits;
+
+  // This node's bits, least significant bit of chunk[0] first.
+  word chunk[BITTREAP_CHUNK_WORDS];
+};
+
+typedef struct bittreap_node node_t;
+
+struct bittreap {
+  node_t* root;
+
+  // Nodes set aside so a rotation never fails halfway through.
+  node_t* spare[BITTREAP_SPARE_NODES];
+  int spare_count;
+
+  // Nodes in the tree itself, not counting the spares.
+  size_t node_count;
+
+  // State of the xorshift generator that hands out priorities.  The tree has
+  // its own so it never disturbs the rand() sequence tests rely on.
+  uint64_t seed;
+};
+
+// Collects bits in order and writes them out to a packed buffer a word at a
+// time.
+struct bit_writer {
+  char* buf;
+  size_t byte_index;
+  word pending;
+  size_t pending_bits;
+};
+
+// ******************** Prototypes for static functions *********************
+
+// Number of bits in the subtree rooted at node, which may be NULL.
+static size_t subtree_bits(const node_t* const node);
+
+// Recomputes node->subtree_bits from its children.
+static void update(node_t* const node);
+
+// Draws the next priority from the tree's generator.
+static uint64_t next_priority(bittreap_t* const tree);
+
+// Builds a balanced subtree over chunks [lo, hi) of buf, or returns NULL
+// (after freeing anything it made) if memory runs out.
+static node_t* build(bittreap_t* const tree,
+                     const char* const buf,
+                     const size_t bit_sz,
+                     const size_t lo,
+                     const size_t hi,
+                     bool* const failed);
+
+// Restores the heap order below node after a priority was assigned to it.
+static void sift_down(node_t* const node);
+
+// Frees every node in a subtree.
+static void free_subtree(node_t* const node);
+
+// Cuts the subtree at node into the first bit_count bits (*left) and the rest
+// (*right).  A chunk straddling the cut is split using a spare node.
+static void split(bittreap_t* const tree,
+                  node_t* const node,
+                  const size_t bit_count,
+                  node_t** const left,
+                  node_t** const right);
+
+// Joins two subtrees, every bit of left coming before every bit of right.
+static node_t* merge(node_t* const left, node_t* const right);
+
+// Like merge, but first moves the bits of right's first node onto the end of
+// left's last node if they fit in one chunk, so that cuts made by earlier
+// rotations do not pile up as ever smaller nodes.
+static node_t* join(bittreap_t* const tree, node_t* const left, node_t* right);
+
+// Removes the first node of a subtree, handing it back to the spares (or
+// freeing it if they are full), and returns what is left of the subtree.
+static node_t* remove_first(bittreap_t* const tree, node_t* const node);
+
+// Rebuilds the tree with full chunks if it holds too many nodes for its bits.
+// Leaves it as it is if memory for the rebuild cannot be found.
+static void compact(bittreap_t* const tree);
+
+// Returns the node holding bit_index and sets *chunk_index to the position of
+// the bit within that node's chunk.
+static node_t* find(const bittreap_t* const tree,
+                    const size_t bit_index,
+                    size_t* const chunk_index);
+
+// Counts the set bits in [from, to) of the bits held by a subtree.
+static size_t count_subtree(const node_t* const node, const size_t from, const size_t to);
+
+// Counts the set bits in [from, to) of one node's chunk.
+static size_t count_chunk(const node_t* const node, const size_t from, const size_t to);
+
+// Moves bits [from, from + count) of src down to the start of dst.
+static void extract_bits(word* const dst,
+                         const word* const src,
+                         const size_t from,
+                         const size_t count);
+
+// Appends the low bit_count bits of a_word to writer.
+static void bit_writer_put(struct bit_writer* const writer,
+                           const word a_word,
+                           const size_t bit_count);
+
+// Writes out whatever bits writer still holds.
+static void bit_writer_flush(struct bit_writer* const writer);
+
+// Appends every chunk of a subtree to writer, in order.
+static void flatten_subtree(const node_t* const node, struct bit_writer* const writer);
+
+// ******************************* Functions ********************************
+
+bittreap_t* bittreap_build(const char* const buf, const size_t bit_sz) {
+  bittreap_t* const tree = malloc(sizeof(struct bittreap));
+  if (tree == NULL) {
+    return NULL;
+  }
+  tree->root = NULL;
+  tree->spare_count = 0;
+  tree->seed = 0x9E3779B97F4A7C15ULL ^ bit_sz;
+
+  bool failed = false;
+  const size_t chunk_count = (bit_sz + BITTREAP_CHUNK_BITS - 1) / BITTREAP_CHUNK_BITS;
+  tree->root = build(tree, buf, bit_sz, 0, chunk_count, &failed);
+  tree->node_count = chunk_count;
+  if (failed) {
+    bittreap_free(tree);
+    return NULL;
+  }
+  return tree;
+}
+
+void bittreap_free(bittreap_t* const tree) {
+  if (tree == NULL) {
+    return;
+  }
+  free_subtree(tree->root);
+  for (int i = 0; i < tree->spare_count; i++) {
+    free(tree->spare[i]);
+  }
+  free(tree);
+}
+
+void bittreap_flatten(const bittreap_t* const tree, char* const buf) {
+  struct bit_writer writer = { buf, 0, 0, 0 };
+  flatten_subtree(tree->root, &writer);
+  bit_writer_flush(&writer);
+}
+
+bool bittreap_get(const bittreap_t* const tree, const size_t bit_index) {
+  size_t chunk_index;
+  const node_t* const node = find(tree, bit_index, &chunk_index);
+  return (node->chunk[chunk_index / WORD_SIZE] >> (chunk_index % WORD_SIZE)) & 1;
+}
+
+void bittreap_set(bittreap_t* const tree, const size_t bit_index, const bool value) {
+  size_t chunk_index;
+  node_t* const node = find(tree, bit_index, &chunk_index);
+  const word mask = (word) 1 << (chunk_index % WORD_SIZE);
+  if (value) {
+    node->chunk[chunk_index / WORD_SIZE] |= mask;
+  } else {
+    node->chunk[chunk_index / WORD_SIZE] &= ~mask;
+  }
+}
+
+size_t bittreap_count(const bittreap_t* const tree,
+                      const size_t bit_offset,
+                      const size_t bit_length) {
+  assert(bit_offset + bit_length <= subtree_bits(tree->root));
+  return count_subtree(tree->root, bit_offset, bit_offset + bit_length);
+}
+
+bool bittreap_rotate_left(bittreap_t* const tree,
+                          const size_t bit_offset,
+                          const size_t bit_length,
+                          const size_t bit_left_amount) {
+  assert(bit_offset + bit_length <= subtree_bits(tree->root));
+  assert(bit_left_amount <= bit_length);
+  if (bit_left_amount == 0 || bit_left_amount == bit_length) {
+    return true;
+  }
+
+  while (tree->spare_count < BITTREAP_SPARE_NODES) {
+    node_t* const node = malloc(sizeof(node_t));
+    if (node == NULL) {
+      return false;
+    }
+    tree->spare[tree->spare_count++] = node;
+  }
+
+  // root = before | moved | kept | after, where moved is the bit_left_amount
+  // bits that wrap around to the end of the subarray.
+  node_t *before, *rest, *range, *after, *moved, *kept;
+  split(tree, tree->root, bit_offset, &before, &rest);
+  split(tree, rest, bit_length, &range, &after);
+  split(tree, range, bit_left_amount, &moved, &kept);
+  tree->root = join(tree, before, join(tree, join(tree, kept, moved), after));
+  compact(tree);
+  return true;
+}
+
+size_t bittreap_node_count(const bittreap_t* const tree) {
+  return tree->node_count;
+}
+
+static size_t subtree_bits(const node_t* const node) {
+  return (node == NULL) ? 0 : node->subtree_bits;
+}
+
+static void update(node_t* const node) {
+  node->subtree_bits = subtree_bits(node->left) + node->bits + subtree_bits(node->right);
+}
+
+static uint64_t next_priority(bittreap_t* const tree) {
+  tree->seed ^= tree->seed << 13;
+  tree->seed ^= tree->seed >> 7;
+  tree->seed ^= tree->seed << 17;
+  return tree->seed;
+}
+
+static node_t* build(bittreap_t* const tree,
+                     const char* const buf,
+                     const size_t bit_sz,
+                     const size_t lo,
+                     const size_t hi,
+                     bool* const failed) {
+  if (lo >= hi || *failed) {
+    return NULL;
+  }
+  const size_t mid = lo + (hi - lo) / 2;
+  node_t* const node = malloc(sizeof(node_t));
+  if (node == NULL) {
+    *failed = true;
+    return NULL;
+  }
+
+  // Chunks start on byte boundaries here, so the bits can simply be copied.
+  const size_t first_bit = mid * BITTREAP_CHUNK_BITS;
+  const size_t bits = (bit_sz - first_bit < BITTREAP_CHUNK_BITS) ?
+                      bit_sz - first_bit : BITTREAP_CHUNK_BITS;
+  memset(node->chunk, 0, sizeof(node->chunk));
+  memcpy(node->chunk, buf + first_bit / 8, (bits + 7) / 8);
+  if (bits % 8 != 0) {
+    // Clear whatever followed the last bit in its byte.
+    node->chunk[(bits - 1) / WORD_SIZE] &= UINT64_MAX >> (WORD_SIZE - bits % WORD_SIZE);
+  }
+  node->bits = bits;
+  node->priority = next_priority(tree);
+  node->left = build(tree, buf, bit_sz, lo, mid, failed);
+  node->right = build(tree, buf, bit_sz, mid + 1, hi, failed);
+  update(node);
+  sift_down(node);
+  if (*failed) {
+    free_subtree(node);
+    return NULL;
+  }
+  return node;
+}
+
+static void sift_down(node_t* const node) {
+  node_t* largest = node;
+  if (node->left != NULL && node->left->priority > largest->priority) {
+    largest = node->left;
+  }
+  if (node->right != NULL && node->right->priority > largest->priority) {
+    largest = node->right;
+  }
+  if (largest != node) {
+    const uint64_t priority = node->priority;
+    node->priority = largest->priority;
+    largest->priority = priority;
+    sift_down(largest);
+  }
+}
+
+static void free_subtree(node_t* const node) {
+  if (node == NULL) {
+    return;
+  }
+  free_subtree(node->left);
+  free_subtree(node->right);
+  free(node);
+}
+
+static void split(bittreap_t* const tree,
+                  node_t* const node,
+                  const size_t bit_count,
+                  node_t** const left,
+                  node_t** const right) {
+  if (node == NULL) {
+    *left = NULL;
+    *right = NULL;
+    return;
+  }
+  const size_t left_bits = subtree_bits(node->left);
+  if (bit_count <= left_bits) {
+    split(tree, node->left, bit_count, left, &node->left);
+    update(node);
+    *right = node;
+  } else if (bit_count >= left_bits + node->bits) {
+    split(tree, node->right, bit_count - left_bits - node->bits, &node->right, right);
+    update(node);
+    *left = node;
+  } else {
+    // The cut falls inside this node's chunk: the tail of the chunk moves to
+    // a spare node that takes over the right subtree.  Giving it the same
+    // priority keeps the heap order intact.
+    assert(tree->spare_count > 0);
+    node_t* const tail = tree->spare[--tree->spare_count];
+    tree->node_count++;
+    const size_t cut = bit_count - left_bits;
+    memset(tail->chunk, 0, sizeof(tail->chunk));
+    extract_bits(tail->chunk, node->chunk, cut, node->bits - cut);
+    tail->bits = node->bits - cut;
+    tail->priority = node->priority;
+    tail->left = NULL;
+    tail->right = node->right;
+    update(tail);
+
+    if (cut % WORD_SIZE != 0) {
+      node->chunk[cut / WORD_SIZE] &= UINT64_MAX >> (WORD_SIZE - cut % WORD_SIZE);
+    }
+    for (size_t i = (cut + WORD_SIZE - 1) / WORD_SIZE; i < BITTREAP_CHUNK_WORDS; i++) {
+      node->chunk[i] = 0;
+    }
+    node->bits = cut;
+    node->right = NULL;
+    update(node);
+
+    *left = node;
+    *right = tail;
+  }
+}
+
+static node_t* merge(node_t* const left, node_t* const right) {
+  if (left == NULL) {
+    return right;
+  }
+  if (right == NULL) {
+    return left;
+  }
+  if (left->priority >= right->priority) {
+    left->right = merge(left->right, right);
+    update(left);
+    return left;
+  }
+  right->left = merge(left, right->left);
+  update(right);
+  return right;
+}
+
+static node_t* join(bittreap_t* const tree, node_t* const left, node_t* right) {
+  if (left == NULL || right == NULL) {
+    return merge(left, right);
+  }
+  node_t* last = left;
+  while (last->right != NULL) {
+    last = last->right;
+  }
+  const node_t* first = right;
+  while (first->left != NULL) {
+    first = first->left;
+  }
+  const size_t bits = first->bits;
+  if (last->bits + bits > BITTREAP_CHUNK_BITS) {
+    return merge(left, right);
+  }
+
+  // Bits past the end of a chunk are always clear, so the moved bits can be
+  // ORed in place.
+  const size_t shift = last->bits % WORD_SIZE;
+  word* const dst = last->chunk + last->bits / WORD_SIZE;
+  for (size_t i = 0; i < (bits + WORD_SIZE - 1) / WORD_SIZE; i++) {
+    dst[i] |= first->chunk[i] << shift;
+    if (shift != 0 && dst + i + 1 < last->chunk + BITTREAP_CHUNK_WORDS) {
+      dst[i + 1] |= first->chunk[i] >> (WORD_SIZE - shift);
+    }
+  }
+  last->bits += bits;
+  for (node_t* node = left; node != NULL; node = node->right) {
+    node->subtree_bits += bits;
+  }
+  return merge(left, remove_first(tree, right));
+}
+
+static node_t* remove_first(bittreap_t* const tree, node_t* const node) {
+  if (node->left != NULL) {
+    node->left = remove_first(tree, node->left);
+    update(node);
+    return node;
+  }
+  // The right child takes the node's place; its priority is no higher, so
+  // the heap order holds.
+  node_t* const right = node->right;
+  if (tree->spare_count < BITTREAP_SPARE_NODES) {
+    tree->spare[tree->spare_count++] = node;
+  } else {
+    free(node);
+  }
+  tree->node_count--;
+  return right;
+}
+
+static void compact(bittreap_t* const tree) {
+  const size_t bit_sz = subtree_bits(tree->root);
+  const size_t chunk_count = (bit_sz + BITTREAP_CHUNK_BITS - 1) / BITTREAP_CHUNK_BITS;
+  if (tree->node_count <= 2 * chunk_count + BITTREAP_SLACK_NODES) {
+    return;
+  }
+  // Through a packed copy: flattening streams whole chunks and building
+  // cuts them again on chunk boundaries.
+  char* const buf = malloc(chunk_count * (BITTREAP_CHUNK_BITS / 8));
+  if (buf == NULL) {
+    return;
+  }
+  bittreap_flatten(tree, buf);
+  bool failed = false;
+  node_t* const root = build(tree, buf, bit_sz, 0, chunk_count, &failed);
+  free(buf);
+  if (failed) {
+    return;
+  }
+  free_subtree(tree->root);
+  tree->root = root;
+  tree->node_count = chunk_count;
+}
+
+static node_t* find(const bittreap_t* const tree,
+                    const size_t bit_index,
+                    size_t* const chunk_index) {
+  assert(bit_index < subtree_bits(tree->root));
+  node_t* node = tree->root;
+  size_t index = bit_index;
+  while (true) {
+    const size_t left_bits = subtree_bits(node->left);
+    if (index < left_bits) {
+      node = node->left;
+    } else if (index < left_bits + node->bits) {
+      *chunk_index = index - left_bits;
+      return node;
+    } else {
+      index -= left_bits + node->bits;
+      node = node->right;
+    }
+  }
+}
+
+static size_t count_subtree(const node_t* const node, const size_t from, const size_t to) {
+  if (node == NULL || from >= to) {
+    return 0;
+  }
+  const size_t left_bits = subtree_bits(node->left);
+  const size_t right_start = left_bits + node->bits;
+  size_t count = 0;
+  if (from < left_bits) {
+    count += count_subtree(node->left, from, (to < left_bits) ? to : left_bits);
+  }
+  if (from < right_start && to > left_bits) {
+    count += count_chunk(node,
+                         (from > left_bits) ? from - left_bits : 0,
+                         ((to < right_start) ? to : right_start) - left_bits);
+  }
+  if (to > right_start) {
+    count += count_subtree(node->right,
+                           (from > right_start) ? from - right_start : 0,
+                           to - right_start);
+  }
+  return count;
+}
+
+static size_t count_chunk(const node_t* const node, const size_t from, const size_t to) {
+  size_t count = 0;
+  for (size_t i = from; i < to; ) {
+    const size_t shift = i % WORD_SIZE;
+    const size_t take = (to - i < WORD_SIZE - shift) ? to - i : WORD_SIZE - shift;
+    word value = node->chunk[i / WORD_SIZE] >> shift;
+    if (take < WORD_SIZE) {
+      value &= ((word) 1 << take) - 1;
+    }
+    count += (size_t) __builtin_popcountll(value);
+    i += take;
+  }
+  return count;
+}
+
+static void extract_bits(word* const dst,
+                         const word* const src,
+                         const size_t from,
+                         const size_t count) {
+  const size_t shift = from % WORD_SIZE;
+  const size_t first = from / WORD_SIZE;
+  const size_t word_count = (count + WORD_SIZE - 1) / WORD_SIZE;
+  for (size_t i = 0; i < word_count; i++) {
+    word value = src[first + i] >> shift;
+    if (shift != 0 && first + i + 1 < BITTREAP_CHUNK_WORDS) {
+      value |= src[first + i + 1] << (WORD_SIZE - shift);
+    }
+    dst[i] = value;
+  }
+  if (count % WORD_SIZE != 0) {
+    dst[word_count - 1] &= UINT64_MAX >> (WORD_SIZE - count % WORD_SIZE);
+  }
+}
+
+static void bit_writer_put(struct bit_writer* const writer,
+                           const word a_word,
+                           const size_t bit_count) {
+  assert(bit_count > 0 && bit_count <= WORD_SIZE);
+  writer->pending |= a_word << writer->pending_bits;
+  if (writer->pending_bits + bit_count < WORD_SIZE) {
+    writer->pending_bits += bit_count;
+    return;
+  }
+  // A whole word is ready; the bits of a_word that did not fit start the
+  // next one.
+  memcpy(writer->buf + writer->byte_index, &writer->pending, sizeof(word));
+  writer->byte_index += sizeof(word);
+  const size_t used = WORD_SIZE - writer->pending_bits;
+  writer->pending = (used == WORD_SIZE) ? 0 : a_word >> used;
+  writer->pending_bits = bit_count - used;
+}
+
+static void bit_writer_flush(struct bit_writer* const writer) {
+  memcpy(writer->buf + writer->byte_index, &writer->pending, (writer->pending_bits + 7) / 8);
+  writer->byte_index += (writer->pending_bits + 7) / 8;
+  writer->pending = 0;
+  writer->pending_bits = 0;
+}
+
+static void flatten_subtree(const node_t* const node, struct bit_writer* const writer) {
+  if (node == NULL) {
+    return;
+  }
+  flatten_subtree(node->left, writer);
+  for (size_t i = 0; i < node->bits; i += WORD_SIZE) {
+    const size_t count = (node->bits - i < WORD_SIZE) ? node->bits - i : WORD_SIZE;
+    bit_writer_put(writer, node->chunk[i / WORD_SIZE], count);
+  }
+  flatten_subtree(node->right, writer);
+}
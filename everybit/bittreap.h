@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// An implicit treap of bit chunks: the storage behind bit arrays created with
+// BITARRAY_BACKEND_TREAP.  The bits are cut into chunks of at most
+// BITTREAP_CHUNK_BITS, kept in order by an in-order walk of the tree, and each
+// node records how many bits its subtree holds.  Cutting the tree at a bit
+// position and gluing two trees together are both O(log n), so rotating a
+// subarray costs three cuts and three joins no matter how long it is.
+//
+// This module only deals with bit positions; struct bitarray in bitarray.c
+// decides when to build a tree and when to flatten it back.
+
+#ifndef BITTREAP_H
+#define BITTREAP_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// ********************************* Types **********************************
+
+typedef struct bittreap bittreap_t;
+
+// ******************************* Prototypes *******************************
+
+// Builds a tree holding the bit_sz bits packed (8 per byte, least significant
+// bit first) in buf.  Returns NULL if memory runs out.
+bittreap_t* bittreap_build(const char* const buf, const size_t bit_sz);
+
+// Frees a tree made by bittreap_build.
+void bittreap_free(bittreap_t* const tree);
+
+// Writes every bit of the tree back to buf in the packed layout that
+// bittreap_build reads.  buf must hold at least (bit_sz + 7) / 8 bytes.
+void bittreap_flatten(const bittreap_t* const tree, char* const buf);
+
+// Reads or writes the bit at bit_index.
+bool bittreap_get(const bittreap_t* const tree, const size_t bit_index);
+void bittreap_set(bittreap_t* const tree, const size_t bit_index, const bool value);
+
+// Counts the set bits in [bit_offset, bit_offset + bit_length).
+size_t bittreap_count(const bittreap_t* const tree,
+                      const size_t bit_offset,
+                      const size_t bit_length);
+
+// Rotates [bit_offset, bit_offset + bit_length) left by bit_left_amount.
+// Returns false, leaving the tree untouched, if memory for the at most three
+// chunks that have to be cut in two cannot be found.
+//
+// Pieces left next to each other that fit in one chunk are joined again, and
+// a tree that still ends up with more than about twice the nodes its bits
+// need is rebuilt with full chunks, so memory stays proportional to the
+// array however many rotations it goes through.
+bool bittreap_rotate_left(bittreap_t* const tree,
+                          const size_t bit_offset,
+                          const size_t bit_length,
+                          const size_t bit_left_amount);
+
+// Returns the number of chunks the tree is cut into.
+size_t bittreap_node_count(const bittreap_t* const tree);
+
+#endif  // BITTREAP_H
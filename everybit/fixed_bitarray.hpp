@@ -0,0 +1,285 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// A bit array whose size is fixed at compile time, for C++14 and later.
+//
+// everybit::fixed_bitarray<N> stores its N bits inline, in the packed layout
+// of struct bitarray (bit i is bit i % 64 of word i / 64), followed by the
+// spare word the C functions expect.  Its rotations and reversals take the
+// subarray as template arguments, so for arrays of a few words every shift
+// and mask is a constant and the loops unroll into straight-line code; they
+// are also constexpr, so they can run at compile time.  view() lends the
+// bits to the C API without copying them.
+
+#ifndef FIXED_BITARRAY_HPP
+#define FIXED_BITARRAY_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+
+#include "./bitarray.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "fixed_bitarray shares bitarray_t's word layout, which assumes little-endian words"
+#endif
+
+namespace everybit {
+
+namespace detail {
+
+// Reverses the bits of a word: the bits within each byte with three swap
+// steps, then the bytes with bswap, which GCC and Clang also evaluate in
+// constant expressions.
+constexpr std::uint64_t reverse_word(std::uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+  v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(v);
+}
+
+// Returns a word with its low count (0 to 64) bits set.
+constexpr std::uint64_t low_mask(const std::size_t count) {
+  return (count == 0) ? 0 : ~0ULL >> (64 - count);
+}
+
+// Returns the left rotation, below length, equivalent to rotating right by
+// bit_right_amount.  length must be nonzero.
+constexpr std::size_t left_amount(const std::ptrdiff_t bit_right_amount,
+                                  const std::size_t length) {
+  const std::ptrdiff_t signed_length = static_cast<std::ptrdiff_t>(length);
+  return static_cast<std::size_t>(((-bit_right_amount % signed_length) + signed_length) %
+                                  signed_length);
+}
+
+}  // namespace detail
+
+template <std::size_t N>
+class fixed_bitarray {
+  static_assert(N > 0, "a fixed_bitarray needs at least one bit");
+
+ public:
+  // Number of words holding the bits, not counting the spare word.
+  static constexpr std::size_t word_count = (N + 63) / 64;
+
+  // A bitarray_t over the bits of a fixed_bitarray, made with
+  // bitarray_new_view.  It may be passed to any C function taking a
+  // bitarray_t*; changes land directly in the fixed_bitarray.  Destroying
+  // it folds back any pending whole-array rotation, so the fixed_bitarray
+  // must not be used while a view of it is alive.
+  class view_type {
+   public:
+    explicit view_type(fixed_bitarray& bits)
+      : bitarray_(bitarray_new_view(bits.words_, sizeof(bits.words_), N)) {}
+
+    view_type(view_type&& other) : bitarray_(other.bitarray_) {
+      other.bitarray_ = nullptr;
+    }
+
+    view_type(const view_type&) = delete;
+    view_type& operator=(const view_type&) = delete;
+
+    ~view_type() {
+      if (bitarray_ != nullptr) {
+        bitarray_normalize(bitarray_);
+        bitarray_free(bitarray_);
+      }
+    }
+
+    // The view, or NULL if bitarray_new_view ran out of memory.
+    bitarray_t* get() const {
+      return bitarray_;
+    }
+
+    operator bitarray_t*() const {
+      return bitarray_;
+    }
+
+   private:
+    bitarray_t* bitarray_;
+  };
+
+  // An array of N zero bits.
+  constexpr fixed_bitarray() : words_{} {}
+
+  static constexpr std::size_t size() {
+    return N;
+  }
+
+  constexpr bool get(const std::size_t bit_index) const {
+    return ((words_[bit_index / 64] >> (bit_index % 64)) & 1) != 0;
+  }
+
+  constexpr void set(const std::size_t bit_index, const bool value) {
+    const std::uint64_t bit = 1ULL << (bit_index % 64);
+    words_[bit_index / 64] = value ? (words_[bit_index / 64] | bit) :
+                                     (words_[bit_index / 64] & ~bit);
+  }
+
+  // Rotates [Off, Off + Len) right by bit_right_amount, which may be
+  // negative, as bitarray_rotate does.  A subarray within one word is
+  // rotated in a register; a longer one is read out a word at a time,
+  // starting at the bit that lands first, and written back.
+  template <std::size_t Off, std::size_t Len>
+  constexpr void rotate(const std::ptrdiff_t bit_right_amount) {
+    static_assert(Off + Len <= N, "subarray runs past the end of the array");
+    if (Len == 0) {
+      return;
+    }
+    // Len is only ever 0 when the branch above returns.
+    const std::size_t length = (Len == 0) ? 1 : Len;
+    const std::size_t left = detail::left_amount(bit_right_amount, length);
+    if (left == 0) {
+      return;
+    }
+    if (Off % 64 + Len <= 64) {
+      const std::uint64_t mask = detail::low_mask(Len);
+      const std::uint64_t field = (words_[Off / 64] >> (Off % 64)) & mask;
+      const std::uint64_t rotated = ((field >> left) | (field << (length - left))) & mask;
+      words_[Off / 64] = (words_[Off / 64] & ~(mask << (Off % 64))) | (rotated << (Off % 64));
+      return;
+    }
+    std::uint64_t rotated[Len / 64 + 1] = {};
+    for (std::size_t i = 0; i < Len; i += 64) {
+      const std::size_t count = (Len - i < 64) ? Len - i : 64;
+      // Bit i of the result is bit i + left of the subarray, wrapping
+      // around its end.
+      std::size_t start = i + left;
+      if (start >= Len) {
+        start -= Len;
+      }
+      if (start + count <= Len) {
+        rotated[i / 64] = get_bits(Off + start, count);
+      } else {
+        const std::size_t first = Len - start;
+        rotated[i / 64] = get_bits(Off + start, first) | (get_bits(Off, count - first) << first);
+      }
+    }
+    for (std::size_t i = 0; i < Len; i += 64) {
+      set_bits(Off + i, (Len - i < 64) ? Len - i : 64, rotated[i / 64]);
+    }
+  }
+
+  // Rotates the whole array right by bit_right_amount.
+  constexpr void rotate(const std::ptrdiff_t bit_right_amount) {
+    rotate<0, N>(bit_right_amount);
+  }
+
+  // Reverses [Off, Off + Len).  Each word of the result is a word of the
+  // subarray, counted from its end, bit-reversed and shifted into place.
+  template <std::size_t Off, std::size_t Len>
+  constexpr void reverse() {
+    static_assert(Off + Len <= N, "subarray runs past the end of the array");
+    if (Len < 2) {
+      return;
+    }
+    if (Off % 64 + Len <= 64) {
+      const std::uint64_t mask = detail::low_mask(Len);
+      const std::uint64_t reversed =
+        (detail::reverse_word(words_[Off / 64]) >> (64 - Off % 64 - Len)) & mask;
+      words_[Off / 64] = (words_[Off / 64] & ~(mask << (Off % 64))) | (reversed << (Off % 64));
+      return;
+    }
+    std::uint64_t reversed[Len / 64 + 1] = {};
+    for (std::size_t i = 0; i < Len; i += 64) {
+      const std::size_t count = (Len - i < 64) ? Len - i : 64;
+      reversed[i / 64] =
+        detail::reverse_word(get_bits(Off + Len - i - count, count)) >> (64 - count);
+    }
+    for (std::size_t i = 0; i < Len; i += 64) {
+      set_bits(Off + i, (Len - i < 64) ? Len - i : 64, reversed[i / 64]);
+    }
+  }
+
+  // Reverses the whole array.
+  constexpr void reverse() {
+    reverse<0, N>();
+  }
+
+  // Returns true if the two arrays hold the same bits.  Bits of the last
+  // word past N, which C functions working a word at a time may leave
+  // behind, are ignored.
+  constexpr bool operator==(const fixed_bitarray& other) const {
+    for (std::size_t i = 0; i + 1 < word_count; i++) {
+      if (words_[i] != other.words_[i]) {
+        return false;
+      }
+    }
+    const std::uint64_t mask = detail::low_mask(N - 64 * (word_count - 1));
+    return ((words_[word_count - 1] ^ other.words_[word_count - 1]) & mask) == 0;
+  }
+
+  constexpr bool operator!=(const fixed_bitarray& other) const {
+    return !(*this == other);
+  }
+
+  // Lends the bits to the C API; see view_type.
+  view_type view() {
+    return view_type(*this);
+  }
+
+  // The words holding the bits, in bitarray_t's layout.
+  constexpr const std::uint64_t* data() const {
+    return words_;
+  }
+
+  constexpr std::uint64_t* data() {
+    return words_;
+  }
+
+ private:
+  // Returns the count (1 to 64) bits starting at bit_index in the low bits
+  // of a word.  The spare word makes the second load safe at the end.
+  constexpr std::uint64_t get_bits(const std::size_t bit_index, const std::size_t count) const {
+    const std::size_t shift = bit_index % 64;
+    std::uint64_t result = words_[bit_index / 64] >> shift;
+    if (shift + count > 64) {
+      result |= words_[bit_index / 64 + 1] << (64 - shift);
+    }
+    return result & detail::low_mask(count);
+  }
+
+  // Overwrites the count (1 to 64) bits starting at bit_index with the low
+  // bits of value, leaving every other bit alone.
+  constexpr void set_bits(const std::size_t bit_index,
+                          const std::size_t count,
+                          const std::uint64_t value) {
+    const std::size_t shift = bit_index % 64;
+    const std::uint64_t mask = detail::low_mask(count);
+    const std::uint64_t bits = value & mask;
+    words_[bit_index / 64] = (words_[bit_index / 64] & ~(mask << shift)) | (bits << shift);
+    if (shift + count > 64) {
+      const std::size_t spill = shift + count - 64;
+      words_[bit_index / 64 + 1] = (words_[bit_index / 64 + 1] & ~detail::low_mask(spill)) |
+                                   (bits >> (64 - shift));
+    }
+  }
+
+  // The bits, then the spare word bitarray_new_view asks for.  Aligned like
+  // the buffers bitarray_new allocates.
+  alignas(64) std::uint64_t words_[word_count + 1];
+};
+
+}  // namespace everybit
+
+#endif  // FIXED_BITARRAY_HPP
@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Checks everybit::fixed_bitarray against a bit-by-bit reference and against
+// the C functions run on its view.  Built and run by "make cxxtest".
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "./fixed_bitarray.hpp"
+
+using everybit::fixed_bitarray;
+
+namespace {
+
+int failures = 0;
+
+// Rotates ref[off, off + len) right by bit_right_amount, one bit at a time.
+template <std::size_t N>
+void reference_rotate(bool (&ref)[N],
+                      const std::size_t off,
+                      const std::size_t len,
+                      const std::ptrdiff_t bit_right_amount) {
+  if (len == 0) {
+    return;
+  }
+  const std::size_t left = everybit::detail::left_amount(bit_right_amount, len);
+  bool rotated[N];
+  for (std::size_t i = 0; i < len; i++) {
+    rotated[i] = ref[off + (i + left) % len];
+  }
+  for (std::size_t i = 0; i < len; i++) {
+    ref[off + i] = rotated[i];
+  }
+}
+
+// Reverses ref[off, off + len), one bit at a time.
+template <std::size_t N>
+void reference_reverse(bool (&ref)[N], const std::size_t off, const std::size_t len) {
+  for (std::size_t i = 0; i < len / 2; i++) {
+    const bool bit = ref[off + i];
+    ref[off + i] = ref[off + len - 1 - i];
+    ref[off + len - 1 - i] = bit;
+  }
+}
+
+template <std::size_t N>
+bool matches(const fixed_bitarray<N>& bits, const bool (&ref)[N]) {
+  for (std::size_t i = 0; i < N; i++) {
+    if (bits.get(i) != ref[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs random rotations and reversals of [Off, Off + Len) of a
+// fixed_bitarray<N>, checking each against the reference.  Every third
+// rotation is also run by bitarray_rotate on a view of a copy, some of them
+// with a pending whole-array rotation, and the copy must agree.
+template <std::size_t N, std::size_t Off, std::size_t Len>
+void check_subarray(const unsigned int seed) {
+  srand(seed);
+  fixed_bitarray<N> bits;
+  bool ref[N];
+  for (std::size_t i = 0; i < N; i++) {
+    ref[i] = (rand() & 1) != 0;
+    bits.set(i, ref[i]);
+  }
+  for (int step = 0; step < 64; step++) {
+    const std::ptrdiff_t amount = rand() % 1001 - 500;
+    if (step % 4 == 3) {
+      bits.template reverse<Off, Len>();
+      reference_reverse(ref, Off, Len);
+    } else {
+      fixed_bitarray<N> copy = bits;
+      bits.template rotate<Off, Len>(amount);
+      reference_rotate(ref, Off, Len, amount);
+      if (step % 3 == 0) {
+        auto view = copy.view();
+        if (view.get() == NULL) {
+          printf("N=%zu Off=%zu Len=%zu: bitarray_new_view failed\n", N, Off, Len);
+          failures++;
+          return;
+        }
+        if (step % 2 == 0) {
+          bitarray_rotate(view, 0, N, amount + 1);
+          bitarray_rotate(view, 0, N, -(amount + 1));
+        }
+        bitarray_rotate(view, Off, Len, amount);
+      } else {
+        copy.template rotate<Off, Len>(amount);
+      }
+      // The view folds its pending rotation back when it goes away above.
+      if (copy != bits) {
+        printf("N=%zu Off=%zu Len=%zu step %d: bitarray_rotate disagrees\n",
+               N, Off, Len, step);
+        failures++;
+        return;
+      }
+    }
+    if (!matches(bits, ref)) {
+      printf("N=%zu Off=%zu Len=%zu step %d: %s disagrees with the reference\n",
+             N, Off, Len, step, (step % 4 == 3) ? "reverse" : "rotate");
+      failures++;
+      return;
+    }
+  }
+}
+
+// The same steps at compile time and at run time must give the same bits.
+constexpr fixed_bitarray<200> scrambled() {
+  fixed_bitarray<200> bits;
+  for (std::size_t i = 0; i < 200; i += 3) {
+    bits.set(i, true);
+  }
+  bits.rotate<5, 150>(-37);
+  bits.reverse<3, 190>();
+  bits.rotate<1, 40>(7);
+  bits.reverse<70, 10>();
+  bits.rotate(13);
+  return bits;
+}
+
+constexpr fixed_bitarray<200> scrambled_at_compile_time = scrambled();
+
+void check_constexpr() {
+  if (scrambled() != scrambled_at_compile_time) {
+    printf("constexpr rotate and reverse disagree with the run-time ones\n");
+    failures++;
+  }
+}
+
+}  // namespace
+
+int main() {
+  // Within one word, across word boundaries, whole arrays and empty or
+  // single-bit subarrays.
+  check_subarray<1, 0, 1>(1);
+  check_subarray<8, 2, 5>(2);
+  check_subarray<64, 0, 64>(3);
+  check_subarray<64, 3, 60>(4);
+  check_subarray<70, 10, 54>(5);
+  check_subarray<130, 63, 2>(6);
+  check_subarray<130, 1, 129>(7);
+  check_subarray<200, 5, 150>(8);
+  check_subarray<200, 0, 200>(9);
+  check_subarray<256, 64, 128>(10);
+  check_subarray<300, 7, 0>(11);
+  check_subarray<300, 150, 1>(12);
+  check_subarray<1000, 13, 977>(13);
+  check_constexpr();
+  if (failures != 0) {
+    printf("fixed_bitarray: %d checks FAILED\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("fixed_bitarray: all checks PASSED\n");
+  return EXIT_SUCCESS;
+}
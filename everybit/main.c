@@ -28,6 +28,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <unistd.h>
 #include "./tests.h"
@@ -40,6 +41,37 @@
 
 void print_usage(const char* const argv_0);
 
+// Parses a rotation engine name given to -e.  Returns false if the name is
+// not recognized.
+bool parse_engine(const char* const name, bitarray_rotate_engine_t* const engine);
+
+// Parses a storage backend name given to -b.  Returns false if the name is
+// not recognized.
+bool parse_backend(const char* const name, bitarray_backend_t* const backend);
+
+// Prints the rotation engine and the settings it runs with, for the -s, -m
+// and -l results.
+void print_engine_header(void);
+
+
+// ******************************** Globals *********************************
+
+// Names accepted by -e, indexed by bitarray_rotate_engine_t.
+static const char* const engine_names[] = {
+  [BITARRAY_ROTATE_REVERSAL] = "reversal",
+  [BITARRAY_ROTATE_BLOCKSWAP] = "blockswap",
+  [BITARRAY_ROTATE_BLOCKED] = "blocked",
+};
+
+// Names accepted by -b, indexed by bitarray_backend_t.
+static const char* const backend_names[] = {
+  [BITARRAY_BACKEND_PACKED] = "packed",
+  [BITARRAY_BACKEND_TREAP] = "treap",
+};
+
+// Backend selected with -b, for the results header.
+static bitarray_backend_t backend = BITARRAY_BACKEND_PACKED;
+
 
 // ******************************* Functions ********************************
 
@@ -50,19 +82,64 @@ int main(int argc, char** argv) {
   char optchar;
   opterr = 0;
   int selected_test = -1;
-  while ((optchar = getopt(argc, argv, "n:t:smli")) != -1) {
+  bitarray_rotate_engine_t engine;
+  while ((optchar = getopt(argc, argv, "n:t:e:p:k:b:o:v:f:csmli")) != -1) {
     switch (optchar) {
     case 'n':
       selected_test = atoi(optarg);
       break;
+    case 'e':
+      // -e engine selects the rotation engine for the options after it.
+      if (!parse_engine(optarg, &engine)) {
+        fprintf(stderr, "Unknown rotation engine %s\n", optarg);
+        retval = EXIT_FAILURE;
+        goto cleanup;
+      }
+      bitarray_set_rotate_engine(engine);
+      break;
+    case 'b':
+      // -b backend selects the storage backend for the options after it.
+      if (!parse_backend(optarg, &backend)) {
+        fprintf(stderr, "Unknown storage backend %s\n", optarg);
+        retval = EXIT_FAILURE;
+        goto cleanup;
+      }
+      testutil_set_backend(backend);
+      break;
+    case 'p':
+      // -p threads sets the thread count for the options after it.
+      bitarray_set_thread_count((unsigned int) atoi(optarg));
+      break;
+    case 'k':
+      // -k kilobytes sets the blocked engine's block size for the options
+      // after it.
+      bitarray_set_block_bytes((size_t) atol(optarg) << 10);
+      break;
+    case 'c': {
+      // -c measures the streaming threshold for the options after it.
+      printf("---- STREAMING CALIBRATION ----\n");
+      const size_t threshold = calibrate_streaming_threshold();
+      if (threshold == SIZE_MAX) {
+        printf("Streaming threshold: never\n");
+      } else {
+        printf("Streaming threshold: %zu bits\n", threshold);
+      }
+      printf("---- END STREAMING CALIBRATION ----\n");
+      break;
+    }
     case 't':
       // -t file runs functional tests in the provided file
       parse_and_run_tests(optarg, selected_test);
       retval = EXIT_SUCCESS;
       goto cleanup;
+    case 'f':
+      // -f rounds checks every operation against a bit-by-bit reference.
+      retval = fuzz_operations((size_t) atol(optarg)) ? EXIT_SUCCESS : EXIT_FAILURE;
+      goto cleanup;
     case 's':
       // -s runs the short rotation performance test.
       printf("---- RESULTS ----\n");
+      print_engine_header();
       printf("Succesfully completed tier: %d\n",
              timed_rotation(0.01));
       printf("---- END RESULTS ----\n");
@@ -71,6 +148,7 @@ int main(int argc, char** argv) {
     case 'm':
       // -m runs the medium rotation performance test.
       printf("---- RESULTS ----\n");
+      print_engine_header();
       printf("Succesfully completed tier: %d\n",
              timed_rotation(0.1));
       printf("---- END RESULTS ----\n");
@@ -79,11 +157,29 @@ int main(int argc, char** argv) {
     case 'l':
       // -l runs the large rotation performance test.
       printf("---- RESULTS ----\n");
+      print_engine_header();
       printf("Succesfully completed tier: %d\n",
              timed_rotation(1.0));
       printf("---- END RESULTS ----\n");
       retval = EXIT_SUCCESS;
       goto cleanup;
+    case 'o':
+      // -o file runs the out-of-core rotation performance test in file.
+      printf("---- RESULTS ----\n");
+      printf("Out-of-core (reverse kernel: %s)\n", bitarray_get_reverse_kernel());
+      printf("Succesfully completed tier: %d\n",
+             timed_file_rotation(1.0, optarg));
+      printf("---- END RESULTS ----\n");
+      retval = EXIT_SUCCESS;
+      goto cleanup;
+    case 'v':
+      // -v items runs the lockstep rotation performance test on that many
+      // short bit arrays.
+      printf("---- BUNDLE RESULTS ----\n");
+      printf("Bundle kernel: %s, %s items\n", bitarray_get_bundle_kernel(), optarg);
+      retval = timed_bundle_rotation((size_t) atol(optarg)) ? EXIT_SUCCESS : EXIT_FAILURE;
+      printf("---- END BUNDLE RESULTS ----\n");
+      goto cleanup;
     case 'i':
       do_isaac_stuff();
       goto cleanup;
@@ -96,6 +192,7 @@ int main(int argc, char** argv) {
   retval = EXIT_SUCCESS;
 
 cleanup:
+  bitarray_release_scratch();
   return retval;
 }
 
@@ -106,6 +203,45 @@ void print_usage(const char* const argv_0) {
           "\t -l Run a sample large (1s) rotation operation\n"
           "\t    (note: the provided -[s/m/l] options only test performance and NOT correctness.)\n"
           "\t -t tests/default\tRun alltests in the testfile tests/default\n"
-          "\t -n 1 -t tests/default\tRun test 1 in the testfile tests/default\n",
+          "\t -n 1 -t tests/default\tRun test 1 in the testfile tests/default\n"
+          "\t -f 200\tCheck every operation against a bit-by-bit reference for 200\n"
+          "\t    rounds of random inputs\n"
+          "\t -e blockswap -s\tUse the named rotation engine (reversal, blockswap,\n"
+          "\t    blocked) for the options that follow it\n"
+          "\t -p 8 -l\tLet large rotations use 8 threads (0: one per processor)\n"
+          "\t -e blocked -k 512 -l\tUse 512KB blocks in the blocked engine (0: half of L2)\n"
+          "\t -b treap -l\tStore bit arrays in the named backend (packed, treap)\n"
+          "\t -o /tmp/bits\tRun the out-of-core (1s) rotation test in the given file\n"
+          "\t -v 65536\tRotate 65536 short bit arrays one by one and in lockstep, and\n"
+          "\t    report items per second\n"
+          "\t -c -l\tMeasure where streaming stores start to pay off, and use\n"
+          "\t    that threshold for the options that follow it\n",
           argv_0);
 }
+
+void print_engine_header(void) {
+  printf("Engine: %s (reverse kernel: %s, threads: %u, backend: %s, block: %zuKB)\n",
+         engine_names[bitarray_get_rotate_engine()], bitarray_get_reverse_kernel(),
+         bitarray_get_thread_count(), backend_names[backend],
+         bitarray_get_block_bytes() >> 10);
+}
+
+bool parse_engine(const char* const name, bitarray_rotate_engine_t* const engine) {
+  for (size_t i = 0; i < sizeof(engine_names) / sizeof(engine_names[0]); i++) {
+    if (engine_names[i] != NULL && strcmp(name, engine_names[i]) == 0) {
+      *engine = (bitarray_rotate_engine_t) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_backend(const char* const name, bitarray_backend_t* const backend) {
+  for (size_t i = 0; i < sizeof(backend_names) / sizeof(backend_names[0]); i++) {
+    if (backend_names[i] != NULL && strcmp(name, backend_names[i]) == 0) {
+      *backend = (bitarray_backend_t) i;
+      return true;
+    }
+  }
+  return false;
+}
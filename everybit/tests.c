@@ -21,14 +21,18 @@
  **/
 #define _GNU_SOURCE
 #include <assert.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "./bitarray.h"
+#include "./bittreap.h"
 #include "./ktiming.h"
 #include "./tests.h"
 
@@ -52,6 +56,10 @@ void testutil_rotate(const size_t bit_offset,
                      const size_t bit_length,
                      const ssize_t bit_right_shift_amount);
 
+// Performs a batch of rotations on test_bitarray with bitarray_rotate_batch.
+// Requires that test_bitarray is not NULL.
+void testutil_rotate_batch(const bitarray_rotation_t* const ops, const size_t n);
+
 // Checks that the rotation is valid given the size of test_bitarray.
 // Causes a test suite failure if the input is invalid.
 void testutil_require_valid_input(const size_t bit_offset,
@@ -60,12 +68,36 @@ void testutil_require_valid_input(const size_t bit_offset,
                                   const char* const func_name,
                                   const int line);
 
+// Replaces test_bitarray with a new, zeroed bit array of bit_sz bits.  With
+// the packed backend it comes from test_arena, which is reset first, so
+// allocation costs next to nothing.
+static void testutil_new(const size_t bit_sz);
+
 // Creates a new bit array in test_bitarray of the specified size and
 // fills it with random data based on the seed given.  For a given seed number,
 // the pseudorandom data will be the same (at least on the same glibc
 // implementation).
 static void testutil_newrand(const size_t bit_sz, const unsigned int seed);
 
+// Replaces the file at path with bit_sz random bits, determined by seed, for
+// timed_file_rotation.  Returns false if the file cannot be written.
+static bool testutil_newfile(const char* const path,
+                             const size_t bit_sz,
+                             const unsigned int seed);
+
+// Fills test_bitarray with bit_sz random bits from seed 6172, rotates the given
+// subarray right, and returns how long the rotation took in seconds.  The time
+// covers everything it takes to go from bits in buf to rotated bits in buf, so
+// for a treap-backed array it includes building the tree and flattening it.
+static double testutil_time_rotation(const size_t bit_sz,
+                                     const size_t bit_offset,
+                                     const size_t bit_length,
+                                     const size_t bit_right_shift_amount);
+
+// Writes a short human-readable size for bit_length bits ("12KB") to label,
+// which must hold at least 20 characters.
+static void testutil_size_label(char* const label, const size_t bit_length);
+
 // Prints a string representation of a bit array.
 static void bitarray_fprint(FILE* const stream,
                             const bitarray_t* const bitarray);
@@ -86,6 +118,186 @@ static bool boolfromchar(const char c);
 // Retrieves a char* argument from a buffer in strtok.
 char* next_arg_char();
 
+// Checks fuzz_operations runs, each counted on its own.
+enum fuzz_check {
+  FUZZ_NEW,
+  FUZZ_ROTATE,
+  FUZZ_ROTATE_SCRATCH,
+  FUZZ_ROTATE_BATCH,
+  FUZZ_RANDFILL,
+  FUZZ_VIEW,
+  FUZZ_MMAP,
+  FUZZ_ROTATE_FILE,
+  FUZZ_BUNDLE,
+  FUZZ_TREAP_NODES,
+  FUZZ_COUNT,
+  FUZZ_RANK,
+  FUZZ_SELECT,
+  FUZZ_OP_RANGE,
+  FUZZ_FIND,
+  FUZZ_FOREACH,
+  FUZZ_COPY_RANGE,
+  FUZZ_MISMATCH,
+  FUZZ_EQUAL,
+  FUZZ_FILL,
+  FUZZ_SHIFT,
+  FUZZ_CHECK_COUNT
+};
+
+// Ways fuzz_operations makes the bit arrays it works on.
+enum fuzz_kind {
+  FUZZ_KIND_PACKED,
+  FUZZ_KIND_TREAP,
+  FUZZ_KIND_ARENA,
+  FUZZ_KIND_VIEW,
+  FUZZ_KIND_MMAP,
+  FUZZ_KIND_COUNT
+};
+
+// A bit array under fuzz_operations and the bits it should hold, one bool
+// per bit.  Every operation is applied to both and the two compared.
+struct fuzz_subject {
+  enum fuzz_kind kind;
+  bitarray_t* bitarray;
+  bool* ref;
+  size_t bit_sz;
+  // The buffer lent to bitarray_new_view, or NULL, and its length.
+  void* view_buf;
+  size_t view_bytes;
+  // The file behind a FUZZ_KIND_MMAP array.
+  const char* path;
+};
+
+// One of the operations fuzz_step picks from.  Runs it on subject, and on
+// subject's reference if it changes bits, over [bit_offset, bit_offset +
+// bit_length) if it takes a range, and checks the result.
+typedef void (*fuzz_op_fn)(struct fuzz_subject* const subject,
+                           const size_t bit_offset,
+                           const size_t bit_length);
+
+// Returns a random number below n, which must not be 0.
+static size_t fuzz_below(const size_t n);
+
+// Returns a random subarray length up to max, favouring 0, max and lengths
+// within a bit of a word.
+static size_t fuzz_length(const size_t max);
+
+// Picks a random subarray of a bit_sz-bit array (bit_sz > 0), sometimes
+// starting and ending on a byte or word boundary.
+static void fuzz_range(const size_t bit_sz, size_t* const bit_offset, size_t* const bit_length);
+
+// Returns a random right rotation or shift amount for a subarray of
+// bit_length bits: negative, past the length, whole turns, whole bytes or
+// words, or extreme.
+static ssize_t fuzz_amount(const size_t bit_length);
+
+// Counts a failure of check and, for the first few, prints why, printf
+// style, with the round it happened in.
+static void fuzz_fail(const enum fuzz_check check, const char* const format, ...);
+
+// Rotates or reverses bits[0, bit_length) one bool at a time: the references
+// the bit array operations are checked against.
+static void fuzz_reference_rotate(bool* const bits,
+                                  const size_t bit_length,
+                                  const ssize_t bit_right_amount);
+static void fuzz_reference_reverse(bool* const bits, const size_t bit_length);
+
+// Sets the bits of bitarray and ref to the same random values, with bitarray_set.
+static void fuzz_randomize(bitarray_t* const bitarray, bool* const ref, const size_t bit_sz);
+
+// Makes a zeroed subject of bit_sz bits in the way kind says.  arena is
+// used for FUZZ_KIND_ARENA and path for FUZZ_KIND_MMAP.  Returns false if
+// the bit array could not be made.
+static bool fuzz_subject_new(struct fuzz_subject* const subject,
+                             const enum fuzz_kind kind,
+                             const size_t bit_sz,
+                             bitarray_arena_t* const arena,
+                             const char* const path);
+
+// Frees a subject.  A view's buffer, or a mapped file reopened read-only,
+// must hold the reference bits by then, and the rest of a view's buffer
+// must be as fuzz_subject_new left it.
+static void fuzz_subject_free(struct fuzz_subject* const subject);
+
+// Compares a subject's bit array with its reference through bitarray_get,
+// failing check if they differ after what.  Returns true if they agree.
+static bool fuzz_check_bits(const struct fuzz_subject* const subject,
+                            const enum fuzz_check check,
+                            const char* const what);
+
+// Runs one random operation from fuzz_ops on subject.
+static void fuzz_step(struct fuzz_subject* const subject);
+
+// Makes other a packed bit array of at least min_sz bits with random bits,
+// for the operations that take two or three arrays.
+static void fuzz_other_new(struct fuzz_subject* const other, const size_t min_sz);
+
+// Returns what op makes of the bits a and b.
+static bool fuzz_combine(const bitarray_op_t op, const bool a, const bool b);
+
+// Runs many random rotations on a bittreap, and the same rotations on a
+// packed bit array, checking that the tree never holds much more than
+// twice the nodes its bits need and ends up holding the same bits.
+static void fuzz_treap_nodes(void);
+
+// Fills an array several randfill blocks long with the same seed on one
+// thread and on four, and checks that the two agree.
+static void fuzz_randfill_threads(void);
+
+// Writes a random file at path and checks a few bitarray_rotate_file calls
+// on it, with block sizes and memory budgets down to a word.
+static void fuzz_rotate_file(const char* const path);
+
+// Checks a few random bitarray_bundle_* calls on a random bundle.
+static void fuzz_bundle(void);
+
+// The operations fuzz_step picks from, one per fuzz_op_fn.
+static void fuzz_count(struct fuzz_subject* const subject,
+                       const size_t bit_offset,
+                       const size_t bit_length);
+static void fuzz_rank_select(struct fuzz_subject* const subject,
+                             const size_t bit_offset,
+                             const size_t bit_length);
+static void fuzz_rotate(struct fuzz_subject* const subject,
+                        const size_t bit_offset,
+                        const size_t bit_length);
+static void fuzz_rotate_scratch(struct fuzz_subject* const subject,
+                                const size_t bit_offset,
+                                const size_t bit_length);
+static void fuzz_rotate_batch(struct fuzz_subject* const subject,
+                              const size_t bit_offset,
+                              const size_t bit_length);
+static void fuzz_randfill(struct fuzz_subject* const subject,
+                          const size_t bit_offset,
+                          const size_t bit_length);
+static void fuzz_op_range(struct fuzz_subject* const subject,
+                          const size_t bit_offset,
+                          const size_t bit_length);
+static void fuzz_op_whole(struct fuzz_subject* const subject,
+                          const size_t bit_offset,
+                          const size_t bit_length);
+static void fuzz_find(struct fuzz_subject* const subject,
+                      const size_t bit_offset,
+                      const size_t bit_length);
+static void fuzz_foreach(struct fuzz_subject* const subject,
+                         const size_t bit_offset,
+                         const size_t bit_length);
+static void fuzz_copy_range(struct fuzz_subject* const subject,
+                            const size_t bit_offset,
+                            const size_t bit_length);
+static void fuzz_mismatch(struct fuzz_subject* const subject,
+                          const size_t bit_offset,
+                          const size_t bit_length);
+static void fuzz_equal(struct fuzz_subject* const subject,
+                       const size_t bit_offset,
+                       const size_t bit_length);
+static void fuzz_fill(struct fuzz_subject* const subject,
+                      const size_t bit_offset,
+                      const size_t bit_length);
+static void fuzz_shift(struct fuzz_subject* const subject,
+                       const size_t bit_offset,
+                       const size_t bit_length);
+
 
 // ******************************** Globals *********************************
 // Some global variables make it easier to run individual tests.
@@ -96,6 +308,13 @@ static bitarray_t* test_bitarray = NULL;
 // Whether or not tests should be verbose.
 static bool test_verbose = false;
 
+// Storage backend of the bit arrays tests create.
+static bitarray_backend_t test_backend = BITARRAY_BACKEND_PACKED;
+
+// Arena holding test_bitarray when test_backend is BITARRAY_BACKEND_PACKED.
+// Created on first use.
+static bitarray_arena_t* test_arena = NULL;
+
 
 // ********************************* Macros *********************************
 
@@ -136,15 +355,76 @@ static bool test_verbose = false;
 
 // ******************************* Functions ********************************
 
-static void testutil_newrand(const size_t bit_sz, const unsigned int seed) {
+void testutil_set_backend(const bitarray_backend_t backend) {
+  test_backend = backend;
+}
+
+static bool testutil_newfile(const char* const path,
+                             const size_t bit_sz,
+                             const unsigned int seed) {
+  // Fill the file through a mapping, so that it may exceed memory.
+  remove(path);
+  bitarray_t* const file_bitarray = bitarray_open_mmap(path, bit_sz, BITARRAY_MMAP_RDWR);
+  if (file_bitarray == NULL) {
+    return false;
+  }
+  bitarray_randfill_seeded(file_bitarray, seed);
+  const bool ok = bitarray_sync(file_bitarray);
+  bitarray_free(file_bitarray);
+  return ok;
+}
+
+static void testutil_size_label(char* const label, const size_t bit_length) {
+  if (bit_length < 8*1024){
+      sprintf(label, "%luB", bit_length / 8);
+  } else if (bit_length < 8 * 1024 * 1024){
+      sprintf(label, "%luKB", bit_length / (8 * 1024));
+  } else if (bit_length < 8UL * 1024 * 1024 * 1024){
+      sprintf(label, "%luMB", bit_length / (8 * 1024 * 1024));
+  } else {
+      sprintf(label, "%luGB", bit_length / (8UL * 1024 * 1024 * 1024));
+  }
+}
+
+static double testutil_time_rotation(const size_t bit_sz,
+                                     const size_t bit_offset,
+                                     const size_t bit_length,
+                                     const size_t bit_right_shift_amount) {
+  // Initialize a new bit_array, with the bits in buf rather than in a tree
+  testutil_newrand(bit_sz, 6172);
+  bitarray_normalize(test_bitarray);
+
+  // Time the duration of a rotation
+  const clockmark_t start_time = ktiming_getmark();
+  testutil_rotate(bit_offset, bit_length, bit_right_shift_amount);
+  bitarray_normalize(test_bitarray);
+  const clockmark_t end_time = ktiming_getmark();
+  return ktiming_diff_usec(&start_time, &end_time) / 1000000000.0;
+}
+
+static void testutil_new(const size_t bit_sz) {
   // If we somehow managed to avoid freeing test_bitarray after a previous
   // test, go free it now.
   if (test_bitarray != NULL) {
     bitarray_free(test_bitarray);
+    test_bitarray = NULL;
   }
 
-  test_bitarray = bitarray_new(bit_sz);
+  if (test_backend == BITARRAY_BACKEND_PACKED) {
+    if (test_arena == NULL) {
+      test_arena = bitarray_arena_new(0, BITARRAY_ARENA_DEFAULT);
+      assert(test_arena != NULL);
+    }
+    bitarray_arena_reset(test_arena);
+    test_bitarray = bitarray_new_in(test_arena, bit_sz);
+  } else {
+    test_bitarray = bitarray_new_backend(bit_sz, test_backend);
+  }
   assert(test_bitarray != NULL);
+}
+
+static void testutil_newrand(const size_t bit_sz, const unsigned int seed) {
+  testutil_new(bit_sz);
 
   // Reseed the RNG with whatever we were passed; this ensures that we can
   // repeat the test deterministically by specifying the same seed.
@@ -163,15 +443,7 @@ static void testutil_newrand(const size_t bit_sz, const unsigned int seed) {
 
 void testutil_frmstr(const char* const bitstring) {
   const size_t bitstring_length = strlen(bitstring);
-
-  // If we somehow managed to avoid freeing test_bitarray after a previous
-  // test, go free it now.
-  if (test_bitarray != NULL) {
-    bitarray_free(test_bitarray);
-  }
-
-  test_bitarray = bitarray_new(bitstring_length);
-  assert(test_bitarray != NULL);
+  testutil_new(bitstring_length);
 
   bool current_bit;
   for (size_t i = 0; i < bitstring_length; i++) {
@@ -248,6 +520,15 @@ void testutil_rotate(const size_t bit_offset,
   }
 }
 
+void testutil_rotate_batch(const bitarray_rotation_t* const ops, const size_t n) {
+  assert(test_bitarray != NULL);
+  bitarray_rotate_batch(test_bitarray, ops, n);
+  if (test_verbose) {
+    bitarray_fprint(stdout, test_bitarray);
+    fprintf(stdout, " rotate batch n=%zu\n", n);
+  }
+}
+
 void testutil_require_valid_input(const size_t bit_offset,
                                   const size_t bit_length,
                                   const ssize_t bit_right_shift_amount,
@@ -271,6 +552,12 @@ int timed_rotation(const double time_limit_seconds) {
   // let the user see all the verbose output.
   test_verbose = false;
 
+  // Stop before a tier's bit array outgrows a quarter of physical memory, so
+  // that an engine fast enough to stay under the time limit does not keep
+  // growing the tiers until the machine runs out of memory.
+  const size_t memory_budget =
+    (size_t) sysconf(_SC_PHYS_PAGES) * (size_t) sysconf(_SC_PAGESIZE) / 4;
+
   // Continue until the rotation exceeds time_limits_seconds
   int tier_num = 0;
   while(tier_num + 3 < FIB_SIZE){
@@ -283,26 +570,71 @@ int timed_rotation(const double time_limit_seconds) {
     assert(bit_right_shift_amount > bit_offset);
     assert(bit_sz > bit_offset + bit_length);
 
-    // Initialize a new bit_array
-    testutil_newrand(bit_sz, 6172);
- 
-    // Time the duration of a rotation
+    if (bit_sz / 8 > memory_budget) {
+      printf("Tier %d stopped: its bit array would not fit in memory\n", tier_num);
+      return tier_num - 1;
+    }
+
+    double diff_seconds = testutil_time_rotation(bit_sz, bit_offset, bit_length,
+                                                 bit_right_shift_amount);
+
+    // Time the reversal engine on the same input so other engines can be
+    // compared with it tier by tier.
+    char baseline[48] = "";
+    const bitarray_rotate_engine_t engine = bitarray_get_rotate_engine();
+    if (engine != BITARRAY_ROTATE_REVERSAL) {
+      bitarray_set_rotate_engine(BITARRAY_ROTATE_REVERSAL);
+      snprintf(baseline, sizeof(baseline), " (reversal: %.6fs)",
+               testutil_time_rotation(bit_sz, bit_offset, bit_length,
+                                      bit_right_shift_amount));
+      bitarray_set_rotate_engine(engine);
+    }
+
+    char buf[20];
+    testutil_size_label(buf, bit_length);
+    if (diff_seconds < time_limit_seconds){
+      printf("Tier %d (≈%s) completed in " ANSI_COLOR_GREEN "%.6fs" ANSI_COLOR_RESET "%s\n",
+        tier_num, buf, diff_seconds, baseline);
+      tier_num++;
+    } else {
+      printf("Tier %d (≈%s) exceeded %.2fs cutoff with time" ANSI_COLOR_RED " %.6fs" ANSI_COLOR_RESET "%s\n",
+         tier_num, buf, time_limit_seconds, diff_seconds, baseline);
+      // Return the last tier that was succesful.
+      return tier_num - 1;
+      //tier_num++;
+    }
+  }
+
+  // Return the last tier that was succesful.
+  return tier_num - 1;
+}
+
+int timed_file_rotation(const double time_limit_seconds, const char* const path) {
+  int tier_num = 0;
+  while (tier_num + 3 < FIB_SIZE) {
+    const size_t bit_offset             = fibs[tier_num];
+    const size_t bit_right_shift_amount = fibs[tier_num+1];
+    const size_t bit_length             = fibs[tier_num+2];
+    const size_t bit_sz                 = fibs[tier_num+3];
+
+    if (!testutil_newfile(path, bit_sz, 6172)) {
+      printf("Tier %d stopped: could not write %s\n", tier_num, path);
+      break;
+    }
+
+    // Time the duration of a rotation, including writing it back to the
+    // file (though not necessarily to disk).
     const clockmark_t start_time = ktiming_getmark();
-    testutil_rotate(bit_offset, bit_length, bit_right_shift_amount);
+    const bool ok = bitarray_rotate_file(path, bit_offset, bit_length, bit_right_shift_amount, NULL);
     const clockmark_t end_time = ktiming_getmark();
     double diff_seconds = ktiming_diff_usec(&start_time, &end_time) / 1000000000.0;
+    if (!ok) {
+      printf("Tier %d stopped: rotating %s failed\n", tier_num, path);
+      break;
+    }
 
-    //char *str_size = NULL;
     char buf[20];
-    if (bit_length < 8*1024){
-        sprintf(buf, "%luB", bit_length / 8);
-    } else if (bit_length < 8 * 1024 * 1024){
-        sprintf(buf, "%luKB", bit_length / (8 * 1024));
-    } else if (bit_length < 8UL * 1024 * 1024 * 1024){
-        sprintf(buf, "%luMB", bit_length / (8 * 1024 * 1024));
-    } else {
-        sprintf(buf, "%luGB", bit_length / (8UL * 1024 * 1024 * 1024));
-    }
+    testutil_size_label(buf, bit_length);
     if (diff_seconds < time_limit_seconds){
       printf("Tier %d (≈%s) completed in " ANSI_COLOR_GREEN "%.6fs" ANSI_COLOR_RESET "\n",
         tier_num, buf, diff_seconds);
@@ -310,16 +642,1287 @@ int timed_rotation(const double time_limit_seconds) {
     } else {
       printf("Tier %d (≈%s) exceeded %.2fs cutoff with time" ANSI_COLOR_RED " %.6fs" ANSI_COLOR_RESET "\n",
          tier_num, buf, time_limit_seconds, diff_seconds);
-      // Return the last tier that was succesful.
-      return tier_num - 1;
-      //tier_num++;
+      break;
     }
   }
+  remove(path);
 
   // Return the last tier that was succesful.
   return tier_num - 1;
 }
 
+size_t calibrate_streaming_threshold(void) {
+  // Arrays from 4MB up to 1GB, as long as the two of them fit comfortably.
+  const size_t memory_budget =
+    (size_t) sysconf(_SC_PHYS_PAGES) * (size_t) sysconf(_SC_PAGESIZE) / 4;
+  size_t byte_sizes[16];
+  double plain_seconds[16];
+  double streaming_seconds[16];
+  size_t size_count = 0;
+  for (size_t bytes = (size_t) 4 << 20;
+       bytes <= ((size_t) 1 << 30) && 2 * bytes <= memory_budget && size_count < 16;
+       bytes *= 2) {
+    byte_sizes[size_count++] = bytes;
+  }
+
+  for (size_t i = 0; i < size_count; i++) {
+    const size_t bit_sz = byte_sizes[i] * 8;
+    bitarray_t* const a = bitarray_new(bit_sz);
+    bitarray_t* const b = bitarray_new(bit_sz);
+    if (a == NULL || b == NULL) {
+      bitarray_free(a);
+      bitarray_free(b);
+      size_count = i;
+      break;
+    }
+    bitarray_randfill_seeded(a, 6172);
+
+    // Best of three runs of each mode, alternating so both see the same
+    // machine conditions.
+    plain_seconds[i] = streaming_seconds[i] = -1.0;
+    for (int run = 0; run < 6; run++) {
+      const bool streaming = run % 2 == 1;
+      bitarray_set_streaming_threshold(streaming ? 0 : SIZE_MAX);
+      const clockmark_t start_time = ktiming_getmark();
+      bitarray_rotate(a, 3, bit_sz - 70, (ssize_t) (bit_sz / 3 + 5));
+      bitarray_copy_range(b, 0, a, 3, bit_sz - 70);
+      const clockmark_t end_time = ktiming_getmark();
+      const double seconds = ktiming_diff_usec(&start_time, &end_time) / 1000000000.0;
+      double* const best = streaming ? &streaming_seconds[i] : &plain_seconds[i];
+      if (*best < 0 || seconds < *best) {
+        *best = seconds;
+      }
+    }
+    bitarray_free(a);
+    bitarray_free(b);
+
+    char buf[20];
+    testutil_size_label(buf, bit_sz);
+    printf("%8s: cached %.6fs, streaming %.6fs\n", buf, plain_seconds[i], streaming_seconds[i]);
+  }
+
+  size_t threshold = SIZE_MAX;
+  for (size_t i = size_count; i > 0 && streaming_seconds[i - 1] < plain_seconds[i - 1]; i--) {
+    threshold = byte_sizes[i - 1] * 8;
+  }
+  bitarray_set_streaming_threshold(threshold);
+  return threshold;
+}
+
+// Width of the items timed_bundle_rotation rotates.
+#define BUNDLE_BIT_SZ 48
+
+// Seconds each mode of timed_bundle_rotation is repeated for.
+#define BUNDLE_SECONDS 0.1
+
+// Returns the average throughput, in items per second, of repeating the
+// timed_bundle_rotation mode given by mode on bundle until BUNDLE_SECONDS
+// have passed.  Modes: 0 rotates the items of arrays one by one, 1 rotates
+// bundle per item, 2 rotates all of bundle by one amount, and 3 reverses
+// bundle per item.
+static double testutil_bundle_rate(const int mode,
+                                   const bitarray_bundle_t* const bundle,
+                                   bitarray_t* const* const arrays,
+                                   const size_t* const offsets,
+                                   const size_t* const lengths,
+                                   const ssize_t* const amounts) {
+  size_t passes = 0;
+  double seconds = 0.0;
+  const clockmark_t start_time = ktiming_getmark();
+  do {
+    switch (mode) {
+    case 0:
+      for (size_t i = 0; i < bundle->count; i++) {
+        bitarray_rotate(arrays[i], offsets[i], lengths[i], amounts[i]);
+      }
+      break;
+    case 1:
+      bitarray_bundle_rotate_each(bundle, offsets, lengths, amounts);
+      break;
+    case 2:
+      bitarray_bundle_rotate(bundle, 3, BUNDLE_BIT_SZ - 7, 5);
+      break;
+    default:
+      bitarray_bundle_reverse_each(bundle, offsets, lengths);
+      break;
+    }
+    passes++;
+    const clockmark_t end_time = ktiming_getmark();
+    seconds = ktiming_diff_usec(&start_time, &end_time) / 1000000000.0;
+  } while (seconds < BUNDLE_SECONDS);
+  return (double) (passes * bundle->count) / seconds;
+}
+
+bool timed_bundle_rotation(const size_t item_count) {
+  uint64_t* const words = malloc(item_count * sizeof(uint64_t));
+  size_t* const offsets = malloc(item_count * sizeof(size_t));
+  size_t* const lengths = malloc(item_count * sizeof(size_t));
+  ssize_t* const amounts = malloc(item_count * sizeof(ssize_t));
+  bitarray_t** const arrays = malloc(item_count * sizeof(bitarray_t*));
+  bitarray_arena_t* const arena = bitarray_arena_new(0, BITARRAY_ARENA_DEFAULT);
+  assert(words != NULL && offsets != NULL && lengths != NULL && amounts != NULL &&
+         arrays != NULL && arena != NULL);
+  const bitarray_bundle_t bundle = { words, item_count, BUNDLE_BIT_SZ };
+
+  // Random items, each with its own subarray and an amount that may exceed
+  // the subarray or be negative.  The bundle and the arrays start out equal.
+  srand(6172);
+  for (size_t i = 0; i < item_count; i++) {
+    arrays[i] = bitarray_new_in(arena, BUNDLE_BIT_SZ);
+    assert(arrays[i] != NULL);
+    bitarray_randfill(arrays[i]);
+    bitarray_bundle_load(&bundle, i, arrays[i]);
+    offsets[i] = (size_t) rand() % (BUNDLE_BIT_SZ / 2);
+    lengths[i] = (size_t) rand() % (BUNDLE_BIT_SZ - offsets[i] + 1);
+    amounts[i] = (ssize_t) (rand() % 201) - 100;
+  }
+
+  // One pass of each way, checked against each other before anything is
+  // timed.
+  for (size_t i = 0; i < item_count; i++) {
+    bitarray_rotate(arrays[i], offsets[i], lengths[i], amounts[i]);
+  }
+  bitarray_bundle_rotate_each(&bundle, offsets, lengths, amounts);
+  size_t mismatches = 0;
+  for (size_t i = 0; i < item_count; i++) {
+    uint64_t expected;
+    const bitarray_bundle_t check = { &expected, 1, BUNDLE_BIT_SZ };
+    bitarray_bundle_load(&check, 0, arrays[i]);
+    if (expected != words[i]) {
+      mismatches++;
+    }
+  }
+
+  printf("bitarray_rotate, one at a time: %.3e items/s\n",
+         testutil_bundle_rate(0, &bundle, arrays, offsets, lengths, amounts));
+  printf("bitarray_bundle_rotate_each:    %.3e items/s\n",
+         testutil_bundle_rate(1, &bundle, arrays, offsets, lengths, amounts));
+  printf("bitarray_bundle_rotate:         %.3e items/s\n",
+         testutil_bundle_rate(2, &bundle, arrays, offsets, lengths, amounts));
+  printf("bitarray_bundle_reverse_each:   %.3e items/s\n",
+         testutil_bundle_rate(3, &bundle, arrays, offsets, lengths, amounts));
+  if (mismatches > 0) {
+    printf(ANSI_COLOR_RED "%zu of %zu items differ from bitarray_rotate" ANSI_COLOR_RESET "\n",
+           mismatches, item_count);
+  }
+
+  bitarray_arena_free(arena);
+  free(arrays);
+  free(amounts);
+  free(lengths);
+  free(offsets);
+  free(words);
+  return mismatches == 0;
+}
+
+// Seed of fuzz_operations' first round; round r uses FUZZ_SEED + r.
+#define FUZZ_SEED 6172
+
+// Operations fuzz_operations runs on each bit array it makes.
+#define FUZZ_STEPS 24
+
+// Failures fuzz_operations describes for each check before it only counts
+// them.
+#define FUZZ_REPORTS 3
+
+// The library's parallel and scratch thresholds, which have no getters, for
+// fuzz_operations to put back.
+#define FUZZ_PARALLEL_THRESHOLD ((size_t) 1 << 24)
+#define FUZZ_SCRATCH_THRESHOLD ((size_t) 1 << 20)
+
+// Names of the fuzz_operations checks, indexed by enum fuzz_check.
+static const char* const fuzz_check_names[] = {
+  [FUZZ_NEW] = "new arrays are zeroed",
+  [FUZZ_ROTATE] = "bitarray_rotate",
+  [FUZZ_ROTATE_SCRATCH] = "bitarray_rotate_with_scratch",
+  [FUZZ_ROTATE_BATCH] = "bitarray_rotate_batch",
+  [FUZZ_RANDFILL] = "bitarray_randfill_seeded",
+  [FUZZ_VIEW] = "bitarray_new_view buffer",
+  [FUZZ_MMAP] = "bitarray_open_mmap file",
+  [FUZZ_ROTATE_FILE] = "bitarray_rotate_file",
+  [FUZZ_BUNDLE] = "bitarray_bundle_*",
+  [FUZZ_TREAP_NODES] = "bittreap node count",
+  [FUZZ_COUNT] = "bitarray_count",
+  [FUZZ_RANK] = "bitarray_rank",
+  [FUZZ_SELECT] = "bitarray_select",
+  [FUZZ_OP_RANGE] = "bitarray_op_range",
+  [FUZZ_FIND] = "bitarray_find_*",
+  [FUZZ_FOREACH] = "bitarray_foreach_set",
+  [FUZZ_COPY_RANGE] = "bitarray_copy_range",
+  [FUZZ_MISMATCH] = "bitarray_mismatch",
+  [FUZZ_EQUAL] = "bitarray_equal*",
+  [FUZZ_FILL] = "bitarray_fill",
+  [FUZZ_SHIFT] = "bitarray_shift",
+};
+
+// Names of the ways fuzz_subject_new makes a bit array, indexed by enum
+// fuzz_kind.
+static const char* const fuzz_kind_names[] = {
+  [FUZZ_KIND_PACKED] = "packed",
+  [FUZZ_KIND_TREAP] = "treap",
+  [FUZZ_KIND_ARENA] = "arena",
+  [FUZZ_KIND_VIEW] = "view",
+  [FUZZ_KIND_MMAP] = "mmap",
+};
+
+// The operations fuzz_step picks from, all equally likely.
+static const fuzz_op_fn fuzz_ops[] = {
+  fuzz_count,
+  fuzz_rank_select,
+  fuzz_rotate,
+  fuzz_rotate_scratch,
+  fuzz_rotate_batch,
+  fuzz_randfill,
+  fuzz_op_range,
+  fuzz_op_whole,
+  fuzz_find,
+  fuzz_foreach,
+  fuzz_copy_range,
+  fuzz_mismatch,
+  fuzz_equal,
+  fuzz_fill,
+  fuzz_shift,
+};
+
+// Cases each check has run, and how many of them failed.
+static size_t fuzz_cases[FUZZ_CHECK_COUNT];
+static size_t fuzz_failures[FUZZ_CHECK_COUNT];
+
+// The round fuzz_operations is on, for failure reports.
+static size_t fuzz_round = 0;
+
+static size_t fuzz_below(const size_t n) {
+  assert(n > 0);
+  // glibc's rand gives 31 bits; join two for ranges past that.
+  const size_t r = ((size_t) rand() << 31) ^ (size_t) rand();
+  return r % n;
+}
+
+static size_t fuzz_length(const size_t max) {
+  switch (fuzz_below(8)) {
+  case 0:
+    return 0;
+  case 1:
+    return max;
+  case 2: {
+    // A word, give or take a bit.
+    const size_t length = 63 + fuzz_below(3);
+    return (length < max) ? length : max;
+  }
+  default:
+    return fuzz_below(max + 1);
+  }
+}
+
+static void fuzz_range(const size_t bit_sz, size_t* const bit_offset, size_t* const bit_length) {
+  *bit_offset = fuzz_below(bit_sz);
+  // Start and end on a byte or word boundary now and then, so the aligned
+  // kernels run too.
+  const size_t unit = (fuzz_below(4) != 0) ? 1 : (fuzz_below(2) == 0) ? 8 : 64;
+  *bit_offset -= *bit_offset % unit;
+  *bit_length = fuzz_length(bit_sz - *bit_offset);
+  *bit_length -= *bit_length % unit;
+}
+
+static ssize_t fuzz_amount(const size_t bit_length) {
+  const ssize_t length = (ssize_t) bit_length;
+  switch (fuzz_below(7)) {
+  case 0:
+    return 0;
+  case 1:
+    // A whole number of turns, plus or minus one.
+    return (ssize_t) fuzz_below(5) * length - 2 * length + (ssize_t) fuzz_below(3) - 1;
+  case 2:
+    return (fuzz_below(2) == 0) ? SSIZE_MAX : -SSIZE_MAX;
+  case 3: {
+    // Whole bytes or words, for the aligned kernels.
+    const size_t unit = (fuzz_below(2) == 0) ? 8 : 64;
+    const ssize_t amount = (ssize_t) (fuzz_below(bit_length / unit + 1) * unit);
+    return (fuzz_below(2) == 0) ? amount : -amount;
+  }
+  default:
+    return (ssize_t) fuzz_below(4 * bit_length + 3) - 2 * length - 1;
+  }
+}
+
+static void fuzz_fail(const enum fuzz_check check, const char* const format, ...) {
+  fuzz_failures[check]++;
+  if (fuzz_failures[check] > FUZZ_REPORTS) {
+    return;
+  }
+  fprintf(stderr, " --> fuzz %s: FAIL\n    Reason: round %zu (seed %zu): ",
+          fuzz_check_names[check], fuzz_round, FUZZ_SEED + fuzz_round);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+}
+
+static void fuzz_reference_rotate(bool* const bits,
+                                  const size_t bit_length,
+                                  const ssize_t bit_right_amount) {
+  if (bit_length == 0) {
+    return;
+  }
+  // The left rotation, computed without negating bit_right_amount itself.
+  const ssize_t length = (ssize_t) bit_length;
+  const size_t left = (size_t) ((length - bit_right_amount % length) % length);
+  bool* const rotated = malloc(bit_length * sizeof(bool));
+  assert(rotated != NULL);
+  for (size_t i = 0; i < bit_length; i++) {
+    rotated[i] = bits[(i + left) % bit_length];
+  }
+  memcpy(bits, rotated, bit_length * sizeof(bool));
+  free(rotated);
+}
+
+static void fuzz_reference_reverse(bool* const bits, const size_t bit_length) {
+  for (size_t i = 0; i < bit_length / 2; i++) {
+    const bool bit = bits[i];
+    bits[i] = bits[bit_length - 1 - i];
+    bits[bit_length - 1 - i] = bit;
+  }
+}
+
+static void fuzz_randomize(bitarray_t* const bitarray, bool* const ref, const size_t bit_sz) {
+  // Dense, sparse, empty and full arrays all turn up, so that the scans
+  // have long runs to skip.
+  static const size_t densities[] = { 0, 1, 32, 63, 64 };
+  const size_t density = densities[fuzz_below(sizeof(densities) / sizeof(densities[0]))];
+  for (size_t i = 0; i < bit_sz; i++) {
+    ref[i] = fuzz_below(64) < density;
+    bitarray_set(bitarray, i, ref[i]);
+  }
+}
+
+// What fuzz_subject_new fills a view's buffer with past the last bit.
+#define FUZZ_VIEW_PATTERN 0xa5
+
+static bool fuzz_subject_new(struct fuzz_subject* const subject,
+                             const enum fuzz_kind kind,
+                             const size_t bit_sz,
+                             bitarray_arena_t* const arena,
+                             const char* const path) {
+  memset(subject, 0, sizeof(*subject));
+  subject->kind = kind;
+  subject->bit_sz = bit_sz;
+  subject->path = path;
+  subject->ref = calloc(bit_sz, sizeof(bool));
+  assert(subject->ref != NULL);
+  switch (kind) {
+  case FUZZ_KIND_TREAP:
+    subject->bitarray = bitarray_new_backend(bit_sz, BITARRAY_BACKEND_TREAP);
+    break;
+  case FUZZ_KIND_ARENA:
+    subject->bitarray = bitarray_new_in(arena, bit_sz);
+    break;
+  case FUZZ_KIND_VIEW: {
+    // Word-aligned but no more, and with a byte of slack past the end.
+    // Everything past the last bit is the caller's and gets a pattern the
+    // array must leave alone.
+    subject->view_bytes = bitarray_view_bytes(bit_sz) + 1;
+    subject->view_buf = malloc(subject->view_bytes);
+    assert(subject->view_buf != NULL);
+    unsigned char* const bytes = subject->view_buf;
+    memset(bytes, FUZZ_VIEW_PATTERN, subject->view_bytes);
+    memset(bytes, 0, bit_sz / 8);
+    bytes[bit_sz / 8] &= (unsigned char) (0xff << (bit_sz % 8));
+    subject->bitarray = bitarray_new_view(subject->view_buf, subject->view_bytes, bit_sz);
+    break;
+  }
+  case FUZZ_KIND_MMAP:
+    remove(path);
+    subject->bitarray = bitarray_open_mmap(path, bit_sz, BITARRAY_MMAP_RDWR);
+    break;
+  case FUZZ_KIND_PACKED:
+  default:
+    subject->bitarray = bitarray_new(bit_sz);
+    break;
+  }
+  if (subject->bitarray == NULL) {
+    free(subject->view_buf);
+    free(subject->ref);
+    return false;
+  }
+  return true;
+}
+
+static void fuzz_subject_free(struct fuzz_subject* const subject) {
+  if (subject->kind == FUZZ_KIND_VIEW) {
+    // Once normalized, the lent buffer holds the bits in bitarray_new's
+    // layout.
+    bitarray_normalize(subject->bitarray);
+    fuzz_cases[FUZZ_VIEW]++;
+    const unsigned char* const bytes = subject->view_buf;
+    for (size_t i = 0; i < subject->view_bytes * 8; i++) {
+      const bool expected = (i < subject->bit_sz) ? subject->ref[i] :
+                            (FUZZ_VIEW_PATTERN >> (i % 8)) & 1;
+      if (((bytes[i / 8] >> (i % 8)) & 1) != expected) {
+        fuzz_fail(FUZZ_VIEW, "%zu-bit view: buffer bit %zu is wrong", subject->bit_sz, i);
+        break;
+      }
+    }
+  }
+  if (subject->kind == FUZZ_KIND_MMAP) {
+    // Whatever was written must be in the file once the array is gone.
+    fuzz_cases[FUZZ_MMAP]++;
+    if (!bitarray_sync(subject->bitarray)) {
+      fuzz_fail(FUZZ_MMAP, "bitarray_sync failed");
+    }
+    bitarray_free(subject->bitarray);
+    subject->bitarray = bitarray_open_mmap(subject->path, subject->bit_sz,
+                                           BITARRAY_MMAP_RDONLY);
+    if (subject->bitarray == NULL) {
+      fuzz_fail(FUZZ_MMAP, "cannot reopen %s", subject->path);
+    } else {
+      for (size_t i = 0; i < subject->bit_sz; i++) {
+        if (bitarray_get(subject->bitarray, i) != subject->ref[i]) {
+          fuzz_fail(FUZZ_MMAP, "%zu-bit file: bit %zu is wrong after reopening",
+                    subject->bit_sz, i);
+          break;
+        }
+      }
+    }
+    remove(subject->path);
+  }
+  bitarray_free(subject->bitarray);
+  free(subject->view_buf);
+  free(subject->ref);
+}
+
+static bool fuzz_check_bits(const struct fuzz_subject* const subject,
+                            const enum fuzz_check check,
+                            const char* const what) {
+  for (size_t i = 0; i < subject->bit_sz; i++) {
+    if (bitarray_get(subject->bitarray, i) != subject->ref[i]) {
+      fuzz_fail(check, "%zu-bit %s array, after %s: bit %zu is %d, expected %d",
+                subject->bit_sz, fuzz_kind_names[subject->kind], what, i,
+                !subject->ref[i], subject->ref[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Context for fuzz_visit: the indices bitarray_foreach_set passes, and how
+// many to take before stopping it.
+struct fuzz_visits {
+  size_t* indices;
+  size_t count;
+  size_t limit;
+};
+
+static bool fuzz_visit(void* const ctx, const size_t bit_index) {
+  struct fuzz_visits* const visits = ctx;
+  visits->indices[visits->count++] = bit_index;
+  return visits->count < visits->limit;
+}
+
+static void fuzz_other_new(struct fuzz_subject* const other, const size_t min_sz) {
+  const size_t bit_sz = min_sz + 1 + fuzz_below(130);
+  const bool made = fuzz_subject_new(other, FUZZ_KIND_PACKED, bit_sz, NULL, NULL);
+  assert(made);
+  fuzz_randomize(other->bitarray, other->ref, bit_sz);
+  if (fuzz_below(2) == 0) {
+    // Leave a whole-array rotation pending.
+    const ssize_t amount = fuzz_amount(bit_sz);
+    bitarray_rotate(other->bitarray, 0, bit_sz, amount);
+    fuzz_reference_rotate(other->ref, bit_sz, amount);
+  }
+  (void) made;
+}
+
+static bool fuzz_combine(const bitarray_op_t op, const bool a, const bool b) {
+  switch (op) {
+  case BITARRAY_OP_AND:
+    return a && b;
+  case BITARRAY_OP_OR:
+    return a || b;
+  case BITARRAY_OP_XOR:
+    return a != b;
+  case BITARRAY_OP_ANDNOT:
+    return a && !b;
+  case BITARRAY_OP_NOT:
+  default:
+    return !a;
+  }
+}
+
+static void fuzz_step(struct fuzz_subject* const subject) {
+  size_t bit_offset;
+  size_t bit_length;
+  fuzz_range(subject->bit_sz, &bit_offset, &bit_length);
+  fuzz_ops[fuzz_below(sizeof(fuzz_ops) / sizeof(fuzz_ops[0]))](subject, bit_offset, bit_length);
+}
+
+static void fuzz_count(struct fuzz_subject* const subject,
+                       const size_t bit_offset,
+                       const size_t bit_length) {
+  size_t expected = 0;
+  for (size_t i = bit_offset; i < bit_offset + bit_length; i++) {
+    expected += subject->ref[i];
+  }
+  const size_t count = bitarray_count(subject->bitarray, bit_offset, bit_length);
+  fuzz_cases[FUZZ_COUNT]++;
+  if (count != expected) {
+    fuzz_fail(FUZZ_COUNT, "%zu-bit %s array: count(%zu, %zu) = %zu, expected %zu",
+              subject->bit_sz, fuzz_kind_names[subject->kind], bit_offset, bit_length,
+              count, expected);
+  }
+}
+
+static void fuzz_rank_select(struct fuzz_subject* const subject,
+                             const size_t bit_offset,
+                             const size_t bit_length) {
+  bool* const ref = subject->ref;
+  const size_t bit_sz = subject->bit_sz;
+  // Queries with an index that is fresh, out of date, or absent.
+  if (fuzz_below(2) == 0) {
+    bitarray_build_rank_index(subject->bitarray);
+    if (fuzz_below(2) == 0) {
+      const size_t flipped = fuzz_below(bit_sz);
+      ref[flipped] = !ref[flipped];
+      bitarray_set(subject->bitarray, flipped, ref[flipped]);
+    }
+  }
+  // The rank of the end of the range, which may be bit_sz itself.
+  const size_t bit_index = bit_offset + bit_length;
+  size_t expected = 0;
+  for (size_t i = 0; i < bit_index; i++) {
+    expected += ref[i];
+  }
+  const size_t rank = bitarray_rank(subject->bitarray, bit_index);
+  fuzz_cases[FUZZ_RANK]++;
+  if (rank != expected) {
+    fuzz_fail(FUZZ_RANK, "%zu-bit %s array: rank(%zu) = %zu, expected %zu",
+              bit_sz, fuzz_kind_names[subject->kind], bit_index, rank, expected);
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < bit_sz; i++) {
+    total += ref[i];
+  }
+  const size_t k = fuzz_below(total + 2);
+  size_t expected_index = bit_sz;
+  size_t seen = 0;
+  for (size_t i = 0; i < bit_sz; i++) {
+    if (ref[i] && seen++ == k) {
+      expected_index = i;
+      break;
+    }
+  }
+  const size_t selected = bitarray_select(subject->bitarray, k);
+  fuzz_cases[FUZZ_SELECT]++;
+  if (selected != expected_index) {
+    fuzz_fail(FUZZ_SELECT, "%zu-bit %s array: select(%zu) = %zu, expected %zu",
+              bit_sz, fuzz_kind_names[subject->kind], k, selected, expected_index);
+  }
+}
+
+static void fuzz_rotate(struct fuzz_subject* const subject,
+                        const size_t bit_offset,
+                        const size_t bit_length) {
+  // Whole-array rotations are only remembered, and every later operation
+  // has to honour them.
+  const bool whole = fuzz_below(3) == 0;
+  const size_t offset = whole ? 0 : bit_offset;
+  const size_t length = whole ? subject->bit_sz : bit_length;
+  const ssize_t amount = fuzz_amount(length);
+  bitarray_rotate(subject->bitarray, offset, length, amount);
+  fuzz_reference_rotate(subject->ref + offset, length, amount);
+  char what[64];
+  snprintf(what, sizeof(what), "rotate(%zu, %zu, %zd)", offset, length, amount);
+  fuzz_cases[FUZZ_ROTATE]++;
+  fuzz_check_bits(subject, FUZZ_ROTATE, what);
+}
+
+static void fuzz_rotate_scratch(struct fuzz_subject* const subject,
+                                const size_t bit_offset,
+                                const size_t bit_length) {
+  const ssize_t amount = fuzz_amount(bit_length);
+  // Sometimes a byte short, which must fall back to rotating in place.
+  const size_t needed = bitarray_rotate_scratch_bytes(bit_length, amount);
+  const size_t scratch_bytes = (needed > 0 && fuzz_below(4) == 0) ? needed - 1 : needed;
+  char* const scratch = malloc(scratch_bytes + 8);
+  assert(scratch != NULL);
+  // Not word-aligned, which the call has to cope with.
+  bitarray_rotate_with_scratch(subject->bitarray, bit_offset, bit_length, amount, scratch + 3,
+                               scratch_bytes);
+  free(scratch);
+  fuzz_reference_rotate(subject->ref + bit_offset, bit_length, amount);
+  char what[96];
+  snprintf(what, sizeof(what), "rotate_with_scratch(%zu, %zu, %zd, %zu bytes)",
+           bit_offset, bit_length, amount, scratch_bytes);
+  fuzz_cases[FUZZ_ROTATE_SCRATCH]++;
+  fuzz_check_bits(subject, FUZZ_ROTATE_SCRATCH, what);
+}
+
+static void fuzz_rotate_batch(struct fuzz_subject* const subject,
+                              const size_t bit_offset,
+                              const size_t bit_length) {
+  bitarray_rotation_t ops[8];
+  const size_t n = 1 + fuzz_below(8);
+  for (size_t i = 0; i < n; i++) {
+    // Overlapping rotations, and repeats of the last one, compose.
+    if (i == 0) {
+      ops[i].bit_offset = bit_offset;
+      ops[i].bit_length = bit_length;
+    } else if (fuzz_below(3) == 0) {
+      ops[i] = ops[i - 1];
+    } else {
+      fuzz_range(subject->bit_sz, &ops[i].bit_offset, &ops[i].bit_length);
+    }
+    ops[i].bit_right_amount = fuzz_amount(ops[i].bit_length);
+    fuzz_reference_rotate(subject->ref + ops[i].bit_offset, ops[i].bit_length,
+                          ops[i].bit_right_amount);
+  }
+  bitarray_rotate_batch(subject->bitarray, ops, n);
+  char what[96];
+  snprintf(what, sizeof(what), "rotate_batch of %zu, the first (%zu, %zu, %zd)",
+           n, ops[0].bit_offset, ops[0].bit_length, ops[0].bit_right_amount);
+  fuzz_cases[FUZZ_ROTATE_BATCH]++;
+  fuzz_check_bits(subject, FUZZ_ROTATE_BATCH, what);
+}
+
+static void fuzz_randfill(struct fuzz_subject* const subject,
+                          const size_t bit_offset,
+                          const size_t bit_length) {
+  // The same seed must give the same bits whatever the storage, pending
+  // rotation or thread count, so a packed array filled on one thread is the
+  // reference.
+  const uint64_t seed = ((uint64_t) fuzz_below((size_t) 1 << 32) << 32) ^
+                        fuzz_below((size_t) 1 << 32);
+  const size_t bit_sz = subject->bit_sz;
+  bitarray_t* const expected = bitarray_new(bit_sz);
+  assert(expected != NULL);
+  const unsigned int thread_count = bitarray_get_thread_count();
+  bitarray_set_thread_count(1);
+  bitarray_randfill_seeded(expected, seed);
+  bitarray_set_thread_count(thread_count);
+  bitarray_randfill_seeded(subject->bitarray, seed);
+  size_t set_bits = 0;
+  for (size_t i = 0; i < bit_sz; i++) {
+    subject->ref[i] = bitarray_get(expected, i);
+    set_bits += subject->ref[i];
+  }
+  bitarray_free(expected);
+
+  char what[64];
+  snprintf(what, sizeof(what), "randfill_seeded(%#llx)", (unsigned long long) seed);
+  fuzz_cases[FUZZ_RANDFILL]++;
+  if (fuzz_check_bits(subject, FUZZ_RANDFILL, what) && bit_sz >= 128 &&
+      (set_bits < bit_sz / 4 || set_bits > bit_sz - bit_sz / 4)) {
+    // Both could agree on something far from random.
+    fuzz_fail(FUZZ_RANDFILL, "%zu-bit %s array: %s set %zu bits", bit_sz,
+              fuzz_kind_names[subject->kind], what, set_bits);
+  }
+  (void) bit_offset;
+  (void) bit_length;
+}
+
+static void fuzz_op_range(struct fuzz_subject* const subject,
+                          const size_t bit_offset,
+                          const size_t bit_length) {
+  bool* const ref = subject->ref;
+  const bitarray_op_t op = (bitarray_op_t) fuzz_below(5);
+  struct fuzz_subject a;
+  struct fuzz_subject b;
+  fuzz_other_new(&a, bit_length);
+  fuzz_other_new(&b, bit_length);
+  size_t a_offset = fuzz_below(a.bit_sz - bit_length + 1);
+  size_t b_offset = fuzz_below(b.bit_sz - bit_length + 1);
+  bitarray_t* a_array = a.bitarray;
+  bitarray_t* b_array = (op == BITARRAY_OP_NOT && fuzz_below(2) == 0) ? NULL : b.bitarray;
+  const bool* a_ref = a.ref;
+  const bool* b_ref = b.ref;
+  // dst may also be an operand if the two ranges start at the same bit.
+  const size_t alias = fuzz_below(4);
+  if (alias == 1) {
+    a_array = subject->bitarray;
+    a_offset = bit_offset;
+    a_ref = ref;
+  } else if (alias == 2 && op != BITARRAY_OP_NOT) {
+    b_array = subject->bitarray;
+    b_offset = bit_offset;
+    b_ref = ref;
+  }
+  bool* const expected = malloc((bit_length + 1) * sizeof(bool));
+  assert(expected != NULL);
+  for (size_t i = 0; i < bit_length; i++) {
+    expected[i] = fuzz_combine(op, a_ref[a_offset + i], b_ref[b_offset + i]);
+  }
+  bitarray_op_range(subject->bitarray, bit_offset, a_array, a_offset, b_array, b_offset,
+                    bit_length, op);
+  memcpy(ref + bit_offset, expected, bit_length * sizeof(bool));
+  free(expected);
+  char what[96];
+  snprintf(what, sizeof(what), "op_range(op %d, dst %zu, a %zu, b %zu, %zu bits)",
+           (int) op, bit_offset, a_offset, b_offset, bit_length);
+  fuzz_cases[FUZZ_OP_RANGE]++;
+  fuzz_check_bits(subject, FUZZ_OP_RANGE, what);
+  fuzz_subject_free(&b);
+  fuzz_subject_free(&a);
+}
+
+static void fuzz_op_whole(struct fuzz_subject* const subject,
+                          const size_t bit_offset,
+                          const size_t bit_length) {
+  // The whole-array forms, against an array of the same size.
+  bitarray_t* const bitarray = subject->bitarray;
+  bool* const ref = subject->ref;
+  const size_t bit_sz = subject->bit_sz;
+  struct fuzz_subject other;
+  const bool made = fuzz_subject_new(&other, FUZZ_KIND_PACKED, bit_sz, NULL, NULL);
+  assert(made);
+  (void) made;
+  fuzz_randomize(other.bitarray, other.ref, bit_sz);
+  const size_t which = fuzz_below(5);
+  switch (which) {
+  case 0:
+    bitarray_and(bitarray, bitarray, other.bitarray);
+    break;
+  case 1:
+    bitarray_or(bitarray, other.bitarray, bitarray);
+    break;
+  case 2:
+    bitarray_xor(bitarray, bitarray, other.bitarray);
+    break;
+  case 3:
+    bitarray_andnot(bitarray, bitarray, other.bitarray);
+    break;
+  default:
+    bitarray_not(bitarray, other.bitarray);
+    break;
+  }
+  static const bitarray_op_t ops[] = {
+    BITARRAY_OP_AND, BITARRAY_OP_OR, BITARRAY_OP_XOR, BITARRAY_OP_ANDNOT, BITARRAY_OP_NOT
+  };
+  for (size_t i = 0; i < bit_sz; i++) {
+    ref[i] = (which == 4) ? !other.ref[i] : fuzz_combine(ops[which], ref[i], other.ref[i]);
+  }
+  char what[32];
+  snprintf(what, sizeof(what), "whole-array op %zu", which);
+  fuzz_cases[FUZZ_OP_RANGE]++;
+  fuzz_check_bits(subject, FUZZ_OP_RANGE, what);
+  fuzz_subject_free(&other);
+  (void) bit_offset;
+  (void) bit_length;
+}
+
+static void fuzz_find(struct fuzz_subject* const subject,
+                      const size_t bit_offset,
+                      const size_t bit_length) {
+  const bool* const ref = subject->ref;
+  const size_t bit_sz = subject->bit_sz;
+  size_t next_set = bit_sz;
+  size_t next_clear = bit_sz;
+  for (size_t i = bit_sz; i > bit_offset; i--) {
+    if (ref[i - 1]) {
+      next_set = i - 1;
+    } else {
+      next_clear = i - 1;
+    }
+  }
+  // find_prev_set also takes indices past the end.
+  const size_t prev_index = bit_offset + ((fuzz_below(8) == 0) ? bit_sz : 0);
+  size_t prev_set = bit_sz;
+  for (size_t i = 0; i <= prev_index && i < bit_sz; i++) {
+    if (ref[i]) {
+      prev_set = i;
+    }
+  }
+  const size_t found_set = bitarray_find_next_set(subject->bitarray, bit_offset);
+  const size_t found_clear = bitarray_find_next_clear(subject->bitarray, bit_offset);
+  const size_t found_prev = bitarray_find_prev_set(subject->bitarray, prev_index);
+  fuzz_cases[FUZZ_FIND]++;
+  if (found_set != next_set || found_clear != next_clear || found_prev != prev_set) {
+    fuzz_fail(FUZZ_FIND, "%zu-bit %s array: next_set(%zu) = %zu, next_clear = %zu, "
+              "prev_set(%zu) = %zu; expected %zu, %zu, %zu",
+              bit_sz, fuzz_kind_names[subject->kind], bit_offset, found_set, found_clear,
+              prev_index, found_prev, next_set, next_clear, prev_set);
+  }
+  (void) bit_length;
+}
+
+static void fuzz_foreach(struct fuzz_subject* const subject,
+                         const size_t bit_offset,
+                         const size_t bit_length) {
+  struct fuzz_visits visits = { malloc((bit_length + 1) * sizeof(size_t)), 0, SIZE_MAX };
+  assert(visits.indices != NULL);
+  if (fuzz_below(4) == 0) {
+    // Stop the walk early.
+    visits.limit = 1 + fuzz_below(8);
+  }
+  const size_t calls = bitarray_foreach_set(subject->bitarray, bit_offset, bit_length,
+                                            fuzz_visit, &visits);
+  size_t expected = 0;
+  bool ok = calls == visits.count;
+  for (size_t i = bit_offset; i < bit_offset + bit_length && expected < visits.limit; i++) {
+    if (subject->ref[i]) {
+      ok = ok && expected < visits.count && visits.indices[expected] == i;
+      expected++;
+    }
+  }
+  ok = ok && visits.count == expected;
+  fuzz_cases[FUZZ_FOREACH]++;
+  if (!ok) {
+    fuzz_fail(FUZZ_FOREACH, "%zu-bit %s array: foreach_set(%zu, %zu) stopping after %zu "
+              "made %zu calls, expected %zu", subject->bit_sz, fuzz_kind_names[subject->kind],
+              bit_offset, bit_length, visits.limit, calls, expected);
+  }
+  free(visits.indices);
+}
+
+static void fuzz_copy_range(struct fuzz_subject* const subject,
+                            const size_t bit_offset,
+                            const size_t bit_length) {
+  // From another array, or from an overlapping range of the same one.
+  struct fuzz_subject src;
+  fuzz_other_new(&src, bit_length);
+  bitarray_t* src_array = src.bitarray;
+  const bool* src_ref = src.ref;
+  size_t src_offset = fuzz_below(src.bit_sz - bit_length + 1);
+  if (fuzz_below(2) == 0) {
+    src_array = subject->bitarray;
+    src_ref = subject->ref;
+    src_offset = fuzz_below(subject->bit_sz - bit_length + 1);
+  }
+  bool* const copied = malloc((bit_length + 1) * sizeof(bool));
+  assert(copied != NULL);
+  memcpy(copied, src_ref + src_offset, bit_length * sizeof(bool));
+  bitarray_copy_range(subject->bitarray, bit_offset, src_array, src_offset, bit_length);
+  memcpy(subject->ref + bit_offset, copied, bit_length * sizeof(bool));
+  free(copied);
+  char what[80];
+  snprintf(what, sizeof(what), "copy_range(dst %zu, %s %zu, %zu bits)", bit_offset,
+           (src_array == subject->bitarray) ? "itself" : "src", src_offset, bit_length);
+  fuzz_cases[FUZZ_COPY_RANGE]++;
+  fuzz_check_bits(subject, FUZZ_COPY_RANGE, what);
+  fuzz_subject_free(&src);
+}
+
+static void fuzz_mismatch(struct fuzz_subject* const subject,
+                          const size_t bit_offset,
+                          const size_t bit_length) {
+  // Compare against a copy of the range, made bit by bit, with at most one
+  // bit flipped.
+  const bool* const ref = subject->ref;
+  struct fuzz_subject other;
+  fuzz_other_new(&other, bit_length);
+  const size_t other_offset = fuzz_below(other.bit_sz - bit_length + 1);
+  for (size_t i = 0; i < bit_length; i++) {
+    other.ref[other_offset + i] = ref[bit_offset + i];
+    bitarray_set(other.bitarray, other_offset + i, ref[bit_offset + i]);
+  }
+  size_t expected = bit_length;
+  if (bit_length > 0 && fuzz_below(4) != 0) {
+    expected = fuzz_below(bit_length);
+    other.ref[other_offset + expected] = !ref[bit_offset + expected];
+    bitarray_set(other.bitarray, other_offset + expected, !ref[bit_offset + expected]);
+  }
+  const size_t mismatch = bitarray_mismatch(subject->bitarray, bit_offset, other.bitarray,
+                                            other_offset, bit_length);
+  const bool equal = bitarray_equal_range(subject->bitarray, bit_offset, other.bitarray,
+                                          other_offset, bit_length);
+  fuzz_cases[FUZZ_MISMATCH]++;
+  if (mismatch != expected) {
+    fuzz_fail(FUZZ_MISMATCH, "%zu-bit %s array: mismatch(%zu, other %zu, %zu bits) = %zu, "
+              "expected %zu", subject->bit_sz, fuzz_kind_names[subject->kind], bit_offset,
+              other_offset, bit_length, mismatch, expected);
+  }
+  fuzz_cases[FUZZ_EQUAL]++;
+  if (equal != (expected == bit_length)) {
+    fuzz_fail(FUZZ_EQUAL, "%zu-bit %s array: equal_range(%zu, other %zu, %zu bits) = %d",
+              subject->bit_sz, fuzz_kind_names[subject->kind], bit_offset, other_offset,
+              bit_length, equal);
+  }
+  fuzz_subject_free(&other);
+  // Comparing must not change either array.
+  fuzz_check_bits(subject, FUZZ_MISMATCH, "mismatch");
+}
+
+static void fuzz_equal(struct fuzz_subject* const subject,
+                       const size_t bit_offset,
+                       const size_t bit_length) {
+  // Against an array of the same size holding random bits or a copy.
+  const bool* const ref = subject->ref;
+  const size_t bit_sz = subject->bit_sz;
+  struct fuzz_subject other;
+  const bool made = fuzz_subject_new(&other, FUZZ_KIND_PACKED, bit_sz, NULL, NULL);
+  assert(made);
+  (void) made;
+  fuzz_randomize(other.bitarray, other.ref, bit_sz);
+  if (fuzz_below(2) == 0) {
+    for (size_t i = 0; i < bit_sz; i++) {
+      other.ref[i] = ref[i];
+      bitarray_set(other.bitarray, i, ref[i]);
+    }
+  }
+  bool expected = true;
+  for (size_t i = 0; i < bit_sz; i++) {
+    expected = expected && other.ref[i] == ref[i];
+  }
+  fuzz_cases[FUZZ_EQUAL]++;
+  if (bitarray_equal(subject->bitarray, other.bitarray) != expected) {
+    fuzz_fail(FUZZ_EQUAL, "%zu-bit %s array: equal gave %d", bit_sz,
+              fuzz_kind_names[subject->kind], !expected);
+  }
+  fuzz_subject_free(&other);
+  (void) bit_offset;
+  (void) bit_length;
+}
+
+static void fuzz_fill(struct fuzz_subject* const subject,
+                      const size_t bit_offset,
+                      const size_t bit_length) {
+  const bool value = fuzz_below(2) == 0;
+  bitarray_fill(subject->bitarray, bit_offset, bit_length, value);
+  for (size_t i = bit_offset; i < bit_offset + bit_length; i++) {
+    subject->ref[i] = value;
+  }
+  char what[64];
+  snprintf(what, sizeof(what), "fill(%zu, %zu, %d)", bit_offset, bit_length, value);
+  fuzz_cases[FUZZ_FILL]++;
+  fuzz_check_bits(subject, FUZZ_FILL, what);
+}
+
+static void fuzz_shift(struct fuzz_subject* const subject,
+                       const size_t bit_offset,
+                       const size_t bit_length) {
+  // Mostly amounts within the range, sometimes the extreme ones.
+  const ssize_t amount = (fuzz_below(8) == 0) ? fuzz_amount(bit_length) :
+                         (ssize_t) fuzz_below(2 * bit_length + 1) - (ssize_t) bit_length;
+  const bool value = fuzz_below(2) == 0;
+  bitarray_shift(subject->bitarray, bit_offset, bit_length, amount, value);
+  bool* const shifted = malloc((bit_length + 1) * sizeof(bool));
+  assert(shifted != NULL);
+  // Checked before subtracting, which could overflow for the extreme amounts.
+  const bool too_far = amount <= -(ssize_t) bit_length || amount >= (ssize_t) bit_length;
+  for (size_t i = 0; i < bit_length; i++) {
+    // Bit i comes from i - amount, if that lies in the subarray.
+    const ssize_t from = too_far ? -1 : (ssize_t) i - amount;
+    shifted[i] = (from < 0 || from >= (ssize_t) bit_length) ? value :
+                 subject->ref[bit_offset + (size_t) from];
+  }
+  memcpy(subject->ref + bit_offset, shifted, bit_length * sizeof(bool));
+  free(shifted);
+  char what[96];
+  snprintf(what, sizeof(what), "shift(%zu, %zu, %zd, %d)", bit_offset, bit_length, amount,
+           value);
+  fuzz_cases[FUZZ_SHIFT]++;
+  fuzz_check_bits(subject, FUZZ_SHIFT, what);
+}
+
+// Bits fuzz_randfill_threads fills: a few 16 KB randfill blocks and a
+// ragged end.
+#define FUZZ_RANDFILL_BITS ((size_t) 5 * 16384 * 8 + 77)
+
+static void fuzz_randfill_threads(void) {
+  const uint64_t seed = ((uint64_t) fuzz_below((size_t) 1 << 32) << 32) ^
+                        fuzz_below((size_t) 1 << 32);
+  bitarray_t* const one = bitarray_new(FUZZ_RANDFILL_BITS);
+  bitarray_t* const four = bitarray_new(FUZZ_RANDFILL_BITS);
+  assert(one != NULL && four != NULL);
+  const unsigned int thread_count = bitarray_get_thread_count();
+  bitarray_set_thread_count(1);
+  bitarray_randfill_seeded(one, seed);
+  bitarray_set_thread_count(4);
+  bitarray_set_parallel_threshold(4096);
+  bitarray_randfill_seeded(four, seed);
+  bitarray_set_thread_count(thread_count);
+  bitarray_set_parallel_threshold(FUZZ_PARALLEL_THRESHOLD);
+
+  fuzz_cases[FUZZ_RANDFILL]++;
+  for (size_t i = 0; i < FUZZ_RANDFILL_BITS; i++) {
+    if (bitarray_get(one, i) != bitarray_get(four, i)) {
+      fuzz_fail(FUZZ_RANDFILL, "%zu bits from seed %#llx: bit %zu differs between one "
+                "thread and four", FUZZ_RANDFILL_BITS, (unsigned long long) seed, i);
+      break;
+    }
+  }
+  bitarray_free(four);
+  bitarray_free(one);
+}
+
+// Rotations fuzz_treap_nodes runs, and the most bits its tree holds.
+#define FUZZ_TREAP_ROTATIONS 20000
+#define FUZZ_TREAP_BITS ((size_t) 1 << 18)
+
+static void fuzz_treap_nodes(void) {
+  const size_t bit_sz = 1 + fuzz_below(FUZZ_TREAP_BITS);
+  bitarray_t* const bitarray = bitarray_new(bit_sz);
+  assert(bitarray != NULL);
+  bitarray_randfill(bitarray);
+  char* const buf = calloc(bitarray_view_bytes(bit_sz), 1);
+  assert(buf != NULL);
+  for (size_t i = 0; i < bit_sz; i++) {
+    buf[i / 8] |= (char) (bitarray_get(bitarray, i) << (i % 8));
+  }
+  bittreap_t* const tree = bittreap_build(buf, bit_sz);
+  assert(tree != NULL);
+
+  // Twice the chunks a freshly built tree needs, plus a little slack.
+  const size_t node_limit = 2 * bittreap_node_count(tree) + 32;
+  size_t most_nodes = 0;
+  for (size_t step = 0; step < FUZZ_TREAP_ROTATIONS; step++) {
+    size_t bit_offset;
+    size_t bit_length;
+    fuzz_range(bit_sz, &bit_offset, &bit_length);
+    const size_t bit_left_amount = fuzz_below(bit_length + 1);
+    const bool rotated = bittreap_rotate_left(tree, bit_offset, bit_length, bit_left_amount);
+    assert(rotated);
+    (void) rotated;
+    bitarray_rotate(bitarray, bit_offset, bit_length, -(ssize_t) bit_left_amount);
+    const size_t node_count = bittreap_node_count(tree);
+    most_nodes = (node_count > most_nodes) ? node_count : most_nodes;
+  }
+
+  fuzz_cases[FUZZ_TREAP_NODES]++;
+  if (most_nodes > node_limit) {
+    fuzz_fail(FUZZ_TREAP_NODES, "%zu-bit tree: %zu nodes after %d rotations, limit %zu",
+              bit_sz, most_nodes, FUZZ_TREAP_ROTATIONS, node_limit);
+  }
+  bittreap_flatten(tree, buf);
+  for (size_t i = 0; i < bit_sz; i++) {
+    if (((buf[i / 8] >> (i % 8)) & 1) != bitarray_get(bitarray, i)) {
+      fuzz_fail(FUZZ_TREAP_NODES, "%zu-bit tree: bit %zu is wrong after %d rotations",
+                bit_sz, i, FUZZ_TREAP_ROTATIONS);
+      break;
+    }
+  }
+  bittreap_free(tree);
+  free(buf);
+  bitarray_free(bitarray);
+}
+
+static void fuzz_rotate_file(const char* const path) {
+  const size_t bit_sz = 1 + fuzz_below(20000);
+  bool* const ref = malloc(bit_sz * sizeof(bool));
+  assert(ref != NULL);
+  remove(path);
+  bitarray_t* bitarray = bitarray_open_mmap(path, bit_sz, BITARRAY_MMAP_RDWR);
+  if (bitarray == NULL) {
+    fuzz_fail(FUZZ_ROTATE_FILE, "cannot create %s", path);
+    free(ref);
+    return;
+  }
+  fuzz_randomize(bitarray, ref, bit_sz);
+  bitarray_free(bitarray);
+
+  // Tiny blocks and budgets force the streaming reversal passes.
+  static const bitarray_stream_options_t options[] = {
+    { 0, 0 }, { 16, 96 }, { 8, 8 }, { 4096, 1 << 20 },
+  };
+  for (size_t step = 0; step < 4; step++) {
+    size_t offset;
+    size_t length;
+    fuzz_range(bit_sz, &offset, &length);
+    const ssize_t amount = fuzz_amount(length);
+    const bitarray_stream_options_t* const option = &options[fuzz_below(4)];
+    fuzz_cases[FUZZ_ROTATE_FILE]++;
+    if (!bitarray_rotate_file(path, offset, length, amount,
+                              (option->block_bytes == 0) ? NULL : option)) {
+      fuzz_fail(FUZZ_ROTATE_FILE, "rotate_file(%zu, %zu, %zd) failed", offset, length, amount);
+      break;
+    }
+    fuzz_reference_rotate(ref + offset, length, amount);
+    bitarray = bitarray_open_mmap(path, bit_sz, BITARRAY_MMAP_RDONLY);
+    assert(bitarray != NULL);
+    for (size_t i = 0; i < bit_sz; i++) {
+      if (bitarray_get(bitarray, i) != ref[i]) {
+        fuzz_fail(FUZZ_ROTATE_FILE, "%zu-bit file, rotate_file(%zu, %zu, %zd) with %zu-byte "
+                  "blocks: bit %zu is wrong", bit_sz, offset, length, amount,
+                  option->block_bytes, i);
+        break;
+      }
+    }
+    bitarray_free(bitarray);
+  }
+  remove(path);
+  free(ref);
+}
+
+static void fuzz_bundle(void) {
+  const size_t count = 1 + fuzz_below(40);
+  const size_t bit_sz = 1 + fuzz_below(64);
+  uint64_t* const words = malloc(count * sizeof(uint64_t));
+  bool* const ref = malloc(count * 64 * sizeof(bool));
+  size_t* const offsets = malloc(count * sizeof(size_t));
+  size_t* const lengths = malloc(count * sizeof(size_t));
+  ssize_t* const amounts = malloc(count * sizeof(ssize_t));
+  assert(words != NULL && ref != NULL && offsets != NULL && lengths != NULL && amounts != NULL);
+  const bitarray_bundle_t bundle = { words, count, bit_sz };
+  for (size_t i = 0; i < count; i++) {
+    words[i] = 0;
+    for (size_t j = 0; j < 64; j++) {
+      ref[i * 64 + j] = fuzz_below(2) == 0;
+      words[i] |= (uint64_t) ref[i * 64 + j] << j;
+    }
+  }
+
+  for (size_t step = 0; step < 8; step++) {
+    const size_t mode = fuzz_below(6);
+    size_t offset;
+    size_t length;
+    fuzz_range(bit_sz, &offset, &length);
+    const ssize_t amount = fuzz_amount(length);
+    const bool per_offset = fuzz_below(4) != 0;
+    const bool per_length = fuzz_below(4) != 0;
+    for (size_t i = 0; i < count; i++) {
+      offsets[i] = per_offset ? fuzz_below(bit_sz) : 0;
+      lengths[i] = per_length ? fuzz_length(bit_sz - offsets[i]) : bit_sz - offsets[i];
+      amounts[i] = fuzz_amount(lengths[i]);
+    }
+    switch (mode) {
+    case 0:
+      bitarray_bundle_rotate(&bundle, offset, length, amount);
+      break;
+    case 1:
+      bitarray_bundle_rotate_each(&bundle, per_offset ? offsets : NULL,
+                                  per_length ? lengths : NULL, amounts);
+      break;
+    case 2:
+      bitarray_bundle_reverse(&bundle, offset, length);
+      break;
+    case 3:
+      bitarray_bundle_reverse_each(&bundle, per_offset ? offsets : NULL,
+                                   per_length ? lengths : NULL);
+      break;
+    default: {
+      // Through a bit array, with a whole-array rotation left pending before
+      // the load.
+      const size_t index = fuzz_below(count);
+      bitarray_t* const bitarray = bitarray_new(bit_sz);
+      assert(bitarray != NULL);
+      bitarray_bundle_store(&bundle, index, bitarray);
+      const ssize_t turn = fuzz_amount(bit_sz);
+      bitarray_rotate(bitarray, 0, bit_sz, turn);
+      bitarray_rotate(bitarray, offset, length, amount);
+      bitarray_bundle_load(&bundle, index, bitarray);
+      bitarray_free(bitarray);
+      fuzz_reference_rotate(ref + index * 64, bit_sz, turn);
+      fuzz_reference_rotate(ref + index * 64 + offset, length, amount);
+      break;
+    }
+    }
+    for (size_t i = 0; i < count && mode < 4; i++) {
+      const size_t item_offset = (mode == 1 || mode == 3) ? offsets[i] : offset;
+      const size_t item_length = (mode == 1 || mode == 3) ? lengths[i] : length;
+      if (mode == 0 || mode == 1) {
+        fuzz_reference_rotate(ref + i * 64 + item_offset, item_length,
+                              (mode == 0) ? amount : amounts[i]);
+      } else {
+        fuzz_reference_reverse(ref + i * 64 + item_offset, item_length);
+      }
+    }
+    fuzz_cases[FUZZ_BUNDLE]++;
+    for (size_t i = 0; i < count; i++) {
+      size_t j = 0;
+      while (j < bit_sz && ((words[i] >> j) & 1) == ref[i * 64 + j]) {
+        j++;
+      }
+      if (j < bit_sz) {
+        fuzz_fail(FUZZ_BUNDLE, "%zu items of %zu bits, mode %zu (%zu, %zu, %zd): "
+                  "bit %zu of item %zu is wrong", count, bit_sz, mode, offset, length,
+                  amount, j, i);
+        break;
+      }
+    }
+  }
+  free(amounts);
+  free(lengths);
+  free(offsets);
+  free(ref);
+  free(words);
+}
+
+bool fuzz_operations(const size_t rounds) {
+  memset(fuzz_cases, 0, sizeof(fuzz_cases));
+  memset(fuzz_failures, 0, sizeof(fuzz_failures));
+  char path[] = "/tmp/everybit-fuzz-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd >= 0) {
+    close(fd);
+  }
+  const unsigned int thread_count = bitarray_get_thread_count();
+  const bitarray_rotate_engine_t engine = bitarray_get_rotate_engine();
+  const size_t streaming_threshold = bitarray_get_streaming_threshold();
+  const size_t block_bytes = bitarray_get_block_bytes();
+  bitarray_arena_t* const arena = bitarray_arena_new(4096, BITARRAY_ARENA_DEFAULT);
+  assert(arena != NULL);
+
+  fprintf(stderr, "Fuzzing %zu rounds from seed %d.\n", rounds, FUZZ_SEED);
+  srand(FUZZ_SEED);
+  fuzz_treap_nodes();
+  fuzz_randfill_threads();
+  for (fuzz_round = 0; fuzz_round < rounds; fuzz_round++) {
+    srand((unsigned int) (FUZZ_SEED + fuzz_round));
+    // Every engine, and now and then the threaded, out-of-place, streaming
+    // and cache-blocked paths at sizes small enough to check.
+    bitarray_set_rotate_engine((bitarray_rotate_engine_t) (fuzz_round % 3));
+    const bool stress = fuzz_round % 4 == 3;
+    bitarray_set_thread_count(stress ? 4 : thread_count);
+    bitarray_set_parallel_threshold(stress ? 4096 : FUZZ_PARALLEL_THRESHOLD);
+    bitarray_set_scratch_threshold(stress ? 512 : FUZZ_SCRATCH_THRESHOLD);
+    bitarray_set_streaming_threshold(stress ? 0 : streaming_threshold);
+    bitarray_set_block_bytes(stress ? 64 : block_bytes);
+
+    const size_t size_class = fuzz_below(20);
+    const size_t bit_sz = (size_class < 14) ? 1 + fuzz_below(700) :
+                          (size_class < 19) ? 700 + fuzz_below(6000) :
+                          20000 + fuzz_below(50000);
+    const enum fuzz_kind kind = (enum fuzz_kind) (fuzz_round % FUZZ_KIND_COUNT);
+    if (kind == FUZZ_KIND_ARENA && fuzz_below(4) == 0) {
+      // Arrays made after a reset must come out zeroed again.
+      bitarray_arena_reset(arena);
+    }
+    struct fuzz_subject subject;
+    if (fd < 0 && kind == FUZZ_KIND_MMAP) {
+      continue;
+    }
+    if (!fuzz_subject_new(&subject, kind, bit_sz, arena, path)) {
+      fuzz_fail(FUZZ_NEW, "cannot make a %zu-bit %s array", bit_sz, fuzz_kind_names[kind]);
+      continue;
+    }
+    fuzz_cases[FUZZ_NEW]++;
+    if (fuzz_check_bits(&subject, FUZZ_NEW, "creation")) {
+      fuzz_randomize(subject.bitarray, subject.ref, bit_sz);
+      for (size_t step = 0; step < FUZZ_STEPS; step++) {
+        fuzz_step(&subject);
+      }
+    }
+    fuzz_subject_free(&subject);
+
+    if (fd >= 0 && fuzz_round % 8 == 0) {
+      fuzz_rotate_file(path);
+    }
+    fuzz_bundle();
+  }
+  remove(path);
+  bitarray_arena_free(arena);
+  bitarray_set_rotate_engine(engine);
+  bitarray_set_thread_count(thread_count);
+  bitarray_set_parallel_threshold(FUZZ_PARALLEL_THRESHOLD);
+  bitarray_set_scratch_threshold(FUZZ_SCRATCH_THRESHOLD);
+  bitarray_set_streaming_threshold(streaming_threshold);
+  bitarray_set_block_bytes(block_bytes);
+
+  bool passed = true;
+  for (size_t check = 0; check < FUZZ_CHECK_COUNT; check++) {
+    if (fuzz_failures[check] == 0) {
+      fprintf(stderr, " --> fuzz %s, %zu cases: PASS\n", fuzz_check_names[check],
+              fuzz_cases[check]);
+    } else {
+      fprintf(stderr, " --> fuzz %s, %zu of %zu cases: FAIL\n", fuzz_check_names[check],
+              fuzz_failures[check], fuzz_cases[check]);
+      passed = false;
+    }
+  }
+  fprintf(stderr, "Done fuzzing.\n");
+  return passed;
+}
+
 static bool boolfromchar(const char c) {
   assert(c == '0' || c == '1');
   return c == '1';
@@ -344,6 +1947,11 @@ void parse_and_run_tests(const char* filename, int selected_test) {
   int test = -1;
   int line = 0;
   bool ready_to_run = false;
+
+  // Rotations queued by b lines, run as one batch by the next other command.
+  bitarray_rotation_t* batch = NULL;
+  size_t batch_count = 0;
+  size_t batch_capacity = 0;
   if (f == NULL) {
     fprintf(stderr, "Error opening file.\n");
     return;
@@ -351,6 +1959,10 @@ void parse_and_run_tests(const char* filename, int selected_test) {
   while (getline(&buf, &bufsize, f) != -1) {
     line++;
     char* token = strtok(buf, " ");
+    if (batch_count > 0 && token[0] != 'b' && token[0] != '#' && token[0] != '\n') {
+      testutil_rotate_batch(batch, batch_count);
+      batch_count = 0;
+    }
     switch (token[0]) {
     case '\n':
     case '#':
@@ -391,10 +2003,34 @@ void parse_and_run_tests(const char* filename, int selected_test) {
         testutil_rotate(offset, length, amount);
       }
       break;
+    case 'b':
+      if (!ready_to_run) {
+        continue;
+      }
+      {
+        size_t offset = (size_t) NEXT_ARG_LONG();
+        size_t length = (size_t) NEXT_ARG_LONG();
+        ssize_t amount = (ssize_t) NEXT_ARG_LONG();
+        testutil_require_valid_input(offset, length, amount, filename, line);
+        if (batch_count == batch_capacity) {
+          batch_capacity = 2 * batch_capacity + 16;
+          batch = realloc(batch, batch_capacity * sizeof(bitarray_rotation_t));
+          assert(batch != NULL);
+        }
+        batch[batch_count].bit_offset = offset;
+        batch[batch_count].bit_length = length;
+        batch[batch_count].bit_right_amount = amount;
+        batch_count++;
+      }
+      break;
     default:
       fprintf(stderr, "Unknown command %s", buf);
     }
   }
+  if (batch_count > 0) {
+    testutil_rotate_batch(batch, batch_count);
+  }
+  free(batch);
   free(buf);
 
   fprintf(stderr, "Done testing file %s.\n", filename);
@@ -34,10 +34,42 @@
 
 // ******************************* Prototypes *******************************
 
+// Selects the storage backend of the bit arrays that later tests and timed
+// rotations create.  The default is BITARRAY_BACKEND_PACKED.
+void testutil_set_backend(const bitarray_backend_t backend);
+
 // Will run increasingly larger test cases, until a test case takes longer
 // than time_limit_seconds to complete.
 int timed_rotation(const double time_limit_seconds);
 
+// Like timed_rotation, but each tier's bit array is written to the file at
+// path and rotated there with bitarray_rotate_file.  Tiers stop growing
+// when the file cannot be written.  The file is removed afterwards.
+int timed_file_rotation(const double time_limit_seconds, const char* const path);
+
+
+// Measures where the streaming mode of bitarray_rotate and
+// bitarray_copy_range starts to pay off on this machine: times an unaligned
+// rotation plus a shifted copy at doubling array sizes, with streaming forced
+// off and forced on, and prints both.  The crossover is the smallest size
+// from which streaming wins at every larger size tried.  Installs it with
+// bitarray_set_streaming_threshold and returns it, in bits (SIZE_MAX if
+// streaming never won).
+size_t calibrate_streaming_threshold(void);
+
+// Rotates item_count random 48-bit bit arrays by per-item amounts, first one
+// at a time with bitarray_rotate and then in lockstep with
+// bitarray_bundle_rotate_each, and prints the throughput of each in items
+// per second, along with that of bitarray_bundle_rotate and
+// bitarray_bundle_reverse_each.  Returns false if the lockstep rotation
+// disagreed with bitarray_rotate.
+bool timed_bundle_rotation(const size_t item_count);
+
+// Runs rounds rounds of random operations on bit arrays of random sizes and
+// checks every result against a bit-by-bit reference kept in an array of
+// bools.  Prints PASS or FAIL for each function checked and returns true if
+// all passed.
+bool fuzz_operations(const size_t rounds);
 
 // Runs the testsuite specified in a given file.
 void parse_and_run_tests(const char* filename, int min_test);